@@ -17,8 +17,8 @@ int is_unbounded = 1;
 #define STRICT_ISO 0
 #endif
 
-int rand_init = 0;
-gmp_randstate_t rand_state;
+THREAD_LOCAL int rand_init = 0;
+THREAD_LOCAL gmp_randstate_t rand_state;
 
 
 int arith_compare(word a, word b);
@@ -143,6 +143,12 @@ int evaluate(word a, number* n)
 {
    if (TAGOF(a) == VARIABLE_TAG)
       return instantiation_error();
+   else if (IS_SMALLINT(a))
+   {
+      n->type = IntegerType;
+      n->i = SMALLINT_VALUE(a);
+      return 1;
+   }
    else if (TAGOF(a) == CONSTANT_TAG)
    {
       int type;
@@ -1305,3 +1311,96 @@ int arith_compare(word a, word b)
    }
    return 0;
 }
+
+// Returns 1 and sets *d if w is a small integer or a float, so that it can be used in the fast path of the compiled instructions below
+int fast_float(word w, double* d)
+{
+   if (IS_SMALLINT(w))
+      *d = (double)SMALLINT_VALUE(w);
+   else if (TAGOF(w) == CONSTANT_TAG && getConstantType(w) == FLOAT_TYPE)
+      *d = getConstant(w, NULL).float_data->data;
+   else
+      return 0;
+   return 1;
+}
+
+/* These implement the compiled arithmetic instructions (A_ADD and friends, see compile_arithmetic() in compiler.c). The common cases, where
+   the operands are small integers or floats, are computed directly. Anything else (including a result which would overflow) is built back
+   into a term and handed to evaluate(), which knows about bigints and rationals and raises the appropriate errors.
+   b is ignored if functor is unary. Both return 0 if an exception was raised.
+*/
+int evaluate_operation(word functor, word a, word b, word* result)
+{
+   if (IS_SMALLINT(a) && (functor == negateFunctor || IS_SMALLINT(b)))
+   {
+      // Small integers have 3 bits of headroom, so only multiplication can overflow an intptr_t
+      intptr_t x = SMALLINT_VALUE(a);
+      intptr_t y = SMALLINT_VALUE(b);
+      intptr_t r;
+      if (functor == addFunctor)
+         r = x + y;
+      else if (functor == subtractFunctor)
+         r = x - y;
+      else if (functor == negateFunctor)
+         r = -x;
+      else if (functor == multiplyFunctor)
+      {
+         if (__builtin_mul_overflow(x, y, &r))
+            goto slow;
+      }
+      else if (functor == intDivFunctor && y != 0)
+         r = x / y;
+      else
+         goto slow;
+      *result = MAKE_INTEGER(r);
+      return 1;
+   }
+   else if (functor != intDivFunctor)
+   {
+      double x, y, r;
+      if (!fast_float(a, &x))
+         goto slow;
+      if (functor == negateFunctor)
+         r = -x;
+      else
+      {
+         if (!fast_float(b, &y))
+            goto slow;
+         if (functor == addFunctor)
+            r = x + y;
+         else if (functor == subtractFunctor)
+            r = x - y;
+         else
+            r = x * y;
+      }
+      // Two small integers were handled above, so if we get here then one of the operands was a float. Overflow must raise an error
+      if (r == INFINITY || r == -INFINITY)
+         goto slow;
+      *result = MAKE_FLOAT(r);
+      return 1;
+   }
+slow:
+   if (functor == negateFunctor)
+      return evaluate_term(MAKE_VCOMPOUND(functor, a), result);
+   return evaluate_term(MAKE_VCOMPOUND(functor, a, b), result);
+}
+
+// Sets *result to -1, 0 or 1 like arith_compare(). Unlike arith_compare(), the return value says whether an exception was raised
+int compare_numbers(word a, word b, int* result)
+{
+   double fa, fb;
+   if (IS_SMALLINT(a) && IS_SMALLINT(b))
+   {
+      intptr_t x = SMALLINT_VALUE(a);
+      intptr_t y = SMALLINT_VALUE(b);
+      *result = (x > y) - (x < y);
+      return 1;
+   }
+   else if (fast_float(a, &fa) && fast_float(b, &fb))
+   {
+      *result = (fa > fb)?1:(fa == fb)?0:-1;
+      return 1;
+   }
+   *result = arith_compare(a, b);
+   return getException() == 0;
+}
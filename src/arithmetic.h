@@ -25,6 +25,8 @@ double toFloatAndFree(number n);
 int arith_compare(word a, word b);
 int evaluate_term(word expr, word* result);
 int evaluate(word a, number* n);
+int evaluate_operation(word functor, word a, word b, word* result);
+int compare_numbers(word a, word b, int* result);
 
 
 #endif
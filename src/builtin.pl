@@ -1,110 +1,57 @@
-% setof/3, bagof/3, findall/3 and findall/4 as implemented by Richard O'Keefe and David Warren.
-% http://www.j-paine.org/prolog/tools/files/setof.pl
 
 :-meta_predicate(findall(?, 0, -)).
 :-meta_predicate(findall(?, 0, -, ?)).
 :-meta_predicate(setof(?, ^, -)).
 :-meta_predicate(bagof(?, ^, -)).
 
+% findall/3 and findall/4 copy each solution into a bag (see findall.c) rather than the recorded database, and then copy the whole
+% list onto the heap at once
 findall(Template, Generator, List) :-
-	save_instances(-Template, Generator),
-	list_instances([], List).
+        findall(Template, Generator, List, []).
+
+findall(Template, Generator, List, Tail) :-
+        strip_existential(Generator, Goal),
+        '$bag_create'(Bag),
+        (  catch(Goal, Exception, ('$bag_free'(Bag), throw(Exception))),
+           '$bag_add'(Bag, Template),
+           fail
+        ;  '$bag_collect'(Bag, Tail, List)
+        ).
 
-findall(Template, Generator, List, SoFar) :-
-	save_instances(-Template, Generator),
-	list_instances(SoFar, List).
+strip_existential(Generator, _) :-
+        var(Generator),
+        throw(error(instantiation_error, _)).
+strip_existential(Module:Generator, Module:Goal) :-
+        !,
+        strip_existential(Generator, Goal).
+strip_existential(_^Generator, Goal) :-
+        !,
+        strip_existential(Generator, Goal).
+strip_existential(Goal, Goal).
 
-setof(Template, Filter, Set) :-
-        bagof(Template, Filter, Bag),
-	sort(Bag, Set).
+% bagof/3 and setof/3 find all the solutions at once with findall/3, and then $group_solutions/3 groups them by the bindings of the free
+% variables of the goal (the witness)
+setof(Template, Generator, Set) :-
+        collect_groups(Template, Generator, true, Set).
 
 bagof(Template, Generator, Bag) :-
+        collect_groups(Template, Generator, false, Bag).
+
+collect_groups(Template, Generator, Sort, Result) :-
         free_variables(Generator, Template, [], Vars),
         Vars \== [],
-	!,
-	Key =.. [.|Vars],
-	functor(Key, ., N),
-        save_instances(Key-Template, Generator),
-	list_instances(Key, N, [], OmniumGatherum),
-        keysort(OmniumGatherum, Gamut), !,
-	concordant_subset(Gamut, Key, Answer),
-	Bag = Answer.
-bagof(Template, Generator, Bag) :-
-	save_instances(-Template, Generator),
-	list_instances([], Bag),
-        Bag \== [].
-save_instances(_Template, Generator) :-
-        var(Generator),
-        throw(error(instantiation_error, _)).
-save_instances(_Template, _:Generator) :-
-        var(Generator),
-        throw(error(instantiation_error, _)).
-save_instances(Template, Module:A^Goal) :-
-        !,
-        save_instances(Template, Module:Goal).
-save_instances(Template, _^Generator) :-
         !,
-        save_instances(Template, Generator).
-
-save_instances(Template, Generator) :-
-        recorda(., -, _),
-        catch(Generator,
-              Exception,
-              ( list_instances([], _),
-                throw(Exception)
-              )),
-        recorda(., Template, _),
-	fail.
-save_instances(_, _).
-
-
-list_instances(SoFar, Total) :-
-        recorded(., Term, Ref),
-	erase(Ref), !,		%   must not backtrack
-	list_instances(Term, SoFar, Total).
-
-list_instances(-, SoFar, Total) :- !,
-	Total = SoFar.		%   = delayed in case Total was bound
-list_instances(-Template, SoFar, Total) :-
-	list_instances([Template|SoFar], Total).
-
-list_instances(Key, NVars, OldBag, NewBag) :-
-        recorded(., Term, Ref),
-	erase(Ref), !,		%  must not backtrack!
-	list_instances(Term, Key, NVars, OldBag, NewBag).
-
-list_instances(-, _, _, AnsBag, AnsBag) :- !.
-list_instances(NewKey-Term, Key, NVars, OldBag, NewBag) :-
-        replace_key_variables(NVars, Key, NewKey), !,
-        list_instances(Key, NVars, [NewKey-Term|OldBag], NewBag).
-
-replace_key_variables(0, _, _) :- !.
-replace_key_variables(N, OldKey, NewKey) :-
-	arg(N, NewKey, Arg),
-	nonvar(Arg), !,
-	M is N-1,
-	replace_key_variables(M, OldKey, NewKey).
-replace_key_variables(N, OldKey, NewKey) :-
-	arg(N, OldKey, OldVar),
-	arg(N, NewKey, OldVar),
-	M is N-1,
-	replace_key_variables(M, OldKey, NewKey).
-
-
-concordant_subset([Key-Val|Rest], Clavis, Answer) :-
-	concordant_subset(Rest, Key, List, More),
-	concordant_subset(More, Key, [Val|List], Clavis, Answer).
-
-concordant_subset([Key-Val|Rest], Clavis, [Val|List], More) :-
-	Key == Clavis,
-	!,
-	concordant_subset(Rest, Clavis, List, More).
-concordant_subset(More, _, [], More).
-
-concordant_subset([],   Key, Subset, Key, Subset) :- !.
-concordant_subset(_,    Key, Subset, Key, Subset).
-concordant_subset(More, _,   _,   Clavis, Answer) :-
-        concordant_subset(More, Clavis, Answer).
+        Witness =.. [.|Vars],
+        findall(Witness-Template, Generator, Pairs),
+        '$group_solutions'(Pairs, Sort, Groups),
+        member(Witness-Result, Groups).
+collect_groups(Template, Generator, Sort, Result) :-
+        findall(Template, Generator, Bag),
+        Bag \== [],
+        (  Sort == true
+        -> sort(Bag, Result)
+        ;  Result = Bag
+        ).
 
 % free_variables/4 is written by Richard O'Keefe, and Jan Wielemaker, and is licensed in the public domain
 free_variables(Term, Bound, VarList, [Term|VarList]) :-
@@ -158,8 +105,7 @@ recorded(Key, Term):-
         recorded(Key, Term, _).
 
 :-meta_predicate(call(0)).
-call(X):- var(X), throw(error(instantiation_error, _)).
-call(_:X):- var(X), throw(error(instantiation_error, _)).
+% A variable goal raises an instantiation error when it is called, so there is no need to check for one here
 call(X):- X.
 
 :-meta_predicate(once(0)).
@@ -280,27 +226,11 @@ reverse([B|A], C, D, [_|E]) :-
 phrase(Rule, Input):-
         phrase(Rule, Input, []).
 
-% Without goal expansion, we have to implement predicates for lists and , so that things like
-% phrase((foo, [65], bar), Codes)
-% will work.
-:-meta_predicate(','(2, 2, ?, ?)).
-'[]'(Tail, Tail).
-'.'(Head, Tail, [Head|Input], Output):- call(Tail, Input, Output).
-','(Goal1, Goal2, Input, Output):-
-        call(Goal1, Input, Intermediate),
-        call(Goal2, Intermediate, Output).
-
+% The grammar body is translated just as the body of a grammar rule is when it is consulted, so that
+% phrase((foo, [65], bar), Codes) calls foo//0 and bar//0 directly
 phrase(Rule, Input, Tail):-
-        ( Rule = Module:InGoal->
-            InGoal =.. [Name|Args],
-            append(Args, [Input, Tail], NewArgs),
-            Goal =.. [Name|NewArgs],
-            call(Module:Goal)
-        ; Rule =.. [Name|Args],
-          append(Args, [Input, Tail], NewArgs),
-          Goal =.. [Name|NewArgs],
-          call(Goal)
-        ).
+        '$dcg_body'(Rule, Input, Tail, Goal),
+        call(Goal).
 
 atomic_list_concat(A, B):-
         atomic_list_concat(A, '', B).
@@ -400,36 +330,19 @@ aggregate_all(Var, _, _) :-
 	var(Var), !,
 	instantiation_error(Var).
 aggregate_all(count, Goal, Count) :- !,
-	aggregate_all(sum(1), Goal, Count).
+        (  aggregate_all_values(count, _, Goal, Count0)
+        -> Count = Count0
+        ;  Count = 0
+        ).
 aggregate_all(sum(X), Goal, Sum) :- !,
-	State = state(0),
-	(  call(Goal),
-	   arg(1, State, S0),
-	   S is S0 + X,
-	   nb_setarg(1, State, S),
-	   fail
-	;  arg(1, State, Sum)
-	).
+        (  aggregate_all_values(sum, X, Goal, Sum0)
+        -> Sum = Sum0
+        ;  Sum = 0
+        ).
 aggregate_all(max(X), Goal, Max) :- !,
-	State = state(X),
-	(  call(Goal),
-	   arg(1, State, M0),
-	   M is max(M0,X),
-	   nb_setarg(1, State, M),
-	   fail
-	;  arg(1, State, Max),
-	   nonvar(Max)
-	).
+        aggregate_all_values(max, X, Goal, Max).
 aggregate_all(min(X), Goal, Min) :- !,
-	State = state(X),
-	(  call(Goal),
-	   arg(1, State, M0),
-	   M is min(M0,X),
-	   nb_setarg(1, State, M),
-	   fail
-	;  arg(1, State, Min),
-	   nonvar(Min)
-	).
+        aggregate_all_values(min, X, Goal, Min).
 aggregate_all(max(X,W), Goal, max(Max,Witness)) :- !,
 	State = state(false, _Max, _Witness),
 	(  call(Goal),
@@ -481,6 +394,14 @@ aggregate_all(Template, Discriminator, Goal0, Result) :-
 	pairs_values(Pairs, List),
 	aggregate_list(Aggregate, List, Result).
 
+% Keeps a running count, sum, maximum or minimum of X over the solutions of Goal in a bag. Fails if there are none
+aggregate_all_values(Op, X, Goal, Value) :-
+        '$bag_create'(Bag),
+        (  catch((Goal, '$bag_aggregate'(Bag, Op, X)), Exception, ('$bag_free'(Bag), throw(Exception))),
+           fail
+        ;  '$bag_value'(Bag, Value)
+        ).
+
 template_to_pattern(All, Template, Pattern, Goal0, Goal, Aggregate) :-
 	template_to_pattern(Template, Pattern, Post, Vars, Aggregate),
 	existential_vars(Goal0, Goal1, AllVars, Vars),
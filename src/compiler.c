@@ -7,8 +7,11 @@
 #include "ctable.h"
 #include "errors.h"
 #include "constants.h"
+#include "local.h"
+#include "threads.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 
@@ -126,7 +129,7 @@ instruction_t* INSTRUCTION_SLOT(unsigned char opcode, int slot)
    i->constant = (word)-1;
    i->slot = slot;
    i->address = -1;
-   i->size = 3;
+   i->size = 2;
    i->constant_count = 0;
    return i;
 }
@@ -138,7 +141,7 @@ instruction_t* INSTRUCTION_FUNC_SLOT(unsigned char opcode, int(*func)(), int slo
    i->constant = (word)-1;
    i->slot = slot;
    i->address = (uintptr_t)func;
-   i->size = 3+sizeof(word);
+   i->size = 3;
    i->constant_count = 0;
    return i;
 }
@@ -151,7 +154,7 @@ instruction_t* INSTRUCTION_SLOT_ADDRESS(unsigned char opcode, int slot, uintptr_
    i->constant = (word)-1;
    i->slot = slot;
    i->address = address;
-   i->size = 3+sizeof(word);
+   i->size = 3;
    i->constant_count = 0;
    return i;
 }
@@ -163,7 +166,7 @@ instruction_t* INSTRUCTION_ADDRESS(unsigned char opcode, uintptr_t address)
    i->constant = (word)-1;
    i->slot = -1;
    i->address = address;
-   i->size = 1+sizeof(word);
+   i->size = 2;
    i->constant_count = 0;
    return i;
 }
@@ -177,7 +180,7 @@ instruction_t* INSTRUCTION_CONST(unsigned char opcode, word constant)
    i->constant = constant;
    i->slot = -1;
    i->address = -1;
-   i->size = 3;
+   i->size = 2;
    i->constant_count = 1;
    return i;
 }
@@ -271,7 +274,10 @@ int compile_argument(word arg, wmap_t variables, instruction_list_t* instruction
    }
    else if (TAGOF(arg) == COMPOUND_TAG)
    {
-      push_instruction(instructions, INSTRUCTION_CONST(H_FUNCTOR, FUNCTOROF(arg)));
+      if (FUNCTOROF(arg) == listFunctor)
+         push_instruction(instructions, INSTRUCTION(H_LIST));
+      else
+         push_instruction(instructions, INSTRUCTION_CONST(H_FUNCTOR, FUNCTOROF(arg)));
       Functor f = getConstant(FUNCTOROF(arg), NULL).functor_data;
       for (int i = 0; i < f->arity; i++)
          compile_argument(ARGOF(arg, i), variables, instructions, 1);
@@ -352,11 +358,12 @@ int compile_term_creation(word term, wmap_t variables, instruction_list_t* instr
       }
       else if (TAGOF(term) == COMPOUND_TAG)
       {
+         int is_list = (FUNCTOROF(term) == listFunctor);
          if (isFinalArg)
-            size += push_instruction(instructions, INSTRUCTION_CONST(B_RFUNCTOR, FUNCTOROF(term)));
+            size += push_instruction(instructions, is_list?INSTRUCTION(B_RLIST):INSTRUCTION_CONST(B_RFUNCTOR, FUNCTOROF(term)));
          else
          {
-            size += push_instruction(instructions, INSTRUCTION_CONST(B_FUNCTOR, FUNCTOROF(term)));
+            size += push_instruction(instructions, is_list?INSTRUCTION(B_LIST):INSTRUCTION_CONST(B_FUNCTOR, FUNCTOROF(term)));
             needs_bpop++;
          }
          isFinalArg = 0;
@@ -369,8 +376,9 @@ int compile_term_creation(word term, wmap_t variables, instruction_list_t* instr
          term = ARGOF(term, f->arity-1);
          continue;
       }
-      else if (TAGOF(term) == CONSTANT_TAG)
+      else if (TAGOF(term) == CONSTANT_TAG || TAGOF(term) == POINTER_TAG)
       {
+         // Pointers (such as database references) can appear in goals passed to call/1. They are put in the constant table too
          size += push_instruction(instructions, INSTRUCTION_CONST(B_ATOM, term));
          break;
       }
@@ -384,6 +392,63 @@ int compile_term_creation(word term, wmap_t variables, instruction_list_t* instr
    return size;
 }
 
+int arithmetic_opcode(word functor)
+{
+   if (functor == addFunctor)
+      return A_ADD;
+   if (functor == subtractFunctor)
+      return A_SUBTRACT;
+   if (functor == multiplyFunctor)
+      return A_MULTIPLY;
+   if (functor == intDivFunctor)
+      return A_INTDIV;
+   if (functor == negateFunctor)
+      return A_NEGATE;
+   return -1;
+}
+
+int comparison_opcode(word functor)
+{
+   if (functor == arithmeticEqualFunctor)
+      return A_EQUAL;
+   if (functor == arithmeticNotEqualFunctor)
+      return A_NOT_EQUAL;
+   if (functor == lessThanFunctor)
+      return A_LESS;
+   if (functor == lessThanOrEqualFunctor)
+      return A_LESS_EQUAL;
+   if (functor == greaterThanFunctor)
+      return A_GREATER;
+   if (functor == greaterThanOrEqualFunctor)
+      return A_GREATER_EQUAL;
+   return -1;
+}
+
+// Compile code that leaves the value of expr on top of the argument stack. The operations in arithmetic_opcode() are done inline, numbers
+// are just pushed, and anything else (including a variable, which will only be bound at runtime) is built as a term and passed to A_EVAL
+int compile_arithmetic(word expr, wmap_t variables, instruction_list_t* instructions)
+{
+   int size = 0;
+   expr = DEREF(expr);
+   if (TAGOF(expr) == COMPOUND_TAG && arithmetic_opcode(FUNCTOROF(expr)) != -1)
+   {
+      Functor f = getConstant(FUNCTOROF(expr), NULL).functor_data;
+      for (int i = 0; i < f->arity; i++)
+         size += compile_arithmetic(ARGOF(expr, i), variables, instructions);
+      size += push_instruction(instructions, INSTRUCTION(arithmetic_opcode(FUNCTOROF(expr))));
+   }
+   else if (TAGOF(expr) == CONSTANT_TAG && (IS_SMALLINT(expr) || getConstantType(expr) == INTEGER_TYPE || getConstantType(expr) == FLOAT_TYPE))
+   {
+      size += push_instruction(instructions, INSTRUCTION_CONST(B_ATOM, expr));
+   }
+   else
+   {
+      size += compile_term_creation(expr, variables, instructions, 0, 0, 0);
+      size += push_instruction(instructions, INSTRUCTION(A_EVAL));
+   }
+   return size;
+}
+
 int compile_body(word term, wmap_t variables, instruction_list_t* instructions, int is_tail, int* next_reserved, int local_cut, int* sizep)
 {
    int rc = 1;
@@ -550,12 +615,18 @@ int compile_body(word term, wmap_t variables, instruction_list_t* instructions,
          //    c_cut
          //    i_fail
          // N: (rest of the clause)
+         // We only ever get to N by backtracking over A, so any variable first seen in A is still fresh afterwards. A is compiled against
+         // a copy of the variables so that this is the case: otherwise the slot would be left pointing at a cell made after the choicepoint,
+         // and since bindings of such cells are not trailed it would not be reset
          int cut_point = (*next_reserved)++;
          int s1 = 0;
          instruction_t* if_then_else = INSTRUCTION_SLOT_ADDRESS(C_IF_THEN_ELSE, cut_point, -1);
          s1 += push_instruction(instructions, if_then_else);
+         wmap_t varcopy = whashmap_copy(variables, _copy_varinfo);
          // If
-         rc &= compile_body(ARGOF(term, 0), variables, instructions, 0, next_reserved, cut_point, &s1);
+         rc &= compile_body(ARGOF(term, 0), varcopy, instructions, 0, next_reserved, cut_point, &s1);
+         whashmap_iterate(varcopy, free_varinfo, NULL);
+         whashmap_free(varcopy);
          // (cut)
          s1 += push_instruction(instructions, INSTRUCTION_SLOT(C_CUT, cut_point));
          // Then
@@ -612,6 +683,34 @@ int compile_body(word term, wmap_t variables, instruction_list_t* instructions,
          if (is_tail)
             size += push_instruction(instructions, INSTRUCTION(I_EXIT));
       }
+      else if (FUNCTOROF(term) == isFunctor)
+      {
+         word result = DEREF(ARGOF(term, 0));
+         var_info_t* varinfo;
+         size += compile_arithmetic(ARGOF(term, 1), variables, instructions);
+         if (TAGOF(result) == VARIABLE_TAG && whashmap_get(variables, result, (any_t)&varinfo) == MAP_OK && varinfo->fresh)
+         {
+            // The slot will hold a number, so it is always safe
+            size += push_instruction(instructions, INSTRUCTION_SLOT(A_FIRSTVAR, varinfo->slot));
+            varinfo->fresh = 0;
+            varinfo->guaranteed_safe = 1;
+         }
+         else
+         {
+            size += compile_term_creation(result, variables, instructions, 0, 0, 0);
+            size += push_instruction(instructions, INSTRUCTION(I_UNIFY));
+         }
+         if (is_tail)
+            size += push_instruction(instructions, INSTRUCTION(I_EXIT));
+      }
+      else if (comparison_opcode(FUNCTOROF(term)) != -1)
+      {
+         size += compile_arithmetic(ARGOF(term, 0), variables, instructions);
+         size += compile_arithmetic(ARGOF(term, 1), variables, instructions);
+         size += push_instruction(instructions, INSTRUCTION(comparison_opcode(FUNCTOROF(term))));
+         if (is_tail)
+            size += push_instruction(instructions, INSTRUCTION(I_EXIT));
+      }
       else
       {
          Functor f = getConstant(FUNCTOROF(term), NULL).functor_data;
@@ -629,19 +728,52 @@ int compile_body(word term, wmap_t variables, instruction_list_t* instructions,
    return rc;
 }
 
+// Returns 1 if compile_body() would compile term to nothing more than a call of its functor with its arguments. Such a goal can be
+// called by I_USERCALL without being compiled at all
+int is_plain_goal(word term)
+{
+   term = DEREF(term);
+   if (TAGOF(term) == CONSTANT_TAG)
+      return !IS_SMALLINT(term) && getConstantType(term) == ATOM_TYPE && term != cutAtom && term != trueAtom && term != catchAtom && term != failAtom;
+   if (TAGOF(term) != COMPOUND_TAG)
+      return 0;
+   word functor = FUNCTOROF(term);
+   return functor != conjunctionFunctor && functor != disjunctionFunctor && functor != notFunctor && functor != throwFunctor &&
+      functor != crossModuleCallFunctor && functor != cleanupChoicepointFunctor && functor != localCutFunctor &&
+      functor != notUnifiableFunctor && functor != unifyFunctor && functor != isFunctor && comparison_opcode(functor) == -1;
+}
+
 
 
+// Appends the variables in term to list, in the order they first appear
 void find_variables(word term, List* list)
 {
-   term = DEREF(term);
-   if (TAGOF(term) == VARIABLE_TAG && !list_contains(list, term))
-      list_append(list, term);
-   else if (TAGOF(term) == COMPOUND_TAG)
+   TermStack stack;
+   VariableMap seen;
+   init_term_stack(&stack);
+   init_variable_map(&seen);
+   push_term(&stack, term);
+   while (stack.size > 0)
    {
-      Functor f = getConstant(FUNCTOROF(term), NULL).functor_data;
-      for (int i = 0; i < f->arity; i++)
-         find_variables(ARGOF(term, i), list);
+      term = DEREF(stack.items[--stack.size]);
+      if (TAGOF(term) == VARIABLE_TAG)
+      {
+         Word found = variable_map_lookup(&seen, term);
+         if (*found == 0)
+         {
+            *found = 1;
+            list_append(list, term);
+         }
+      }
+      else if (TAGOF(term) == COMPOUND_TAG)
+      {
+         Functor f = getConstant(FUNCTOROF(term), NULL).functor_data;
+         for (int i = f->arity-1; i >= 0; i--)
+            push_term(&stack, ARGOF(term, i));
+      }
    }
+   free_variable_map(&seen);
+   free_term_stack(&stack);
 }
 
 
@@ -710,12 +842,15 @@ typedef struct
    int ip;
    int codep;
    wmap_t constants;
+   int has_calls;
 } compile_context_t;
 
 void build_asm_context(void* c, instruction_t* i)
 {
    compile_context_t* context = ((compile_context_t*)c);
    context->size += i->size;
+   if (i->opcode == I_CALL || i->opcode == I_DEPART)
+      context->has_calls = 1;
    any_t tmp;
    for (long j = 0; j < i->constant_count; j++)
    {
@@ -735,72 +870,52 @@ void _assemble(void *p, instruction_t* i)
    {
       long index;
       assert(whashmap_get(context->constants, i->constant, (void*)&index) == MAP_OK);
-      assert(index < (1 << 16) && "Too many constants in clause!");
       context->clause->constants[index] = i->constant;
-      context->clause->code[context->codep++] = (index >> 8) & 0xff;
-      context->clause->code[context->codep++] = (index >> 0) & 0xff;
+      context->clause->code[context->codep++] = index;
    }
    if (i->address != -1)
-   {
-      uintptr_t offset = i->address;
-      if (sizeof(word) == 4)
-      {
-         context->clause->code[context->codep++] = (offset >> 24) & 0xff;
-         context->clause->code[context->codep++] = (offset >> 16) & 0xff;
-         context->clause->code[context->codep++] = (offset >>  8) & 0xff;
-         context->clause->code[context->codep++] = (offset >>  0) & 0xff;
-      }
-      else if (sizeof(word) == 8)
-      {
-         context->clause->code[context->codep++] = (offset >> 56) & 0xff;
-         context->clause->code[context->codep++] = (offset >> 48) & 0xff;
-         context->clause->code[context->codep++] = (offset >> 40) & 0xff;
-         context->clause->code[context->codep++] = (offset >> 32) & 0xff;
-         context->clause->code[context->codep++] = (offset >> 24) & 0xff;
-         context->clause->code[context->codep++] = (offset >> 16) & 0xff;
-         context->clause->code[context->codep++] = (offset >>  8) & 0xff;
-         context->clause->code[context->codep++] = (offset >>  0) & 0xff;
-      }
-      else if (sizeof(word) == 2)
-      {
-         context->clause->code[context->codep++] = (offset >>  8) & 0xff;
-         context->clause->code[context->codep++] = (offset >>  0) & 0xff;
-      }
-      else
-         assert(0 && "What kind of CPU IS this?");
-
-
-   }
+      context->clause->code[context->codep++] = i->address;
    if (i->slot != -1)
-   {
-      assert(i->slot < (1 << 16));
-      context->clause->code[context->codep++] = (i->slot >> 8) & 0xff;
-      context->clause->code[context->codep++] = (i->slot >> 0) & 0xff;
-   }
+      context->clause->code[context->codep++] = i->slot;
 }
 
 Clause allocClause()
 {
    Clause c = malloc(sizeof(clause));
    c->next = NULL;
+   c->index = NULL;
+   c->call_cache = NULL;
+   c->prev = NULL;
+   c->source = NULL;
+   c->original = NULL;
+   c->copies = NULL;
+   c->index_arg = -1;
+   c->index_position = -1;
+   c->born = 0;
+   c->died = 0;
    return c;
 }
 
 Clause assemble(instruction_list_t* instructions)
 {
-   compile_context_t context = {0, 0, NULL, 0, 0, 0};
+   compile_context_t context = {0, 0, NULL, 0, 0, 0, 0};
    context.constants = whashmap_new();
    context.clause = allocClause();
    instruction_list_apply(instructions, &context, build_asm_context);
-   context.clause->code = malloc(context.size);
+   context.clause->code = malloc(context.size * sizeof(word));
    context.clause->constants = malloc(context.constant_count * sizeof(word));
+   if (context.has_calls)
+      context.clause->call_cache = calloc(context.constant_count, sizeof(struct call_cache*));
    //#ifdef DEBUG
    context.clause->code_size = context.size;
    context.clause->constant_size = context.constant_count;
    //#endif
    instruction_list_apply(instructions, &context, _assemble);
    for (int i = 0; i < context.constant_count; i++)
-      acquire_constant("compiled constant", context.clause->constants[i]);
+   {
+      if (TAGOF(context.clause->constants[i]) == CONSTANT_TAG)
+         acquire_constant("compiled constant", context.clause->constants[i]);
+   }
    whashmap_free(context.constants);
    assert(context.codep == context.size);
 
@@ -868,18 +983,32 @@ void set_variables(word variable, void* query)
    q->variables[q->variable_count++] = variable;
 }
 
+// Compiles '$query'(V1, ..., Vn):- term, where V1...Vn are the given variables. Returns NULL if term is not callable
+static Clause compile_query_clause(word term, List* variables)
+{
+   instruction_list_t instructions;
+   init_instruction_list(&instructions);
+   int slot_count;
+   if (!compile_clause(MAKE_VCOMPOUND(clauseFunctor, MAKE_LCOMPOUND(queryAtom, variables), term), &instructions, &slot_count))
+   {
+      deinit_instruction_list(&instructions);
+      return NULL;
+   }
+   Clause clause = assemble(&instructions);
+   clause->slot_count = slot_count;
+   deinit_instruction_list(&instructions);
+   return clause;
+}
+
 Query compile_query(word term)
 {
    //printf("Compiling query: "); PORTRAY(term); printf("\n");
-   instruction_list_t instructions;
    List variables;
    init_list(&variables);
-   init_instruction_list(&instructions);
    find_variables(term, &variables);
-   int slot_count;
-   if (!compile_clause(MAKE_VCOMPOUND(clauseFunctor, MAKE_LCOMPOUND(queryAtom, &variables), term), &instructions, &slot_count))
+   Clause clause = compile_query_clause(term, &variables);
+   if (clause == NULL)
    {
-      deinit_instruction_list(&instructions);
       free_list(&variables);
       return NULL;
    }
@@ -887,13 +1016,205 @@ Query compile_query(word term)
    q->variable_count = 0;
    q->variables = malloc(sizeof(word) * list_length(&variables));
    list_apply(&variables, q, set_variables);
-   q->clause = assemble(&instructions);
-   q->clause->slot_count = slot_count;
-   deinit_instruction_list(&instructions);
+   q->clause = clause;
    free_list(&variables);
    return q;
 }
 
+/* A goal called through call/N is compiled to a clause like a query, but the clause only depends on the shape of the goal: the control
+   constructs in it, the functors of the goals inside those, and the modules they are called in. Everything else is passed in as an
+   argument, so that call(foo(X, 1)) and call(foo(a, Y)) are both run by '$query'(A, B):- foo(A, B). The shape is a list of words made by
+   walking the goal: the functor of each compound, each atom, the module of each M:G, and 0 for a variable goal. Clauses are kept for
+   the shapes that have been seen, and are never freed or changed once they are in the table, so it can be read without locking.
+*/
+
+#define META_CALL_BUCKETS 256
+#define META_CALL_LIMIT 4096        // Once there are this many shapes, goals of new shapes are compiled each time they are called
+#define META_CALL_MAX_SHAPE 64
+#define META_CALL_MAX_ARGS 256
+
+struct meta_call
+{
+   struct meta_call* next;
+   Clause clause;
+   int length;
+   word shape[];
+};
+
+struct meta_call_shape
+{
+   word shape[META_CALL_MAX_SHAPE];
+   int length;
+   word* args;
+   int arg_count;
+};
+
+static struct meta_call* meta_calls[META_CALL_BUCKETS];
+static int meta_call_count = 0;
+
+// The control constructs which compile_body() compiles inline. The arguments of anything else are passed as arguments of the query
+static int is_meta_control(word functor)
+{
+   return functor == conjunctionFunctor || functor == disjunctionFunctor || functor == localCutFunctor || functor == notFunctor;
+}
+
+// Adds the shape of goal, putting its arguments into shape->args. Returns 0 if the goal is too big, or is not something that can be
+// called, in which case it is just compiled as a query
+static int meta_call_shape(word goal, struct meta_call_shape* shape)
+{
+   goal = DEREF(goal);
+   if (shape->length == META_CALL_MAX_SHAPE)
+      return 0;
+   if (TAGOF(goal) == VARIABLE_TAG)
+   {
+      if (shape->arg_count == META_CALL_MAX_ARGS)
+         return 0;
+      shape->shape[shape->length++] = 0;
+      shape->args[shape->arg_count++] = goal;
+      return 1;
+   }
+   if (TAGOF(goal) == CONSTANT_TAG)
+   {
+      if (IS_SMALLINT(goal) || getConstantType(goal) != ATOM_TYPE)
+         return 0;
+      shape->shape[shape->length++] = goal;
+      return 1;
+   }
+   if (TAGOF(goal) != COMPOUND_TAG)
+      return 0;
+   word functor = FUNCTOROF(goal);
+   int arity = FUNCTOR_ARITY(functor);
+   shape->shape[shape->length++] = functor;
+   if (is_meta_control(functor))
+   {
+      for (int i = 0; i < arity; i++)
+         if (!meta_call_shape(ARGOF(goal, i), shape))
+            return 0;
+      return 1;
+   }
+   if (functor == crossModuleCallFunctor)
+   {
+      word module = ARGOF(goal, 0);
+      if (TAGOF(module) != CONSTANT_TAG || IS_SMALLINT(module) || getConstantType(module) != ATOM_TYPE || shape->length == META_CALL_MAX_SHAPE)
+         return 0;
+      shape->shape[shape->length++] = module;
+      return meta_call_shape(ARGOF(goal, 1), shape);
+   }
+   if (shape->arg_count + arity > META_CALL_MAX_ARGS)
+      return 0;
+   for (int i = 0; i < arity; i++)
+      shape->args[shape->arg_count++] = ARGOF(goal, i);
+   return 1;
+}
+
+// Makes a copy of goal with a fresh variable in place of each argument that meta_call_shape() takes out of it, appending them to params
+static word meta_call_skeleton(word goal, List* params)
+{
+   goal = DEREF(goal);
+   if (TAGOF(goal) == VARIABLE_TAG)
+   {
+      word var = MAKE_VAR();
+      list_append(params, var);
+      return var;
+   }
+   if (TAGOF(goal) != COMPOUND_TAG)
+      return goal;
+   word functor = FUNCTOROF(goal);
+   int arity = FUNCTOR_ARITY(functor);
+   word args[arity];
+   if (is_meta_control(functor))
+   {
+      for (int i = 0; i < arity; i++)
+         args[i] = meta_call_skeleton(ARGOF(goal, i), params);
+   }
+   else if (functor == crossModuleCallFunctor)
+   {
+      args[0] = ARGOF(goal, 0);
+      args[1] = meta_call_skeleton(ARGOF(goal, 1), params);
+   }
+   else
+   {
+      for (int i = 0; i < arity; i++)
+      {
+         args[i] = MAKE_VAR();
+         list_append(params, args[i]);
+      }
+   }
+   return MAKE_ACOMPOUND(functor, args);
+}
+
+static unsigned int meta_call_hash(word* shape, int length)
+{
+   uint64_t hash = 0;
+   for (int i = 0; i < length; i++)
+      hash = (hash ^ shape[i]) * 0x9E3779B97F4A7C15ull;
+   return (unsigned int)(hash >> 32) % META_CALL_BUCKETS;
+}
+
+static struct meta_call* find_meta_call(struct meta_call* m, word* shape, int length)
+{
+   for (; m != NULL; m = m->next)
+      if (m->length == length && memcmp(m->shape, shape, length * sizeof(word)) == 0)
+         return m;
+   return NULL;
+}
+
+// Returns the clause to run goal, and puts the arguments for it in args, setting *arg_count to how many there are. If *is_local is set
+// then the clause was made just for this call, and must be freed with free_clause() once it is finished with. Returns NULL if goal
+// is not callable
+Clause compile_meta_call(word goal, word* args, int* arg_count, int* is_local)
+{
+   struct meta_call_shape shape;
+   shape.length = 0;
+   shape.args = args;
+   shape.arg_count = 0;
+   if (!meta_call_shape(goal, &shape))
+   {
+      Query query = compile_query(goal);
+      if (query == NULL)
+         return NULL;
+      Clause clause = query->clause;
+      for (int i = 0; i < query->variable_count; i++)
+         args[i] = query->variables[i];
+      *arg_count = query->variable_count;
+      *is_local = 1;
+      free_query(query);
+      return clause;
+   }
+   *arg_count = shape.arg_count;
+   unsigned int bucket = meta_call_hash(shape.shape, shape.length);
+   struct meta_call* m = find_meta_call(ATOMIC_LOAD(&meta_calls[bucket]), shape.shape, shape.length);
+   if (m != NULL)
+   {
+      *is_local = 0;
+      return m->clause;
+   }
+   List params;
+   init_list(&params);
+   Clause clause = compile_query_clause(meta_call_skeleton(goal, &params), &params);
+   free_list(&params);
+   if (clause == NULL)
+      return NULL;
+   LOCK_GLOBALS();
+   if (meta_call_count == META_CALL_LIMIT || (m = find_meta_call(meta_calls[bucket], shape.shape, shape.length)) != NULL)
+   {
+      // Another thread got there first, or the table is full
+      UNLOCK_GLOBALS();
+      *is_local = 1;
+      return clause;
+   }
+   m = malloc(sizeof(struct meta_call) + shape.length * sizeof(word));
+   m->clause = clause;
+   m->length = shape.length;
+   memcpy(m->shape, shape.shape, shape.length * sizeof(word));
+   m->next = meta_calls[bucket];
+   meta_call_count++;
+   ATOMIC_STORE(&meta_calls[bucket], m);
+   UNLOCK_GLOBALS();
+   *is_local = 0;
+   return clause;
+}
+
 void free_query(Query q)
 {
    free(q->variables);
@@ -933,46 +1254,727 @@ Clause compile_predicate_clause(word term, int with_choicepoint, char* meta)
    return clause;
 }
 
-struct predicate_context_t
+/* Clause indexing
+   If a predicate has more than one clause, and some of them have a constant or compound first argument, we put a clause containing
+   just the SWITCH_ON_* instructions in front of the normal chain of clauses:
+      SWITCH_ON_TERM      If the first argument is a constant, fall through to SWITCH_ON_CONSTANT. If it is a compound, skip to
+                          SWITCH_ON_FUNCTOR. If it is unbound (or the first argument is not indexed) jump to SWITCH_ON_ARGUMENTS
+      SWITCH_ON_CONSTANT  Look up the first argument in the index, and continue with the chain of clauses found there
+      SWITCH_ON_FUNCTOR   Look up the functor of the first argument in the index, and continue with the chain of clauses found there
+      SWITCH_ON_ARGUMENTS Look up any other bound arguments which have an index, and continue with the shortest chain found. If there
+                          are none, continue with the normal chain (the next clause after this one)
+   The chains in an index contain every clause with that key, as well as every clause with a variable in that position, in the
+   original order. They do not have their own code: TRY_ME_OR_NEXT_CLAUSE only creates a choicepoint if the clause has a next clause,
+   so the last clause in a chain is always deterministic, even if it was not the last clause in the predicate.
+   Small indexes are searched linearly. Larger ones also get a hash table.
+
+   Indexes on the other arguments are built just in time. Predicates with at least JIT_MIN_CLAUSES clauses always get a switch clause,
+   and SWITCH_ON_ARGUMENTS counts how often each argument is bound (in predicate->bound_calls). Once that reaches JIT_INDEX_CALLS we
+   build an index for the argument. The set of indexed arguments is kept in the predicate, so the indexes are rebuilt whenever the
+   predicate is recompiled. Arguments which turn out to be useless as keys are not tried again.
+
+   Dynamic predicates are not recompiled when a clause is asserted or retracted. Instead the clause is compiled on its own and linked
+   into (or out of) the chain and the chains of each index, see add_dynamic_clause() and remove_dynamic_clause(). Every clause of a
+   dynamic predicate starts with TRY_ME_OR_NEXT_CLAUSE, so none of them need to change when another is linked in after them.
+   Other threads may be running the code while this happens, so a clause is complete before it is linked in, the next pointer of a
+   clause is left alone when it is unlinked (anything running it can carry on to the clause after it), and it is only freed once
+   nothing can be running it. A retracted clause is not unlinked straight away either, since calls made before it was retracted must
+   still see it. Instead its TRY_ME_OR_NEXT_CLAUSE is replaced with NEXT_CLAUSE, so later calls skip it (see retract_clause()), and it
+   is unlinked once no call can see it. TRY_ME_OR_NEXT_CLAUSE passes over the clauses that a call cannot see in the same way.
+*/
+
+#define SWITCH_LINEAR_LIMIT 8
+// Clauses with a variable in the indexed position are copied into every chain. Do not let that get out of hand
+#define SWITCH_MAX_SHARED_CLAUSES 65536
+#define JIT_MIN_CLAUSES 16
+#define JIT_INDEX_CALLS 8
+#define JIT_MAX_ARGS 32
+
+// Returns the key used to index an argument t, or 0 if it could match anything
+word switch_key(word t)
+{
+   t = DEREF(t);
+   if (TAGOF(t) == CONSTANT_TAG)
+      return t;
+   if (TAGOF(t) == COMPOUND_TAG)
+      return FUNCTOROF(t);
+   return 0;
+}
+
+// Returns a copy of c for the chain at position in the index on argument arg
+Clause share_clause(Clause c, int arg, int position)
+{
+   Clause shared = allocClause();
+   *shared = *c;
+   shared->next = NULL;
+   shared->prev = NULL;
+   shared->index = NULL;
+   shared->source = NULL;
+   shared->original = c;
+   shared->index_arg = arg;
+   shared->index_position = position;
+   shared->copies = c->copies;
+   c->copies = shared;
+   return shared;
+}
+
+// Links c into the start or end of a chain
+void link_into_chain(Clause* head, Clause* tail, int* length, Clause c, int at_end)
+{
+   if (*head == NULL)
+   {
+      c->prev = NULL;
+      c->next = NULL;
+      *tail = c;
+      ATOMIC_STORE(head, c);
+   }
+   else if (at_end)
+   {
+      c->prev = *tail;
+      c->next = NULL;
+      ATOMIC_STORE(&(*tail)->next, c);
+      *tail = c;
+   }
+   else
+   {
+      c->prev = NULL;
+      c->next = *head;
+      (*head)->prev = c;
+      ATOMIC_STORE(head, c);
+   }
+   if (length != NULL)
+      ATOMIC_STORE(length, *length + 1);
+}
+
+void unlink_from_chain(Clause* head, Clause* tail, int* length, Clause c)
+{
+   if (c->prev == NULL)
+      ATOMIC_STORE(head, c->next);
+   else
+      ATOMIC_STORE(&c->prev->next, c->next);
+   if (c->next == NULL)
+      *tail = c->prev;
+   else
+      c->next->prev = c->prev;
+   if (length != NULL)
+      ATOMIC_STORE(length, *length - 1);
+}
+
+void free_chain(Clause c)
+{
+   while (c != NULL)
+   {
+      Clause next = c->next;
+      free(c);
+      c = next;
+   }
+}
+
+void free_argument_index(struct argument_index* index)
+{
+   for (int i = 0; i < index->keys->count; i++)
+      free_chain(index->keys->keys[i].chain);
+   free_chain(index->default_chain);
+   free(index->keys);
+   free(index);
+}
+
+void _free_argument_index(void* index)
+{
+   free_argument_index((struct argument_index*)index);
+}
+
+// The copies in the chains of an argument index, for retire_code()
+void _forall_index_clauses(void* data, ClauseVisitor fn, void* fn_data)
+{
+   struct argument_index* index = (struct argument_index*)data;
+   for (int i = 0; i < index->keys->count; i++)
+      for (Clause c = index->keys->keys[i].chain; c != NULL; c = c->next)
+         fn(c, fn_data);
+   for (Clause c = index->default_chain; c != NULL; c = c->next)
+      fn(c, fn_data);
+}
+
+void free_clause_index(struct clause_index* index)
+{
+   for (int i = 0; i < index->arity; i++)
+      if (index->args[i] != NULL)
+         free_argument_index(index->args[i]);
+   free(index->args);
+   free(index);
+}
+
+// The clauses starting at first forget their copies in the index on argument arg, since it is about to be freed
+void forget_copies(Clause first, int arg)
+{
+   for (Clause c = first; c != NULL; c = c->next)
+   {
+      Clause* copy = &c->copies;
+      while (*copy != NULL)
+      {
+         if ((*copy)->index_arg == arg)
+            *copy = (*copy)->copies;
+         else
+            copy = &(*copy)->copies;
+      }
+   }
+}
+
+static unsigned int key_hash(word key)
 {
+   return (unsigned int)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+struct index_keys* alloc_index_keys(int capacity)
+{
+   int table_size = 0;
+   if (capacity > SWITCH_LINEAR_LIMIT)
+   {
+      for (table_size = 16; table_size < capacity * 2; table_size *= 2)
+         ;
+   }
+   struct index_keys* keys = malloc(sizeof(struct index_keys) + sizeof(struct index_key) * capacity + sizeof(int) * table_size);
+   keys->count = 0;
+   keys->capacity = capacity;
+   keys->table = NULL;
+   keys->table_mask = table_size - 1;
+   if (table_size > 0)
+   {
+      keys->table = (int*)&keys->keys[capacity];
+      memset(keys->table, 0, sizeof(int) * table_size);
+   }
+   return keys;
+}
+
+// Returns the entry for key, or NULL if there is not one. This is called without holding any lock
+struct index_key* find_key(struct index_keys* keys, word key)
+{
+   if (keys->table == NULL)
+   {
+      int count = ATOMIC_LOAD(&keys->count);
+      for (int i = 0; i < count; i++)
+         if (keys->keys[i].key == key)
+            return &keys->keys[i];
+      return NULL;
+   }
+   for (unsigned int i = key_hash(key) & keys->table_mask;; i = (i + 1) & keys->table_mask)
+   {
+      int position = ATOMIC_LOAD(&keys->table[i]);
+      if (position == 0)
+         return NULL;
+      if (keys->keys[position-1].key == key)
+         return &keys->keys[position-1];
+   }
+}
+
+static void insert_key(struct index_keys* keys, struct index_key* key)
+{
+   int position = keys->count;
+   keys->keys[position] = *key;
+   if (keys->table != NULL)
+   {
+      unsigned int i = key_hash(key->key) & keys->table_mask;
+      while (keys->table[i] != 0)
+         i = (i + 1) & keys->table_mask;
+      ATOMIC_STORE(&keys->table[i], position + 1);
+   }
+   ATOMIC_STORE(&keys->count, position + 1);
+}
+
+// Adds a key, whose chain must already be complete, to the end of the keys of index
+void add_key(struct argument_index* index, word key, Clause chain, Clause tail, int length)
+{
+   struct index_keys* keys = index->keys;
+   if (keys->count == keys->capacity)
+   {
+      struct index_keys* bigger = alloc_index_keys(keys->capacity * 2);
+      for (int i = 0; i < keys->count; i++)
+         insert_key(bigger, &keys->keys[i]);
+      ATOMIC_STORE(&index->keys, bigger);
+      defer_free(free_memory, keys);
+      keys = bigger;
+   }
+   struct index_key k = {key, chain, tail, length};
+   insert_key(keys, &k);
+}
+
+// Links copies of c into the chains of the index on argument arg where it belongs, given that its key there is key. Returns 0 instead
+// if that would make the index too big
+int add_to_argument_index(struct argument_index* index, int arg, Clause c, word key, int at_end)
+{
+   struct index_keys* keys = index->keys;
+   if (key == 0)
+   {
+      if ((long)(index->default_length + 1) * keys->count > SWITCH_MAX_SHARED_CLAUSES)
+         return 0;
+      for (int i = 0; i < keys->count; i++)
+      {
+         if (keys->keys[i].length == 0)
+            index->empty_count--;
+         link_into_chain(&keys->keys[i].chain, &keys->keys[i].tail, &keys->keys[i].length, share_clause(c, arg, i), at_end);
+      }
+      link_into_chain(&index->default_chain, &index->default_tail, &index->default_length, share_clause(c, arg, -1), at_end);
+      return 1;
+   }
+   struct index_key* k = find_key(keys, key);
+   if (k != NULL)
+   {
+      if (k->length == 0)
+         index->empty_count--;
+      link_into_chain(&k->chain, &k->tail, &k->length, share_clause(c, arg, k - keys->keys), at_end);
+      return 1;
+   }
+   // A new key. Its chain has every clause with a variable in this position as well
+   if ((long)index->default_length * (keys->count + 1) > SWITCH_MAX_SHARED_CLAUSES)
+      return 0;
+   Clause chain = NULL;
+   Clause tail = NULL;
+   int length = 0;
+   for (Clause d = index->default_chain; d != NULL; d = d->next)
+      link_into_chain(&chain, &tail, &length, share_clause(d->original, arg, keys->count), 1);
+   link_into_chain(&chain, &tail, &length, share_clause(c, arg, keys->count), at_end);
+   add_key(index, key, chain, tail, length);
+   return 1;
+}
+
+// Unlinks a copy from the chain it is in
+void remove_from_argument_index(struct argument_index* index, Clause copy)
+{
+   if (copy->index_position == -1)
+   {
+      unlink_from_chain(&index->default_chain, &index->default_tail, &index->default_length, copy);
+      return;
+   }
+   struct index_key* k = &index->keys->keys[copy->index_position];
+   unlink_from_chain(&k->chain, &k->tail, &k->length, copy);
+   if (k->length == 0)
+      index->empty_count++;
+}
+
+Clause lookup_argument_index(struct argument_index* index, word key, int* length)
+{
+   struct index_key* k = find_key(ATOMIC_LOAD(&index->keys), key);
+   if (k == NULL)
+   {
+      *length = ATOMIC_LOAD(&index->default_length);
+      return ATOMIC_LOAD(&index->default_chain);
+   }
+   *length = ATOMIC_LOAD(&k->length);
+   return ATOMIC_LOAD(&k->chain);
+}
+
+Clause lookup_clause_index(Clause switch_clause, word key)
+{
+   struct argument_index* index = ATOMIC_LOAD(&switch_clause->index->args[0]);
    int length;
-   int index;
-   char* meta;
-   Clause* next;
-};
+   if (index == NULL)
+      return ATOMIC_LOAD(&switch_clause->next); // The index was dropped after SWITCH_ON_TERM looked at it
+   return lookup_argument_index(index, key, &length);
+}
+
+// Returns the head of the clause term t
+word clause_head(word t)
+{
+   t = DEREF(t);
+   if (TAGOF(t) == COMPOUND_TAG && FUNCTOROF(t) == clauseFunctor)
+      return DEREF(ARGOF(t, 0));
+   return t;
+}
+
+// Returns the keys of argument arg of the clauses of p in keys (0 for a variable), or 0 if that argument cannot be indexed
+int get_switch_keys(Predicate p, int arg, word* keys)
+{
+   if (p->meta != NULL && !(p->meta[arg] == '+' || p->meta[arg] == '?' || p->meta[arg] == '-'))
+      return 0; // The argument gets qualified with the module before the head is matched
+   int i = 0;
+   for (struct cell_t* cell = p->clauses.head; cell != NULL; cell = cell->next)
+   {
+      word head = clause_head(cell->data);
+      if (TAGOF(head) != COMPOUND_TAG)
+         return 0;
+      keys[i++] = switch_key(ARGOF(head, arg));
+   }
+   return 1;
+}
+
+// Builds an index on argument arg of the clauses of p, whose compiled code starts at first. Returns NULL if there is no point
+struct argument_index* build_argument_index(Predicate p, Clause first, int arg)
+{
+   int length = list_length(&p->clauses);
+   word* keys = malloc(sizeof(word) * length);
+   if (!get_switch_keys(p, arg, keys))
+   {
+      free(keys);
+      return NULL;
+   }
+   wmap_t positions = whashmap_new();
+   int key_count = 0;
+   int shared_count = 0;
+   for (int i = 0; i < length; i++)
+   {
+      any_t ignored;
+      if (keys[i] == 0)
+         shared_count++;
+      else if (whashmap_get(positions, keys[i], &ignored) == MAP_MISSING)
+         whashmap_put(positions, keys[i], (any_t)(intptr_t)key_count++);
+   }
+   whashmap_free(positions);
+   if (key_count == 0 || (long)shared_count * key_count > SWITCH_MAX_SHARED_CLAUSES)
+   {
+      free(keys);
+      return NULL;
+   }
+   struct argument_index* index = malloc(sizeof(struct argument_index));
+   index->keys = alloc_index_keys(key_count);
+   index->default_chain = NULL;
+   index->default_tail = NULL;
+   index->default_length = 0;
+   index->empty_count = 0;
+   int i = 0;
+   for (Clause c = first; c != NULL; c = c->next, i++)
+      add_to_argument_index(index, arg, c, keys[i], 1);
+   free(keys);
+   return index;
+}
+
+void discard_argument_index(Clause first, int arg, struct argument_index* index)
+{
+   forget_copies(first, arg);
+   free_argument_index(index);
+}
+
+// Stops indexing argument arg of p, for example because the index would be too big, and frees the index once nothing can be using it
+void drop_argument_index(Predicate p, Clause switch_clause, int arg)
+{
+   struct clause_index* index = switch_clause->index;
+   struct argument_index* arg_index = index->args[arg];
+   ATOMIC_STORE(&index->args[arg], NULL);
+   if (arg_index != NULL)
+   {
+      forget_copies(switch_clause->next, arg);
+      // A clause/2 or retract/1 call may be part way through one of its chains
+      if (p->cursors > 0)
+         list_append(&p->dropped_indexes, (word)arg_index);
+      else
+         retire_code(arg_index, _free_argument_index, _forall_index_clauses);
+   }
+   p->indexed_args &= ~((uint32_t)1 << arg);
+   if (p->bound_calls == NULL)
+      p->bound_calls = calloc((index->arity < JIT_MAX_ARGS)?index->arity:JIT_MAX_ARGS, sizeof(int));
+   p->bound_calls[arg] = -1;
+}
+
+void free_dropped_indexes(Predicate p)
+{
+   while (p->dropped_indexes.head != NULL)
+      retire_code((void*)list_shift(&p->dropped_indexes), _free_argument_index, _forall_index_clauses);
+}
 
-void _compile_predicate(word term, void* _context)
+// Replaces the index on argument arg of p with a new one. This gets rid of keys whose clauses have all been retracted
+void rebuild_argument_index(Predicate p, Clause switch_clause, int arg)
 {
-   struct predicate_context_t* context = (struct predicate_context_t*)_context;
-   //printf("Compiling clause: "); PORTRAY(term); printf("\n");
-   Clause q = compile_predicate_clause(DEREF(term), context->index + 1 < context->length, context->meta);
-   context->index++;
-   *(context->next) = q;
-   context->next = &(q->next);
+   struct clause_index* index = switch_clause->index;
+   struct argument_index* old = index->args[arg];
+   forget_copies(switch_clause->next, arg);
+   struct argument_index* arg_index = build_argument_index(p, switch_clause->next, arg);
+   ATOMIC_STORE(&index->args[arg], arg_index);
+   retire_code(old, _free_argument_index, _forall_index_clauses);
+   if (arg_index == NULL)
+      p->indexed_args &= ~((uint32_t)1 << arg);
+}
+
+// This is SWITCH_ON_ARGUMENTS. args are the arguments of the call to the predicate whose switch clause is given
+Clause select_clauses(Clause switch_clause, word* args)
+{
+   struct clause_index* index = switch_clause->index;
+   Predicate p = index->predicate;
+   Clause best = ATOMIC_LOAD(&switch_clause->next);
+   int clause_count = ATOMIC_LOAD(&index->clause_count);
+   int best_length = clause_count;
+   int limit = (index->arity < JIT_MAX_ARGS)?index->arity:JIT_MAX_ARGS;
+   for (int i = 1; i < limit; i++)
+   {
+      word key = switch_key(args[i]);
+      if (key == 0)
+         continue;
+      struct argument_index* arg_index = ATOMIC_LOAD(&index->args[i]);
+      if (arg_index == NULL)
+      {
+         if (clause_count < JIT_MIN_CLAUSES)
+            continue;
+         if (p->bound_calls != NULL && ATOMIC_LOAD(&p->bound_calls[i]) < 0)
+            continue;
+         // Other threads may be running this code, so the counts and the index are only changed while holding the lock
+         LOCK_GLOBALS();
+         if (p->bound_calls == NULL)
+            p->bound_calls = calloc(limit, sizeof(int));
+         if (index->args[i] == NULL && p->bound_calls[i] >= 0 && ++p->bound_calls[i] >= JIT_INDEX_CALLS)
+         {
+            arg_index = build_argument_index(p, switch_clause->next, i);
+            if (arg_index != NULL && arg_index->keys->count < 2)
+            {
+               discard_argument_index(switch_clause->next, i, arg_index);
+               arg_index = NULL;
+            }
+            if (arg_index == NULL)
+               ATOMIC_STORE(&p->bound_calls[i], -1);
+            else
+            {
+               ATOMIC_STORE(&index->args[i], arg_index);
+               p->indexed_args |= (uint32_t)1 << i;
+            }
+         }
+         arg_index = index->args[i];
+         UNLOCK_GLOBALS();
+         if (arg_index == NULL)
+            continue;
+      }
+      int length;
+      Clause chain = lookup_argument_index(arg_index, key, &length);
+      if (length < best_length)
+      {
+         best = chain;
+         best_length = length;
+      }
+   }
+   return best;
+}
+
+Clause compile_switch(Predicate p, Clause first)
+{
+   int length = list_length(&p->clauses);
+   int i = 0;
+   for (Clause c = first; c != NULL; c = c->next)
+      i++;
+   word head = clause_head(p->clauses.head->data);
+   if (i != length || TAGOF(head) != COMPOUND_TAG)
+      return first;
+
+   struct clause_index* index = malloc(sizeof(struct clause_index));
+   index->predicate = p;
+   index->clause_count = length;
+   index->arity = getConstant(FUNCTOROF(head), NULL).functor_data->arity;
+   index->args = calloc(index->arity, sizeof(struct argument_index*));
+   index->args[0] = build_argument_index(p, first, 0);
+   for (i = 1; i < index->arity && i < JIT_MAX_ARGS; i++)
+   {
+      if (p->indexed_args & ((uint32_t)1 << i))
+         index->args[i] = build_argument_index(p, first, i);
+   }
+   // Retracted clauses which are still in the code do not make p any more worth indexing
+   if (index->args[0] == NULL && length - list_length(&p->erased) < JIT_MIN_CLAUSES)
+   {
+      for (i = 1; i < index->arity; i++)
+         if (index->args[i] != NULL)
+            forget_copies(first, i);
+      free_clause_index(index);
+      return first;
+   }
+
+   instruction_list_t instructions;
+   init_instruction_list(&instructions);
+   push_instruction(&instructions, INSTRUCTION_ADDRESS(SWITCH_ON_TERM, 4));
+   push_instruction(&instructions, INSTRUCTION(SWITCH_ON_CONSTANT));
+   push_instruction(&instructions, INSTRUCTION(SWITCH_ON_FUNCTOR));
+   push_instruction(&instructions, INSTRUCTION(SWITCH_ON_ARGUMENTS));
+   Clause clause = assemble(&instructions);
+   deinit_instruction_list(&instructions);
+   clause->slot_count = 0;
+   clause->index = index;
+   clause->next = first;
+   return clause;
+}
+
+Clause compile_fail_clause()
+{
+   instruction_list_t instructions;
+   init_instruction_list(&instructions);
+   push_instruction(&instructions, INSTRUCTION(I_FAIL));
+   Clause clause = assemble(&instructions);
+   deinit_instruction_list(&instructions);
+   return clause;
 }
 
 Clause compile_predicate(Predicate p)
 {
-   Clause clause = NULL;
+   p->lastClause = NULL;
    if (list_length(&p->clauses) == 0)
+      return compile_fail_clause();
+   // Clauses may be added after the last clause of a dynamic predicate, so it must try the next clause as well
+   int dynamic = (p->flags & PREDICATE_DYNAMIC) != 0;
+   Clause clause = NULL;
+   Clause* next = &clause;
+   for (struct cell_t* cell = p->clauses.head; cell != NULL; cell = cell->next)
    {
-      instruction_list_t instructions;
-      init_instruction_list(&instructions);
-      push_instruction(&instructions, INSTRUCTION(I_FAIL));
-      clause = assemble(&instructions);
-      deinit_instruction_list(&instructions);
+      Clause c = compile_predicate_clause(DEREF(cell->data), dynamic || cell->next != NULL, p->meta);
+      if (c == NULL)
+      {
+         while (clause != NULL)
+         {
+            c = clause->next;
+            free_clause(clause);
+            clause = c;
+         }
+         p->lastClause = NULL;
+         return NULL;
+      }
+      c->source = cell;
+      c->born = clause_generation;
+      c->prev = p->lastClause;
+      *next = c;
+      next = &c->next;
+      p->lastClause = c;
    }
+   if (list_length(&p->clauses) > 1)
+      clause = compile_switch(p, clause);
+   return clause;
+}
+
+// Returns the first clause of p after any switch clause, or NULL if there are none. p must have been compiled
+Clause first_clause(Predicate p)
+{
+   if (p->lastClause == NULL)
+      return NULL;
+   if (p->firstClause->index != NULL)
+      return p->firstClause->next;
+   return p->firstClause;
+}
+
+// Returns the start of a chain holding every clause of p which might unify with head, for clause/2 and retract/1. This is the shortest
+// chain for the bound arguments of head which have an index, so it may be made of copies. p must have been compiled
+Clause candidate_clauses(Predicate p, word head)
+{
+   Clause first = first_clause(p);
+   struct clause_index* index = p->firstClause->index;
+   if (first == NULL || index == NULL || TAGOF(head) != COMPOUND_TAG)
+      return first;
+   Clause best = first;
+   int best_length = index->clause_count;
+   for (int i = 0; i < index->arity && i < JIT_MAX_ARGS; i++)
+   {
+      word key = switch_key(ARGOF(head, i));
+      if (key == 0 || index->args[i] == NULL)
+         continue;
+      int length;
+      Clause chain = lookup_argument_index(index->args[i], key, &length);
+      if (length < best_length)
+      {
+         best = chain;
+         best_length = length;
+      }
+   }
+   return best;
+}
+
+void add_to_clause_index(Predicate p, Clause switch_clause, Clause c, int at_end)
+{
+   struct clause_index* index = switch_clause->index;
+   ATOMIC_STORE(&index->clause_count, index->clause_count + 1);
+   word head = clause_head(c->source->data);
+   for (int i = 0; i < index->arity && i < JIT_MAX_ARGS; i++)
+   {
+      word key = switch_key(ARGOF(head, i));
+      if (index->args[i] != NULL)
+      {
+         if (!add_to_argument_index(index->args[i], i, c, key, at_end))
+            drop_argument_index(p, switch_clause, i);
+      }
+      else if (i == 0 && key != 0 && (p->bound_calls == NULL || p->bound_calls[0] >= 0))
+      {
+         // None of the other clauses had a key for the first argument
+         struct argument_index* arg_index = build_argument_index(p, switch_clause->next, 0);
+         if (arg_index == NULL)
+            drop_argument_index(p, switch_clause, 0);
+         else
+            ATOMIC_STORE(&index->args[0], arg_index);
+      }
+   }
+}
+
+// Compiles the clause in cell, which has just been added to the start or end of p->clauses, and links it into the code for p.
+// Returns 0 if it cannot be compiled. Must be called while holding global_lock
+int add_dynamic_clause(Predicate p, struct cell_t* cell, int at_end)
+{
+   Clause c = compile_predicate_clause(DEREF(cell->data), 1, p->meta);
+   if (c == NULL)
+      return 0;
+   c->born = ++clause_generation;
+   if (p->firstClause == NULL)
+   {
+      // p has not been compiled yet. That will happen when it is first called
+      free_clause(c);
+      return 1;
+   }
+   c->source = cell;
+   Clause switch_clause = (p->firstClause->index != NULL)?p->firstClause:NULL;
+   if (switch_clause == NULL && p->lastClause == NULL)
+   {
+      // p has no clauses, so its code is just I_FAIL
+      Clause old = p->firstClause;
+      p->lastClause = c;
+      ATOMIC_STORE(&p->firstClause, c);
+      retire_code(old, _free_clauses, forall_chain_clauses);
+      return 1;
+   }
+   Clause* head = (switch_clause != NULL)?&switch_clause->next:&p->firstClause;
+   link_into_chain(head, &p->lastClause, NULL, c, at_end);
+   if (switch_clause != NULL)
+      add_to_clause_index(p, switch_clause, c, at_end);
    else
    {
-      Clause* ptr = &clause;
-      struct predicate_context_t context;
-      context.length = list_length(&p->clauses);
-      context.index = 0;
-      context.meta = p->meta;
-      context.next = &clause;
-      list_apply(&p->clauses, &context, _compile_predicate);
+      // It may be worth indexing p now. Retracted clauses which are still in the code do not count
+      int live = list_length(&p->clauses) - list_length(&p->erased);
+      if (live > 1 && live <= JIT_MIN_CLAUSES)
+      {
+         Clause first = p->firstClause;
+         Clause code = compile_switch(p, first);
+         if (code != first)
+            ATOMIC_STORE(&p->firstClause, code);
+      }
    }
-   return clause;
+   return 1;
+}
+
+void _free_removed_clause(void* data)
+{
+   Clause c = (Clause)data;
+   Clause copy = c->copies;
+   while (copy != NULL)
+   {
+      Clause next = copy->copies;
+      free(copy);
+      copy = next;
+   }
+   free_clause(c);
+}
+
+// Unlinks c from the code for p, after the cell it was compiled from has been removed from p->clauses. c is retired, since something
+// may still be running it. Must be called while holding global_lock
+void remove_dynamic_clause(Predicate p, Clause c)
+{
+   Clause switch_clause = (p->firstClause->index != NULL)?p->firstClause:NULL;
+   if (switch_clause == NULL && p->firstClause == c && p->lastClause == c)
+   {
+      // That was the only clause
+      p->lastClause = NULL;
+      ATOMIC_STORE(&p->firstClause, compile_fail_clause());
+   }
+   else
+      unlink_from_chain((switch_clause != NULL)?&switch_clause->next:&p->firstClause, &p->lastClause, NULL, c);
+   if (switch_clause != NULL)
+   {
+      struct clause_index* index = switch_clause->index;
+      ATOMIC_STORE(&index->clause_count, index->clause_count - 1);
+      for (Clause copy = c->copies; copy != NULL; copy = copy->copies)
+         remove_from_argument_index(index->args[copy->index_arg], copy);
+      for (int i = 0; i < index->arity && i < JIT_MAX_ARGS; i++)
+      {
+         struct argument_index* arg_index = index->args[i];
+         if (arg_index != NULL && arg_index->empty_count > SWITCH_LINEAR_LIMIT && arg_index->empty_count * 2 > arg_index->keys->count)
+            rebuild_argument_index(p, switch_clause, i);
+      }
+   }
+   retire_code(c, _free_removed_clause, _forall_copies);
 }
 
 Clause foreign_predicate_c(int(*func)(), int arity, int flags)
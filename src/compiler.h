@@ -1,10 +1,59 @@
 #include "types.h"
 #include "list.h"
 #include "module.h"
+#include "whashmap.h"
+
+// An index on one argument of a predicate. Each chain is a list of clauses (in order) that might match a call where that argument has
+// the given key. The clauses in the chains share their code with the clauses in the predicate, only the next pointers differ
+struct index_key
+{
+   word key;                // The constant or functor of the argument in a clause
+   Clause chain;
+   Clause tail;
+   int length;
+};
+
+// Other threads may be looking up keys while a clause is added, so a key is filled in before count is increased to include it, and
+// when there is no room for more the keys are copied to a bigger struct index_keys which replaces this one
+struct index_keys
+{
+   int count;
+   int capacity;
+   int* table;              // Hash table of positions in keys, plus one. Only used if there are more than SWITCH_LINEAR_LIMIT keys
+   int table_mask;
+   struct index_key keys[];
+};
+
+struct argument_index
+{
+   struct index_keys* keys;
+   Clause default_chain;    // Clauses with a variable in this position, for keys which do not appear in the index
+   Clause default_tail;
+   int default_length;
+   int empty_count;         // Keys whose clauses have all been retracted
+};
+
+struct clause_index
+{
+   Predicate predicate;
+   int arity;
+   int clause_count;
+   struct argument_index** args; // NULL for each argument which is not indexed
+};
 
 Query compile_query(word);
 void free_query(Query);
+Clause compile_meta_call(word goal, word* args, int* arg_count, int* is_local);
+int is_plain_goal(word term);
 Clause compile_predicate(Predicate p);
+Clause lookup_clause_index(Clause switch_clause, word key);
+Clause select_clauses(Clause switch_clause, word* args);
+void free_clause_index(struct clause_index* index);
+Clause first_clause(Predicate p);
+int add_dynamic_clause(Predicate p, struct cell_t* cell, int at_end);
+void remove_dynamic_clause(Predicate p, Clause c);
+Clause candidate_clauses(Predicate p, word head);
+void free_dropped_indexes(Predicate p);
 void find_variables(word term, List* list);
 Clause foreign_predicate_js(word func, int arity, int flags);
 Clause foreign_predicate_c(int(*func)(), int arity, int flags);
@@ -5,19 +5,40 @@
 #include "ctable.h"
 #include "constants.h"
 #include "options.h"
+#include "threads.h"
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <gmp.h>
 
-#define CONSTANT_BITS 2
+/* The table is made of pages of CTABLE_PAGE_SIZE constants. When it is full we add another page rather than reallocating it, so a
+   constant never moves once it has been created, and other threads can read the table without taking any locks while it grows.
+   Interning a constant takes the lock for its type, so atoms and functors (say) can be interned at the same time. The indices
+   themselves are handed out under index_lock */
+#define CTABLE_MAX_PAGES 65536
 
-constant* CTable = NULL;
+constant** CTable = NULL;
 bimap_t map[7];
 int CTableSize = 0;
 int CNext = 0;
 int constant_count = 0;
 
+#ifdef HAVE_THREADS
+pthread_rwlock_t intern_locks[8];
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+#define READ_LOCK_TYPE(t) pthread_rwlock_rdlock(&intern_locks[t])
+#define WRITE_LOCK_TYPE(t) pthread_rwlock_wrlock(&intern_locks[t])
+#define UNLOCK_TYPE(t) pthread_rwlock_unlock(&intern_locks[t])
+#define LOCK_INDEX() pthread_mutex_lock(&index_lock)
+#define UNLOCK_INDEX() pthread_mutex_unlock(&index_lock)
+#else
+#define READ_LOCK_TYPE(t) (void)0
+#define WRITE_LOCK_TYPE(t) (void)0
+#define UNLOCK_TYPE(t) (void)0
+#define LOCK_INDEX() (void)0
+#define UNLOCK_INDEX() (void)0
+#endif
+
 
 void ctable_check()
 {
@@ -35,15 +56,26 @@ void ctable_check()
 
 cdata getConstant(word w, int* type)
 {
-   constant c = CTable[w >> CONSTANT_BITS];
+   if (IS_SMALLINT(w))
+   {
+      cdata d;
+      d.integer_data = SMALLINT_VALUE(w);
+      if (type != NULL)
+         *type = INTEGER_TYPE;
+      return d;
+   }
+   // Do not copy the whole constant: another thread may be changing its reference count
+   constant* c = &CONSTANT(w >> CONSTANT_BITS);
    if (type != NULL)
-      *type = c.type;
-   return c.data;
+      *type = c->type;
+   return c->data;
 }
 
 int getConstantType(word w)
 {
-   return CTable[w >> CONSTANT_BITS].type;
+   if (IS_SMALLINT(w))
+      return INTEGER_TYPE;
+   return CONSTANT(w >> CONSTANT_BITS).type;
 }
 
 
@@ -127,39 +159,47 @@ int rational_compare2(void* data, int len, word w)
 
 void initialize_ctable()
 {
-   CTableSize = 256;
    map[ATOM_TYPE] = bihashmap_new(atom_compare1, atom_compare2);
    map[INTEGER_TYPE] = bihashmap_new(integer_compare1, integer_compare2);
    map[FUNCTOR_TYPE] = bihashmap_new(functor_compare1, functor_compare2);
    map[FLOAT_TYPE] = bihashmap_new(float_compare1, float_compare2);
    map[BIGINTEGER_TYPE] = bihashmap_new(biginteger_compare1, biginteger_compare2);
    map[RATIONAL_TYPE] = bihashmap_new(rational_compare1, rational_compare2);
-   CTable = calloc(CTableSize, sizeof(constant));
+#ifdef HAVE_THREADS
+   for (int i = 0; i < 8; i++)
+      pthread_rwlock_init(&intern_locks[i], NULL);
+#endif
+   CTable = calloc(CTABLE_MAX_PAGES, sizeof(constant*));
+   CTable[0] = calloc(CTABLE_PAGE_SIZE, sizeof(constant));
+   CTableSize = CTABLE_PAGE_SIZE;
 }
 
 int next_free_index = -1;
 
 int allocate_ctable_index(int type)
 {
+   LOCK_INDEX();
+   constant_count++;
    if (next_free_index != -1)
    {
       int index = next_free_index;
-      next_free_index = CTable[index].data.tombstone_data;
+      next_free_index = CONSTANT(index).data.tombstone_data;
       //printf("Reusing index %d for a %d. Next free is %d\n", index, type, next_free_index);
       if (CNext < index+1)
          CNext = index+1;
+      UNLOCK_INDEX();
       return index;
    }
    else if (CTableSize == CNext)
    {
-      CTableSize <<= 1;
-      constant* c = calloc(CTableSize, sizeof(constant));
-      memcpy(c, CTable, CNext * sizeof(constant));
-      free(CTable);
-      CTable = c;
+      if ((CTableSize >> CTABLE_PAGE_BITS) == CTABLE_MAX_PAGES)
+         fatal("Constant table is full");
+      CTable[CTableSize >> CTABLE_PAGE_BITS] = calloc(CTABLE_PAGE_SIZE, sizeof(constant));
+      CTableSize += CTABLE_PAGE_SIZE;
    }
    int index = CNext;
    CNext++;
+   UNLOCK_INDEX();
    return index;
 }
 
@@ -169,7 +209,18 @@ word intern(int type, uint32_t hashcode, void* key1, int key2, void*(*create)(vo
    if (CTable == NULL)
       initialize_ctable();
    word w;
-   if (bihashmap_get(map[type], hashcode, key1, key2, &w) == MAP_OK)
+   READ_LOCK_TYPE(type);
+   int found = bihashmap_get(map[type], hashcode, key1, key2, &w) == MAP_OK;
+   UNLOCK_TYPE(type);
+   if (!found)
+   {
+      // Someone else may have interned it between dropping the read lock and getting the write lock
+      WRITE_LOCK_TYPE(type);
+      found = bihashmap_get(map[type], hashcode, key1, key2, &w) == MAP_OK;
+      if (found)
+         UNLOCK_TYPE(type);
+   }
+   if (found)
    {
       if (isNew != NULL)
          *isNew = 0;
@@ -177,25 +228,26 @@ word intern(int type, uint32_t hashcode, void* key1, int key2, void*(*create)(vo
    }
    int index = allocate_ctable_index(type);
    w = (word)((index << CONSTANT_BITS) | CONSTANT_TAG);
-   CTable[index].type = type;
-   CTable[index].references = 0;
-   CTable[index].marked = 0;
+   CONSTANT(index).type = type;
+   CONSTANT(index).arity = 0;
+   CONSTANT(index).references = 0;
+   CONSTANT(index).marked = 0;
    void* created = create(key1, key2);
    switch(type)
    {
-      case ATOM_TYPE: CTable[index].data.atom_data = (Atom)created; break;
-      case FUNCTOR_TYPE: CTable[index].data.functor_data = (Functor)created; break;
-      case INTEGER_TYPE: CTable[index].data.integer_data = (long)created; break;
-      case FLOAT_TYPE: CTable[index].data.float_data = (Float)created; break;
-      case BIGINTEGER_TYPE: CTable[index].data.biginteger_data = (BigInteger)created; break;
-      case RATIONAL_TYPE: CTable[index].data.rational_data = (Rational)created; break;
+      case ATOM_TYPE: CONSTANT(index).data.atom_data = (Atom)created; break;
+      case FUNCTOR_TYPE: CONSTANT(index).data.functor_data = (Functor)created; CONSTANT(index).arity = key2; break;
+      case INTEGER_TYPE: CONSTANT(index).data.integer_data = (long)created; break;
+      case FLOAT_TYPE: CONSTANT(index).data.float_data = (Float)created; break;
+      case BIGINTEGER_TYPE: CONSTANT(index).data.biginteger_data = (BigInteger)created; break;
+      case RATIONAL_TYPE: CONSTANT(index).data.rational_data = (Rational)created; break;
       default:
          assert(0);
    }
    if (isNew != NULL)
       *isNew = 1;
-   constant_count++;
    bihashmap_put(map[type], hashcode, created, w);
+   UNLOCK_TYPE(type);
    //printf("Created constant word %lu: ", w); PORTRAY(((word)((index << CONSTANT_BITS) | CONSTANT_TAG))); printf("\n");
    return w;
 }
@@ -223,17 +275,17 @@ word intern_blob(const char* type, void* ptr, char* (*portray)(char*, void*, Opt
    int index = allocate_ctable_index(BLOB_TYPE);
    word w = (word)((index << CONSTANT_BITS) | CONSTANT_TAG);
    Blob b = allocBlob(type, ptr, portray);
-   CTable[index].type = BLOB_TYPE;
-   CTable[index].references = 2;
-   CTable[index].marked = 0;
-   CTable[index].data.blob_data = b;
-   constant_count++;
+   CONSTANT(index).type = BLOB_TYPE;
+   CONSTANT(index).arity = 0;
+   CONSTANT(index).references = 2;
+   CONSTANT(index).marked = 0;
+   CONSTANT(index).data.blob_data = b;
    return w;
 }
 
 void delete_constant(int index)
 {
-   constant c = CTable[index];
+   constant c = CONSTANT(index);
    //printf("Deleting constant %d: ", index); PORTRAY(((word)((index << CONSTANT_BITS) | CONSTANT_TAG))); printf("\n");
    switch(c.type)
    {
@@ -252,7 +304,7 @@ void delete_constant(int index)
          bihashmap_remove(map[FUNCTOR_TYPE], uint32_hash((unsigned char*)name->data, name->length) + f->arity, &f->name, f->arity);
          release_constant("name of freed functor", f->name);
          // Step E of AGC
-         if (CTable[f->name >> CONSTANT_BITS].references == 0)
+         if (CONSTANT(f->name >> CONSTANT_BITS).references == 0)
          {
             delete_constant(f->name >> CONSTANT_BITS);
          }
@@ -294,8 +346,8 @@ void delete_constant(int index)
          assert(0);
    }
    // Now delete the reference in the table
-   CTable[index].type = TOMBSTONE_TYPE;
-   CTable[index].data.tombstone_data = next_free_index;
+   CONSTANT(index).type = TOMBSTONE_TYPE;
+   CONSTANT(index).data.tombstone_data = next_free_index;
    next_free_index = index;
    constant_count--;
 
@@ -304,8 +356,10 @@ void delete_constant(int index)
 word acquire_constant(char* context, word w)
 {
    assert(TAGOF(w) == CONSTANT_TAG);
-   CTable[w >> CONSTANT_BITS].references++;
-   //printf("(%s) Acquiring constant %lu: ", context, w); PORTRAY(w); printf(" which now has %d references\n", CTable[w >> CONSTANT_BITS].references);
+   if (IS_SMALLINT(w))
+      return w;
+   ATOMIC_ADD(&CONSTANT(w >> CONSTANT_BITS).references, 1);
+   //printf("(%s) Acquiring constant %lu: ", context, w); PORTRAY(w); printf(" which now has %d references\n", CONSTANT(w >> CONSTANT_BITS).references);
    // This return value makes it easier to chain things together. You can do something like
    //   return acquire_constant(MAKE_ATOM("foo"))
    return w;
@@ -314,9 +368,11 @@ word acquire_constant(char* context, word w)
 word release_constant(char* context, word w)
 {
    assert(TAGOF(w) == CONSTANT_TAG);
-   CTable[w >> CONSTANT_BITS].references--;
-   //printf("(%s) Releasing constant %lu, ", context, w); PORTRAY(w); printf(" which now has %d references\n", CTable[w >> CONSTANT_BITS].references);
-   assert (CTable[w >> CONSTANT_BITS].references >= 0);
+   if (IS_SMALLINT(w))
+      return 0;
+   int references = ATOMIC_ADD(&CONSTANT(w >> CONSTANT_BITS).references, -1);
+   //printf("(%s) Releasing constant %lu, ", context, w); PORTRAY(w); printf(" which now has %d references\n", references);
+   assert (references >= 0);
    return 0;
 }
 
@@ -325,10 +381,23 @@ int get_constant_count()
    return constant_count;
 }
 
+void unmark_heap_constants(word* from, word* to)
+{
+   for (word* i = from; i < to; i++)
+   {
+      if (TAGOF(*i) == CONSTANT_TAG && !IS_SMALLINT(*i))
+      {
+         //printf("constant %d is NOT garbage: ", i);  PORTRAY((word)((*i << CONSTANT_BITS) | CONSTANT_TAG)); printf(" (refs=%d)\n", CONSTANT(*i >> CONSTANT_BITS).references);
+         CONSTANT(*i >> CONSTANT_BITS).marked = 0;
+      }
+   }
+}
+
 void garbage_collect_constants()
 {
    /*
-     The AGC algorithm here is quite simple, but it makes use of things like the fact we know that the engine is single-threaded
+     The AGC algorithm here is quite simple, but it makes use of things like the fact we know that no other thread is running a query
+     (if one is, we just do nothing). The heaps of idle engines are scanned too
      1) whenever a constant is created, it gets a reference count of 1.
         1A) If a functor is created, then the atom representing its name has its reference count incremented by 1.
      2) whenever a constant is used in a compiled clause, it bumps the reference count by 1
@@ -339,7 +408,7 @@ void garbage_collect_constants()
      7) garbage_collect_constants() can be called at any time to collect unused constants. It proceeds as follows:
         A) Seeep through all constants in ctable. For all non-tombstone references with a reference_count of 0, set them to 'marked'
         B) Sweep through ARGS, unmarking any constants found. Do not follow pointers.
-        C) Sweep from HEAP to H, unmarking any constants found. Do not follow pointers.
+        C) Sweep from HEAP to H of every engine, and through its pending exception, unmarking any constants found. Do not follow pointers.
         D) Sweep through all constants in ctable. For all constants still marked, delete the constant.
         E) If deleting a functor, release the atom representing its name. If it reaches zero, delete it too (this saves a second sweep)
 
@@ -351,13 +420,20 @@ void garbage_collect_constants()
     It might be simpler to just wait until the next pass to clean these atoms up, but I think this approach is still safe.
    */
 
+   // Holding the lock stops any pool thread from starting a query until we are done
+   LOCK_GLOBALS();
+   if (threads_running())
+   {
+      UNLOCK_GLOBALS();
+      return;
+   }
    // Step A
    for (int i = 0; i < CNext; i++)
    {
-      if (CTable[i].type != TOMBSTONE_TYPE && CTable[i].references == 0)
+      if (CONSTANT(i).type != TOMBSTONE_TYPE && CONSTANT(i).references == 0)
       {
-         //printf("Marking possible garbage constant %d: ", i);  PORTRAY((word)((i << CONSTANT_BITS) | CONSTANT_TAG)); printf(" (refs=%d)\n", CTable[i].references);
-         CTable[i].marked = 1;
+         //printf("Marking possible garbage constant %d: ", i);  PORTRAY((word)((i << CONSTANT_BITS) | CONSTANT_TAG)); printf(" (refs=%d)\n", CONSTANT(i).references);
+         CONSTANT(i).marked = 1;
       }
    }
 
@@ -366,39 +442,37 @@ void garbage_collect_constants()
    assert_no_args();
 
    // Step C
-   for (word* i = HEAP; i < H; i++)
-   {
-      if (TAGOF(*i) == CONSTANT_TAG)
-      {
-         //printf("constant %d is NOT garbage: ", i);  PORTRAY((word)((*i << CONSTANT_BITS) | CONSTANT_TAG)); printf(" (refs=%d)\n", CTable[*i >> CONSTANT_BITS].references);
-         CTable[*i >> CONSTANT_BITS].marked = 0;
-      }
-   }
+   forall_engine_heaps(unmark_heap_constants);
 
    // Step D
    for (int i = 0; i < CNext; i++)
    {
-      if (CTable[i].type != TOMBSTONE_TYPE && CTable[i].marked)
+      if (CONSTANT(i).type != TOMBSTONE_TYPE && CONSTANT(i).marked)
       {
          //printf("Constant %d is garbage: ", i); PORTRAY((word)((i << CONSTANT_BITS) | CONSTANT_TAG)); printf("\n");
          delete_constant(i);
       }
    }
+   UNLOCK_GLOBALS();
 }
 
+// This is right-recursive, so that walking a list uses O(1) C-stack
 void forall_term_constants(word w, char* context, word (fn)(char*, word))
 {
-   w = DEREF(w);
-   if (TAGOF(w) == CONSTANT_TAG)
-   {
-      fn(context, w);
-   }
-   else if (TAGOF(w) == COMPOUND_TAG)
+   while (1)
    {
-      fn(context, FUNCTOROF(w));
-      Functor functor = getConstant(FUNCTOROF(w), NULL).functor_data;
-      for (int i = 0; i < functor->arity; i++)
+      w = DEREF(w);
+      if (TAGOF(w) == CONSTANT_TAG)
+         fn(context, w);
+      if (TAGOF(w) != COMPOUND_TAG)
+         return;
+      // A list cell has no functor cell, and listFunctor is never freed anyway
+      if (!IS_LIST_CELL(w))
+         fn(context, FUNCTOROF(w));
+      int arity = FUNCTOR_ARITY(FUNCTOROF(w));
+      for (int i = 0; i < arity-1; i++)
          forall_term_constants(ARGOF(w, i), context, fn);
+      w = ARGOF(w, arity-1);
    }
 }
 
@@ -11,6 +11,15 @@
 #include "options.h"
 #include "bihashmap.h"
 
+#define CONSTANT_BITS 3
+#define CTABLE_PAGE_BITS 12
+#define CTABLE_PAGE_SIZE (1 << CTABLE_PAGE_BITS)
+#define CONSTANT(i) (CTable[(i) >> CTABLE_PAGE_BITS][(i) & (CTABLE_PAGE_SIZE - 1)])
+// The arity of a functor. This is kept in the table itself so that finding it does not need another load
+#define FUNCTOR_ARITY(w) (CONSTANT((w) >> CONSTANT_BITS).arity)
+
+extern constant** CTable;
+
 word intern(int type, uint32_t hashcode, void* key1, int key2, void*(*create)(void*, int), int* isNew);
 word intern_blob(const char* type, void* ptr, char* (*portray)(char*, void*, Options*, int, int*));
 cdata getConstant(word t, int* type);
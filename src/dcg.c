@@ -0,0 +1,165 @@
+#include "global.h"
+#include "kernel.h"
+#include "constants.h"
+#include "ctable.h"
+#include "errors.h"
+#include "list.h"
+#include "dcg.h"
+
+/* Grammar rules are translated to ordinary clauses when they are consulted, so that a grammar runs as fast as any other code. A
+   non-terminal gets two extra arguments, for the list before and after it, and the body is threaded through with fresh variables:
+
+      a, [x] --> b, [c], {g}, !, call(G, y).
+
+   becomes
+
+      a(S0, S):- b(S0, S1), S1 = [c|S2], g, S2 = S3, !, S3 = S4, call(G, y, S4, S5), S = [x|S5].
+
+   Terminals are unified explicitly rather than being folded into the head or the previous goal, so that they still happen after any
+   cut before them. phrase/2,3 translate their first argument with the same code, so they can be given any grammar body.
+*/
+
+// Appends s0 and s to the arguments of the non-terminal t
+static int dcg_non_terminal(word t, word s0, word s, word* goal)
+{
+   if (TAGOF(t) == CONSTANT_TAG && getConstantType(t) == ATOM_TYPE)
+   {
+      *goal = MAKE_VCOMPOUND(MAKE_FUNCTOR(t, 2), s0, s);
+      return SUCCESS;
+   }
+   if (TAGOF(t) != COMPOUND_TAG)
+      return type_error(callableAtom, t);
+   Functor f = getConstant(FUNCTOROF(t), NULL).functor_data;
+   word args[f->arity + 2];
+   for (int i = 0; i < f->arity; i++)
+      args[i] = ARGOF(t, i);
+   args[f->arity] = s0;
+   args[f->arity+1] = s;
+   *goal = MAKE_ACOMPOUND(MAKE_FUNCTOR(f->name, f->arity + 2), args);
+   return SUCCESS;
+}
+
+// Makes the goal s0 = [t1, t2, ...|s] for the list of terminals t
+static int dcg_terminals(word t, word s0, word s, word* goal)
+{
+   List terminals;
+   init_list(&terminals);
+   word l = t;
+   while (TAGOF(l) == COMPOUND_TAG && FUNCTOROF(l) == listFunctor)
+   {
+      list_append(&terminals, ARGOF(l, 0));
+      l = ARGOF(l, 1);
+   }
+   if (l != emptyListAtom)
+   {
+      free_list(&terminals);
+      if (TAGOF(l) == VARIABLE_TAG)
+         return instantiation_error();
+      return type_error(listAtom, t);
+   }
+   *goal = MAKE_VCOMPOUND(unifyFunctor, s0, term_from_list(&terminals, s));
+   free_list(&terminals);
+   return SUCCESS;
+}
+
+int dcg_translate_body(word body, word s0, word s, word* goal)
+{
+   body = DEREF(body);
+   if (TAGOF(body) == VARIABLE_TAG)
+   {
+      *goal = MAKE_VCOMPOUND(phraseFunctor, body, s0, s);
+      return SUCCESS;
+   }
+   if (body == emptyListAtom || (TAGOF(body) == COMPOUND_TAG && FUNCTOROF(body) == listFunctor))
+      return dcg_terminals(body, s0, s, goal);
+   if (body == cutAtom)
+   {
+      *goal = MAKE_VCOMPOUND(conjunctionFunctor, cutAtom, MAKE_VCOMPOUND(unifyFunctor, s0, s));
+      return SUCCESS;
+   }
+   if (TAGOF(body) != COMPOUND_TAG)
+      return dcg_non_terminal(body, s0, s, goal);
+   word functor = FUNCTOROF(body);
+   if (functor == conjunctionFunctor)
+   {
+      word mid = MAKE_VAR();
+      word left, right;
+      if (!dcg_translate_body(ARGOF(body, 0), s0, mid, &left) || !dcg_translate_body(ARGOF(body, 1), mid, s, &right))
+         return 0;
+      *goal = MAKE_VCOMPOUND(conjunctionFunctor, left, right);
+      return SUCCESS;
+   }
+   if (functor == disjunctionFunctor)
+   {
+      word left, right;
+      if (!dcg_translate_body(ARGOF(body, 0), s0, s, &left) || !dcg_translate_body(ARGOF(body, 1), s0, s, &right))
+         return 0;
+      *goal = MAKE_VCOMPOUND(disjunctionFunctor, left, right);
+      return SUCCESS;
+   }
+   if (functor == localCutFunctor)
+   {
+      word mid = MAKE_VAR();
+      word condition, then;
+      if (!dcg_translate_body(ARGOF(body, 0), s0, mid, &condition) || !dcg_translate_body(ARGOF(body, 1), mid, s, &then))
+         return 0;
+      *goal = MAKE_VCOMPOUND(localCutFunctor, condition, then);
+      return SUCCESS;
+   }
+   if (functor == notFunctor)
+   {
+      word negated;
+      if (!dcg_translate_body(ARGOF(body, 0), s0, MAKE_VAR(), &negated))
+         return 0;
+      *goal = MAKE_VCOMPOUND(conjunctionFunctor, MAKE_VCOMPOUND(notFunctor, negated), MAKE_VCOMPOUND(unifyFunctor, s0, s));
+      return SUCCESS;
+   }
+   if (functor == curlyFunctor)
+   {
+      *goal = MAKE_VCOMPOUND(conjunctionFunctor, ARGOF(body, 0), MAKE_VCOMPOUND(unifyFunctor, s0, s));
+      return SUCCESS;
+   }
+   if (functor == crossModuleCallFunctor)
+   {
+      word inner;
+      if (!dcg_translate_body(ARGOF(body, 1), s0, s, &inner))
+         return 0;
+      *goal = MAKE_VCOMPOUND(crossModuleCallFunctor, ARGOF(body, 0), inner);
+      return SUCCESS;
+   }
+   // Everything else is a non-terminal, including call//N, which just becomes call/N+2
+   return dcg_non_terminal(body, s0, s, goal);
+}
+
+// Translates the grammar rule Head --> Body to a clause. Head may be followed by a list of terminals to push back onto the input
+int dcg_translate_rule(word rule, word* clause)
+{
+   word head = ARGOF(rule, 0);
+   word body = ARGOF(rule, 1);
+   word pushback = 0;
+   if (TAGOF(head) == COMPOUND_TAG && FUNCTOROF(head) == conjunctionFunctor)
+   {
+      pushback = ARGOF(head, 1);
+      head = ARGOF(head, 0);
+   }
+   if (TAGOF(head) == VARIABLE_TAG)
+      return instantiation_error();
+   word s0 = MAKE_VAR();
+   word s = MAKE_VAR();
+   word goal;
+   if (pushback == 0)
+   {
+      if (!dcg_non_terminal(head, s0, s, &head) || !dcg_translate_body(body, s0, s, &goal))
+         return 0;
+   }
+   else
+   {
+      word mid = MAKE_VAR();
+      word pushed;
+      if (!dcg_non_terminal(head, s0, s, &head) || !dcg_translate_body(body, s0, mid, &goal) || !dcg_terminals(pushback, s, mid, &pushed))
+         return 0;
+      goal = MAKE_VCOMPOUND(conjunctionFunctor, goal, pushed);
+   }
+   *clause = MAKE_VCOMPOUND(clauseFunctor, head, goal);
+   return SUCCESS;
+}
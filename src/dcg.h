@@ -0,0 +1,10 @@
+#ifndef _DCG_H
+#define _DCG_H
+
+#include "kernel.h"
+
+// These return 0 and set the exception if the rule or body is not valid
+int dcg_translate_rule(word rule, word* clause);
+int dcg_translate_body(word body, word s0, word s, word* goal);
+
+#endif
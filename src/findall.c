@@ -0,0 +1,223 @@
+#include "global.h"
+#include "kernel.h"
+#include "ctable.h"
+#include "constants.h"
+#include "arithmetic.h"
+#include "findall.h"
+#include <assert.h>
+
+/* A bag holds copies of the solutions to a goal for findall/3 and findall/4. Each solution is appended to a single block of cells as a
+   list cell followed by a copy of the term. This is laid out just as it will be on the heap, except that references to other cells in the
+   block are stored as byte offsets from the start of it. That way the block can be moved when it grows, and once there are no more
+   solutions the whole list can be copied onto the heap in one pass, by adding the address it is copied to. Like a local copy, a bag holds
+   a reference to each constant in it until it is collected or freed.
+   aggregate_all/3 uses a bag to hold a running count, sum, maximum or minimum instead.
+*/
+
+struct bag
+{
+   Word cells;
+   size_t size;
+   size_t capacity;
+   size_t tail;            // The index of the tail of the last list cell, or 0 if there are no solutions yet
+   word value;             // The value so far for aggregate_all/3, or 0 if there is not one yet
+   Word* bound;            // The variables of the term being added, each bound to its copy while we copy it
+   size_t bound_count;
+   size_t bound_capacity;
+};
+
+Bag create_bag()
+{
+   Bag bag = malloc(sizeof(struct bag));
+   bag->capacity = 256;
+   bag->cells = malloc(sizeof(word) * bag->capacity);
+   bag->size = 0;
+   bag->tail = 0;
+   bag->value = 0;
+   bag->bound_capacity = 16;
+   bag->bound = malloc(sizeof(Word) * bag->bound_capacity);
+   bag->bound_count = 0;
+   return bag;
+}
+
+void free_bag(Bag bag)
+{
+   for (size_t i = 0; i < bag->size; i++)
+   {
+      if (TAGOF(bag->cells[i]) == CONSTANT_TAG)
+         release_constant("constant in bag", bag->cells[i]);
+   }
+   if (bag->value != 0)
+      release_constant("aggregate value", bag->value);
+   free(bag->cells);
+   free(bag->bound);
+   free(bag);
+}
+
+// Returns the number of cells needed for a copy of t, not including the one which refers to it. Variables are counted each time they appear
+static size_t term_size(word t)
+{
+   size_t size = 0;
+   while (1)
+   {
+      t = DEREF(t);
+      if (TAGOF(t) == VARIABLE_TAG)
+         return size + 1;
+      if (TAGOF(t) != COMPOUND_TAG)
+         return size;
+      int arity = FUNCTOR_ARITY(FUNCTOROF(t));
+      size += arity + (IS_LIST_CELL(t)?0:1);
+      for (int i = 0; i < arity-1; i++)
+         size += term_size(ARGOF(t, i));
+      t = ARGOF(t, arity-1);
+   }
+}
+
+// Copies t to the end of the bag and stores a reference to it in cells[target]. There must already be room for it.
+// Like make_local_(), this is right-recursive so that copying a list uses O(1) C-stack
+static void copy_to_bag(Bag bag, word t, size_t target)
+{
+   Word cells = bag->cells;
+   while (1)
+   {
+      t = DEREF(t);
+      switch(TAGOF(t))
+      {
+         case CONSTANT_TAG:
+            acquire_constant("constant in bag", t);
+         case POINTER_TAG:
+            cells[target] = t;
+            return;
+         case VARIABLE_TAG:
+         {
+            Word v = (Word)t;
+            if (v < cells || v >= cells + bag->capacity)
+            {
+               // First time we have seen this variable. Bind it to its copy so that we find the copy next time. bag_add() undoes this
+               if (bag->bound_count == bag->bound_capacity)
+               {
+                  bag->bound_capacity *= 2;
+                  bag->bound = realloc(bag->bound, sizeof(Word) * bag->bound_capacity);
+               }
+               bag->bound[bag->bound_count++] = v;
+               v = &cells[bag->size++];
+               *v = (word)v;
+               *((Word)t) = (word)v;
+            }
+            cells[target] = (word)((char*)v - (char*)cells);
+            return;
+         }
+         case COMPOUND_TAG:
+         {
+            int arity = FUNCTOR_ARITY(FUNCTOROF(t));
+            size_t i = bag->size;
+            if (IS_LIST_CELL(t))
+               cells[target] = (word)(i * sizeof(word)) | LIST_TAG;
+            else
+            {
+               cells[i++] = acquire_constant("functor in bag", FUNCTOROF(t));
+               cells[target] = (word)((i-1) * sizeof(word)) | COMPOUND_TAG;
+            }
+            bag->size = i + arity;
+            for (int j = 0; j < arity-1; j++)
+               copy_to_bag(bag, ARGOF(t, j), i+j);
+            target = i + arity - 1;
+            t = ARGOF(t, arity-1);
+         }
+      }
+   }
+}
+
+void bag_add(Bag bag, word term)
+{
+   size_t needed = bag->size + 2 + LIST_FUNCTOR_CELLS + term_size(term);
+   if (needed > bag->capacity)
+   {
+      while (needed > bag->capacity)
+         bag->capacity *= 2;
+      bag->cells = realloc(bag->cells, sizeof(word) * bag->capacity);
+   }
+   // Add a new list cell, and link the previous one to it
+   size_t cell = bag->size;
+   bag->size += 2 + LIST_FUNCTOR_CELLS;
+   if (LIST_FUNCTOR_CELLS)
+      bag->cells[cell] = acquire_constant("functor in bag", listFunctor);
+   size_t head = cell + LIST_FUNCTOR_CELLS;
+   bag->cells[head+1] = 0;
+   if (bag->tail != 0)
+      bag->cells[bag->tail] = (word)(cell * sizeof(word)) | LIST_TAG;
+   bag->tail = head + 1;
+   bag->bound_count = 0;
+   copy_to_bag(bag, term, head);
+   // Now turn the copies of the variables into offsets as well, and unbind the originals
+   for (size_t i = 0; i < bag->bound_count; i++)
+   {
+      Word v = bag->bound[i];
+      Word copy = (Word)*v;
+      *copy = (word)((char*)copy - (char*)bag->cells);
+      *v = (word)v;
+   }
+}
+
+// Copies the solutions onto the heap as a list ending in tail, and frees the bag. This may move the heap, so any other heap references
+// the caller is holding on to must be registered roots
+word bag_collect(Bag bag, word tail)
+{
+   if (bag->tail == 0)
+   {
+      free_bag(bag);
+      return tail;
+   }
+   register_root(&tail);
+   Word base = allocate_heap(bag->size);
+   unregister_root(&tail);
+   for (size_t i = 0; i < bag->size; i++)
+   {
+      word w = bag->cells[i];
+      if (TAGOF(w) == VARIABLE_TAG || TAGOF(w) == COMPOUND_TAG)
+         w += (word)base;
+      else if (TAGOF(w) == CONSTANT_TAG)
+         release_constant("constant in bag", w);
+      base[i] = w;
+   }
+   base[bag->tail] = tail;
+   // The constants have all been released now
+   bag->size = 0;
+   free_bag(bag);
+   return (word)base | LIST_TAG;
+}
+
+// Adds x to the count, sum, maximum or minimum (according to op) held in the bag. Returns 0 if evaluating x raised an exception
+int bag_aggregate(Bag bag, word op, word x)
+{
+   word value;
+   if (op == countAtom)
+      value = MAKE_INTEGER(1);
+   else if (!evaluate_term(x, &value))
+      return 0;
+   if (bag->value != 0)
+   {
+      if (op == countAtom || op == sumAtom)
+      {
+         if (!evaluate_operation(addFunctor, bag->value, value, &value))
+            return 0;
+      }
+      else
+      {
+         int order;
+         if (!compare_numbers(value, bag->value, &order))
+            return 0;
+         if ((op == maxAtom && order <= 0) || (op == minAtom && order >= 0))
+            return 1;
+      }
+      release_constant("aggregate value", bag->value);
+   }
+   bag->value = acquire_constant("aggregate value", value);
+   return 1;
+}
+
+// Returns the value held by the bag, or 0 if nothing has been added to it
+word bag_value(Bag bag)
+{
+   return bag->value;
+}
@@ -0,0 +1,15 @@
+#ifndef _FINDALL_H
+#define _FINDALL_H
+
+#include "kernel.h"
+
+typedef struct bag* Bag;
+
+Bag create_bag();
+void free_bag(Bag bag);
+void bag_add(Bag bag, word term);
+word bag_collect(Bag bag, word tail);
+int bag_aggregate(Bag bag, word op, word x);
+word bag_value(Bag bag);
+
+#endif
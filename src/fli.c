@@ -484,6 +484,17 @@ void _free_local(word t)
    free_local(t);
 }
 
+// The heap may move during execution. If you need to hold a reference to a term on it across a call to _execute, register it here
+void _register_root(word* w)
+{
+   register_root(w);
+}
+
+void _unregister_root(word* w)
+{
+   unregister_root(w);
+}
+
 int _define_foreign_predicate(word moduleName, word functor, int(*func)(), int flags)
 {
    Module module = find_module(moduleName);
@@ -4,6 +4,9 @@
 #include "module.h"
 #include "checks.h"
 #include "format.h"
+#include "gc.h"
+#include "whashmap.h"
+#include "record.h"
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -33,6 +36,8 @@ int term_difference(word a, word b)
    b = DEREF(b);
    if (a == b)
       return 0;
+   if (IS_SMALLINT(a) && IS_SMALLINT(b))
+      return (SMALLINT_VALUE(a) > SMALLINT_VALUE(b)) - (SMALLINT_VALUE(a) < SMALLINT_VALUE(b));
    if (TAGOF(a) == VARIABLE_TAG)
    {
       if (TAGOF(b) == VARIABLE_TAG)
@@ -248,6 +253,86 @@ int qcompare_terms(const void * a, const void* b)
    return term_difference(*((word*)a), *((word*)b));
 }
 
+// A group of solutions for bagof/3 (see $group_solutions/3)
+struct solution_group
+{
+   word witness;
+   int first;           // The first and last solutions in the group. The others are linked through the next array
+   int last;
+   int collision;       // The previous group whose witness has the same hash, or -1
+};
+
+int qcompare_groups(const void* a, const void* b)
+{
+   return term_difference((*(struct solution_group**)a)->witness, (*(struct solution_group**)b)->witness);
+}
+
+// Hashes t so that variants (terms which are the same apart from the names of their variables) hash to the same value
+word variant_hash(word t)
+{
+   word h = 0;
+   while (1)
+   {
+      t = DEREF(t);
+      if (TAGOF(t) == VARIABLE_TAG)
+         return h * 31 + 1;
+      if (TAGOF(t) != COMPOUND_TAG)
+         return h * 31 + t;
+      h = h * 31 + FUNCTOROF(t);
+      Functor f = getConstant(FUNCTOROF(t), NULL).functor_data;
+      for (int i = 0; i < f->arity-1; i++)
+         h = h * 31 + variant_hash(ARGOF(t, i));
+      t = ARGOF(t, f->arity-1);
+   }
+}
+
+// va and vb hold the variables seen so far in a and b, in the same order
+int _is_variant(word a, word b, List* va, List* vb)
+{
+   while (1)
+   {
+      a = DEREF(a);
+      b = DEREF(b);
+      if (TAGOF(a) == VARIABLE_TAG)
+      {
+         if (TAGOF(b) != VARIABLE_TAG)
+            return 0;
+         int i = list_index(va, a);
+         if (i != list_index(vb, b))
+            return 0;
+         if (i == -1)
+         {
+            list_append(va, a);
+            list_append(vb, b);
+         }
+         return 1;
+      }
+      if (TAGOF(a) != COMPOUND_TAG)
+         return a == b;
+      if (TAGOF(b) != COMPOUND_TAG || FUNCTOROF(a) != FUNCTOROF(b))
+         return 0;
+      Functor f = getConstant(FUNCTOROF(a), NULL).functor_data;
+      for (int i = 0; i < f->arity-1; i++)
+      {
+         if (!_is_variant(ARGOF(a, i), ARGOF(b, i), va, vb))
+            return 0;
+      }
+      a = ARGOF(a, f->arity-1);
+      b = ARGOF(b, f->arity-1);
+   }
+}
+
+int is_variant(word a, word b)
+{
+   List va, vb;
+   init_list(&va);
+   init_list(&vb);
+   int rc = _is_variant(a, b, &va, &vb);
+   free_list(&va);
+   free_list(&vb);
+   return rc;
+}
+
 // The caller must free buffer if a non-zero value is returned
 // buffer will be in UTF-8 encoding.
 RC get_string_from_codes(word codes, char** buffer, size_t* length)
@@ -308,6 +393,32 @@ RC get_string_from_codes(word codes, char** buffer, size_t* length)
    return SUCCESS;
 }
 
+static void _close_clause_cursor(int ignored, word cursor)
+{
+   close_clause_cursor(GET_POINTER(cursor));
+}
+
+// Unifies head and body with a copy of c, which the cursor for clause/2 or retract/1 has just returned, leaving a choicepoint if
+// the cursor has more clauses and closing it otherwise
+static int next_clause_solution(ClauseCursor cursor, Clause c, word head, word body)
+{
+   int more = has_next_clause(cursor);
+   if (more)
+      make_foreign_cleanup_choicepoint(MAKE_POINTER(cursor), _close_clause_cursor, 0);
+   // The clause term itself is shared, so we must not bind it. It cannot be freed until the cursor is closed
+   word clause = copy_term(c->source->data);
+   if (!more)
+      close_clause_cursor(cursor);
+   if (TAGOF(clause) == COMPOUND_TAG && FUNCTOROF(clause) == clauseFunctor)
+      return unify(ARGOF(clause, 0), head) && unify(ARGOF(clause, 1), body);
+   return unify(clause, head) && unify(trueAtom, body);
+}
+
+static void _close_record_cursor(int ignored, word cursor)
+{
+   close_record_cursor(GET_POINTER(cursor));
+}
+
 #define TOKENPASTE(x, y) x ## y
 #define TOKENPASTE2(x, y) TOKENPASTE(x, y)
 #define PREDICATE(name, arity, body) static int TOKENPASTE2(PRED_, __LINE__) body
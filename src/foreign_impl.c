@@ -10,6 +10,8 @@
 #include "char_conversion.h"
 #include "term_writer.h"
 #include "record.h"
+#include "findall.h"
+#include "dcg.h"
 #include "string_builder.h"
 #include <stdio.h>
 #include <ctype.h>
@@ -292,30 +294,25 @@ NONDET_PREDICATE(clause, 2, (word head, word body, word backtrack)
    {
       return 0; // Error
    }
-   Predicate p = lookup_predicate(module, functor);
-   if (p == NULL)
-      return FAIL;
-   if ((p->flags & PREDICATE_DYNAMIC) == 0)
-      return permission_error(accessAtom, privateProcedureAtom, predicate_indicator(head));
-   word list;
+   ClauseCursor cursor;
    if (backtrack == 0)
-      list = term_from_list(&p->clauses, emptyListAtom);
-   else
-      list = backtrack;
-   if (list == emptyListAtom)
-      return FAIL;
-   if (TAGOF(list) == COMPOUND_TAG && FUNCTOROF(list) == listFunctor)
-      make_foreign_choicepoint(ARGOF(list,1));
-   word clause = ARGOF(list, 0);
-   if (TAGOF(clause) == COMPOUND_TAG)
    {
-      return unify(ARGOF(clause,0), head) && unify(ARGOF(clause,1), body);
+      Predicate p = lookup_predicate(module, functor);
+      if (p == NULL)
+         return FAIL;
+      if ((p->flags & PREDICATE_DYNAMIC) == 0)
+         return permission_error(accessAtom, privateProcedureAtom, predicate_indicator(head));
+      cursor = open_clause_cursor(p, MAKE_VCOMPOUND(clauseFunctor, head, body));
    }
    else
+      cursor = GET_POINTER(backtrack);
+   Clause c = next_clause(cursor);
+   if (c == NULL)
    {
-      return unify(clause, head) && unify(trueAtom, body);
+      close_clause_cursor(cursor);
+      return FAIL;
    }
-
+   return next_clause_solution(cursor, c, head, body);
 })
 
 // 8.8.2
@@ -338,7 +335,9 @@ NONDET_PREDICATE(current_predicate, 1, (word indicator, word backtrack)
    {
       List list;
       init_list(&list);
+      LOCK_GLOBALS();
       whashmap_iterate(get_current_module()->predicates, build_predicate_list, &list);
+      UNLOCK_GLOBALS();
       predicates = term_from_list(&list, emptyListAtom);
       free_list(&list);
    }
@@ -384,7 +383,6 @@ PREDICATE(assertz, 1, (word term)
 // 8.9.3
 NONDET_PREDICATE(retract, 1, (word term, word backtrack)
 {
-   word list;
    Module m;
    word clause;
    if (TAGOF(term) == COMPOUND_TAG && FUNCTOROF(term) == crossModuleCallFunctor)
@@ -399,6 +397,14 @@ NONDET_PREDICATE(retract, 1, (word term, word backtrack)
       m = get_current_module();
       clause = term;
    }
+   word head = clause;
+   word body = trueAtom;
+   if (TAGOF(clause) == COMPOUND_TAG && FUNCTOROF(clause) == clauseFunctor)
+   {
+      head = ARGOF(clause, 0);
+      body = ARGOF(clause, 1);
+   }
+   ClauseCursor cursor;
    if (backtrack == 0)
    {
       word functor;
@@ -411,23 +417,20 @@ NONDET_PREDICATE(retract, 1, (word term, word backtrack)
       }
       if ((p->flags & PREDICATE_DYNAMIC) == 0)
          return permission_error(modifyAtom, staticProcedureAtom, predicate_indicator(functor));
-      list = term_from_list(&p->clauses, emptyListAtom);
+      cursor = open_clause_cursor(p, MAKE_VCOMPOUND(clauseFunctor, head, body));
    }
    else
-      list = backtrack;
-   if (list == emptyListAtom)
+      cursor = GET_POINTER(backtrack);
+   // Skip any clauses which something else has retracted since the cursor found them
+   Clause c;
+   while ((c = next_clause(cursor)) != NULL && !retract_clause(cursor, c))
+      ;
+   if (c == NULL)
+   {
+      close_clause_cursor(cursor);
       return FAIL;
-   if (TAGOF(list) == COMPOUND_TAG && FUNCTOROF(list) == listFunctor && ARGOF(list, 1) != emptyListAtom)
-   {
-      make_foreign_choicepoint(ARGOF(list, 1));
    }
-   if (unify(ARGOF(list, 0), term))
-   {
-      retract(m, term);
-      return SUCCESS;
-   }
-   else
-      return FAIL;
+   return next_clause_solution(cursor, c, head, body);
 })
 
 // 8.9.4
@@ -1618,57 +1621,114 @@ PREDICATE(recordz, 3, (word key, word term, word ref)
 
 PREDICATE(erase, 1, (word ref)
 {
+   if (TAGOF(ref) == VARIABLE_TAG)
+      return instantiation_error();
+   if (TAGOF(ref) != POINTER_TAG)
+      return type_error(dbReferenceAtom, ref);
    return _erase(ref);
 })
 
-// Note there is a known bug here
-// If you use recorded/3 to get a list, then erase one of the items, then backtrack, you will end up with the wrong value
-// This is because we get the list again each time recorded/3 is called OR redone. But on redo, we keep the index in the list
-// In many cases you can use this to get a reference to a subsequently-freed clause, resulting in a crash
-// However, it is safe if called from the code in builtin.pl, and that is currently all I anticipate anyone using it for
 NONDET_PREDICATE(recorded, 3, (word key, word value, word ref, word backtrack)
 {
-   if (TAGOF(ref) == POINTER_TAG)
+   RecordCursor cursor;
+   if (backtrack != 0)
+      cursor = GET_POINTER(backtrack);
+   else if (TAGOF(ref) == POINTER_TAG)
    {
       // Deterministic case
       word k;
       word v;
       return recorded(ref, &k, &v) && unify(k, key) && unify(v, value);
    }
+   else if (TAGOF(ref) != VARIABLE_TAG)
+      return type_error(dbReferenceAtom, ref);
    else
    {
-      if (TAGOF(ref) == VARIABLE_TAG)
-      {
-         List* list;
-         int index;
-         if (TAGOF(key) == CONSTANT_TAG)
-            list = find_records(key);
-         else if (TAGOF(key) == COMPOUND_TAG)
-            list = find_records(FUNCTOROF(key));
-         else if (TAGOF(key) == VARIABLE_TAG)
-            return instantiation_error();
-         else
-            return type_error(dbReferenceAtom, key);
-         if (backtrack == 0)
-            index = 0;
-         else
-            index = getConstant(backtrack, NULL).integer_data;
-         if (list == NULL)
-            return FAIL;
-         if (list_length(list) < index)
-            return FAIL;
-         if (list_length(list) - index != 1)
-         {
-            make_foreign_choicepoint(MAKE_INTEGER(index+1));
-         }
-         word head = list_element(list, index);
-         // DANGER! head contains references to the local storage! We must copy it to the heap or it will no longer be valid after erased!
-         return unify(value, copy_term(ARGOF(head, 0))) && unify(ref, ARGOF(head, 1));
-      }
+      if (TAGOF(key) == CONSTANT_TAG)
+         cursor = open_record_cursor(key, value);
+      else if (TAGOF(key) == COMPOUND_TAG)
+         cursor = open_record_cursor(FUNCTOROF(key), value);
+      else
+         return instantiation_error();
+      if (cursor == NULL)
+         return FAIL;
    }
-   return type_error(dbReferenceAtom, key);
+   Record record = next_record(cursor);
+   if (record == NULL)
+   {
+      close_record_cursor(cursor);
+      return FAIL;
+   }
+   int more = has_next_record(cursor);
+   if (more)
+      make_foreign_cleanup_choicepoint(MAKE_POINTER(cursor), _close_record_cursor, 0);
+   // The term is in the local storage of the record, so we must copy it to the heap before the record can be freed
+   word copy = copy_term(record_term(record));
+   word dbref = record_ref(record);
+   if (!more)
+      close_record_cursor(cursor);
+   return unify(value, copy) && unify(ref, dbref);
+})
+
+// Solution bags for findall/3, findall/4 and aggregate_all/3 (see findall.c). A bag is freed by $bag_collect/3, $bag_value/2 or $bag_free/1
+PREDICATE($bag_create, 1, (word bag)
+{
+   return unify(bag, MAKE_POINTER(create_bag()));
 })
 
+PREDICATE($bag_add, 2, (word bag, word term)
+{
+   bag_add(GET_POINTER(bag), term);
+   return SUCCESS;
+})
+
+PREDICATE($bag_collect, 3, (word bag, word tail, word list)
+{
+   // Collecting the bag can move the heap
+   register_root(&list);
+   word result = bag_collect(GET_POINTER(bag), tail);
+   unregister_root(&list);
+   return unify(list, result);
+})
+
+PREDICATE($bag_aggregate, 3, (word bag, word op, word x)
+{
+   if (!bag_aggregate(GET_POINTER(bag), op, x))
+      return ERROR;
+   return SUCCESS;
+})
+
+PREDICATE($bag_value, 2, (word bag, word value)
+{
+   word v = bag_value(GET_POINTER(bag));
+   free_bag(GET_POINTER(bag));
+   return v != 0 && unify(value, v);
+})
+
+PREDICATE($bag_free, 1, (word bag)
+{
+   free_bag(GET_POINTER(bag));
+   return SUCCESS;
+})
+
+PREDICATE(dcg_translate_rule, 2, (word rule, word clause)
+{
+   word translated;
+   if (TAGOF(rule) == VARIABLE_TAG)
+      return instantiation_error();
+   if (!(TAGOF(rule) == COMPOUND_TAG && FUNCTOROF(rule) == dcgRuleFunctor))
+      return type_error(dcgRuleAtom, rule);
+   return dcg_translate_rule(rule, &translated) && unify(clause, translated);
+})
+
+// Used by phrase/3 to turn a grammar body into the goal to call
+PREDICATE($dcg_body, 4, (word body, word s0, word s, word goal)
+{
+   word translated;
+   if (TAGOF(body) == VARIABLE_TAG)
+      return instantiation_error();
+   return dcg_translate_body(body, s0, s, &translated) && unify(goal, translated);
+})
 
 NONDET_PREDICATE(between, 3, (word low, word high, word value, word backtrack)
 {
@@ -1797,6 +1857,96 @@ PREDICATE(sort, 2, (word in, word out)
    return unify(out, list);
 })
 
+// Used by bagof/3 and setof/3. pairs is a list of Witness-Template as found by findall/3. The solutions are grouped by hashing their
+// witnesses so that variants end up in the same group, and the witnesses in each group are unified. groups is then unified with a list
+// of Witness-Templates for each group, in standard order of the witnesses. If sort is true, as for setof/3, each list of templates is
+// sorted and has duplicates removed
+PREDICATE($group_solutions, 3, (word pairs, word sort, word groups)
+{
+   int n = 0;
+   for (word list = pairs; TAGOF(list) == COMPOUND_TAG && FUNCTOROF(list) == listFunctor; list = ARGOF(list, 1))
+      n++;
+   if (n == 0)
+      return unify(groups, emptyListAtom);
+   // The result needs at most 9 cells per solution. Reserve them now, since this can move the heap
+   register_root(&pairs);
+   register_root(&groups);
+   reserve_heap(9 * n);
+   unregister_root(&groups);
+   unregister_root(&pairs);
+
+   word* witnesses = malloc(sizeof(word) * n);
+   word* templates = malloc(sizeof(word) * n);
+   int* next = malloc(sizeof(int) * n);
+   struct solution_group* group_data = malloc(sizeof(struct solution_group) * n);
+   int group_count = 0;
+   wmap_t map = whashmap_new();
+   word list = pairs;
+   for (int i = 0; i < n; i++, list = ARGOF(list, 1))
+   {
+      witnesses[i] = ARGOF(ARGOF(list, 0), 0);
+      templates[i] = ARGOF(ARGOF(list, 0), 1);
+      next[i] = -1;
+      word hash = variant_hash(witnesses[i]);
+      int latest = -1;
+      int g = -1;
+      any_t value;
+      if (whashmap_get(map, hash, &value) == MAP_OK)
+      {
+         latest = (int)(intptr_t)value;
+         for (g = latest; g != -1 && !is_variant(group_data[g].witness, witnesses[i]); g = group_data[g].collision)
+            ;
+      }
+      if (g == -1)
+      {
+         g = group_count++;
+         group_data[g].witness = witnesses[i];
+         group_data[g].first = i;
+         group_data[g].last = i;
+         group_data[g].collision = latest;
+         whashmap_put(map, hash, (any_t)(intptr_t)g);
+      }
+      else
+      {
+         next[group_data[g].last] = i;
+         group_data[g].last = i;
+         // The witnesses are variants, so this just shares their variables
+         unify(witnesses[i], group_data[g].witness);
+      }
+   }
+   whashmap_free(map);
+
+   struct solution_group** order = malloc(sizeof(struct solution_group*) * group_count);
+   for (int g = 0; g < group_count; g++)
+      order[g] = &group_data[g];
+   qsort(order, group_count, sizeof(struct solution_group*), qcompare_groups);
+
+   // Build the list backwards. witnesses is reused to hold the templates of each group in turn
+   word result = emptyListAtom;
+   for (int g = group_count-1; g >= 0; g--)
+   {
+      int count = 0;
+      for (int i = order[g]->first; i != -1; i = next[i])
+         witnesses[count++] = templates[i];
+      if (sort == trueAtom)
+         qsort(witnesses, count, sizeof(word), qcompare_terms);
+      word bag = emptyListAtom;
+      while (--count >= 0)
+      {
+         if (sort == trueAtom && bag != emptyListAtom && term_difference(witnesses[count], ARGOF(bag, 0)) == 0)
+            continue;
+         bag = MAKE_VCOMPOUND(listFunctor, witnesses[count], bag);
+      }
+      result = MAKE_VCOMPOUND(listFunctor, MAKE_VCOMPOUND(hyphenPairFunctor, order[g]->witness, bag), result);
+   }
+   free(order);
+   free(group_data);
+   free(next);
+   free(templates);
+   free(witnesses);
+   return unify(groups, result);
+})
+
 PREDICATE(format, 2, (word fmt, word args)
 {
     return format(current_output->term, fmt, args);
@@ -2162,7 +2312,7 @@ PREDICATE(nb_setarg, 3, (word arg, word term, word value)
    if (!must_be_positive_integer(arg))
       return ERROR;
    long i = getConstant(arg, NULL).integer_data;
-   *((Word)(((Word*)(DEREF(term) & ~TAG_MASK))+i)) = value;
+   ARGPOF(term)[i-1] = value;
    return SUCCESS;
 })
 
@@ -2236,6 +2386,12 @@ PREDICATE($heap_usage, 1, (word u)
    return unify(MAKE_INTEGER(heap_usage()), u);
 })
 
+PREDICATE(garbage_collect, 0, ()
+{
+   collect_garbage();
+   return SUCCESS;
+})
+
 PREDICATE($yield, 2, (word key, word ptr)
 {
    printf("Yielding for "); PORTRAY(key); printf(" at %p\n", current_yield());
@@ -0,0 +1,260 @@
+#include "global.h"
+#include "kernel.h"
+#include "ctable.h"
+#include "gc.h"
+#include "list.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+/* Garbage collection of the heap (aka Global Stack)
+
+   This is a sliding mark-compact collector. It is only ever run from a safe point in execute() (or from a foreign predicate called via
+   I_FOREIGN, which is equivalent), since it moves things around and any heap references held in C locals would be invalidated.
+
+   1) Mark. Starting from the roots, set a bit in a bitmap (one per heap cell) for every cell that is reachable. The roots are:
+      A) The slots of every live frame, and the args of every live choicepoint. These are found by following the parent links from FR,
+         and the CP links from CP and from every choicepoint saved by push_state(), and the FR chain of each of those choicepoints. We
+         keep a bitmap of the stack so that we only visit each frame once. We cannot just scan everything below SP, since cutting a
+         choicepoint leaves the frames above it there until the next call, and they would keep all their terms alive. Slots which have
+         not been initialised yet may still contain stale values, so references to compound terms are only followed if they point at a
+         functor cell, and references to list cells only if neither of their cells is one
+      B) ARGS up to ARGP, the argStack, and ARGP itself
+      C) Anything registered with register_root()
+      Note that we mark cells individually rather than whole terms, so a variable in the middle of an otherwise unreachable term keeps
+      only that cell alive.
+   2) The trail is not a root. If a trailed cell on the heap is not reachable then nothing can observe it being reset on backtracking,
+      so we point the trail entry at a dummy cell instead. This also means we never have to keep the value it is bound to alive.
+   3) Compute, for every 64-cell block of the bitmap, how many cells are marked in all the blocks before it. The new address of a cell
+      (or any address in the heap, such as choicepoint->H) is then HEAP + the number of marked cells below it, which we can find with
+      one lookup and a popcount. Because the relative order of cells never changes, neither does the relative age of variables, and
+      choicepoint->H still separates the cells created before the choicepoint from those created after it.
+   4) Adjust every reference into the heap: everything we scanned in step 1, plus the trail. Here we adjust everything below SP rather
+      than just the live frames, which also catches choicepoint->H. Adjusting a stale value is harmless.
+   5) Slide the marked cells down, adjusting the references they hold as we go.
+*/
+
+int gc_enabled = 1;
+int gc_threshold = 50;
+
+// Each thread collects the heap of its own engine, so these are all thread-local
+THREAD_LOCAL word dead_cell;
+THREAD_LOCAL uint64_t* gc_marks = NULL;
+THREAD_LOCAL size_t* gc_counts = NULL;
+THREAD_LOCAL uint64_t* gc_visited = NULL;
+THREAD_LOCAL word** gc_stack = NULL;
+THREAD_LOCAL size_t gc_stack_size = 0;
+THREAD_LOCAL size_t gc_stack_capacity = 0;
+
+#define CELL_MARKED(i) (gc_marks[(i) >> 6] & ((uint64_t)1 << ((i) & 63)))
+#define MARK_CELL(i) gc_marks[(i) >> 6] |= ((uint64_t)1 << ((i) & 63))
+
+void gc_push(word* p)
+{
+   if (gc_stack_size == gc_stack_capacity)
+   {
+      gc_stack_capacity = (gc_stack_capacity == 0)?1024:gc_stack_capacity*2;
+      gc_stack = realloc(gc_stack, sizeof(word*) * gc_stack_capacity);
+      if (gc_stack == NULL)
+         fatal("Out of memory during garbage collection");
+   }
+   gc_stack[gc_stack_size++] = p;
+}
+
+int is_functor_cell(word* p)
+{
+   return TAGOF(*p) == CONSTANT_TAG && getConstantType(*p) == FUNCTOR_TYPE;
+}
+
+// Mark a single cell referred to by a variable, and schedule its contents to be marked
+void gc_mark_cell(word* p)
+{
+   size_t i = p - HEAP;
+   if (CELL_MARKED(i))
+      return;
+   // Variables never point at functor cells, but raw pointers like choicepoint->H can. Do not treat these as reachable, since then
+   // the functor would survive without its arguments
+   if (is_functor_cell(p))
+      return;
+   MARK_CELL(i);
+   gc_push(p);
+}
+
+void gc_mark_word(word w)
+{
+   if (TAGOF(w) == VARIABLE_TAG)
+   {
+      if ((Word)w >= HEAP && (Word)w < H)
+         gc_mark_cell((Word)w);
+   }
+   else if (IS_LIST_CELL(w))
+   {
+      // A list cell has no functor cell, so the best we can do to check a stale reference is that neither of its cells is one
+      word* p = COMPOUND_ADDRESS(w);
+      if (p < HEAP || p + 1 >= H || is_functor_cell(p) || is_functor_cell(p + 1))
+         return;
+      for (int i = 0; i < 2; i++)
+      {
+         if (!CELL_MARKED(p + i - HEAP))
+         {
+            MARK_CELL(p + i - HEAP);
+            gc_push(p + i);
+         }
+      }
+   }
+   else if (TAGOF(w) == COMPOUND_TAG)
+   {
+      word* p = COMPOUND_ADDRESS(w);
+      if (p < HEAP || p >= H || CELL_MARKED(p - HEAP))
+         return;
+      if (!is_functor_cell(p))
+         return;
+      int arity = FUNCTOR_ARITY(*p);
+      if (p + arity >= H)
+         return;
+      MARK_CELL(p - HEAP);
+      for (int i = 1; i <= arity; i++)
+      {
+         if (!CELL_MARKED(p + i - HEAP))
+         {
+            MARK_CELL(p + i - HEAP);
+            gc_push(p + i);
+         }
+      }
+   }
+}
+
+void gc_mark_from(word w)
+{
+   gc_mark_word(w);
+   while (gc_stack_size > 0)
+      gc_mark_word(*gc_stack[--gc_stack_size]);
+}
+
+// Returns 1 if the frame or choicepoint at p has already been visited
+int gc_visit(void* p)
+{
+   size_t i = (word*)p - STACK;
+   if (gc_visited[i >> 6] & ((uint64_t)1 << (i & 63)))
+      return 1;
+   gc_visited[i >> 6] |= ((uint64_t)1 << (i & 63));
+   return 0;
+}
+
+void gc_mark_frames(Frame f)
+{
+   for (; f != NULL && !gc_visit(f); f = f->parent)
+   {
+      if (f->clause == NULL)
+         continue;
+      for (int i = 0; i < f->clause->slot_count; i++)
+         gc_mark_from(f->slots[i]);
+   }
+}
+
+void gc_mark_choicepoints(Choicepoint c)
+{
+   for (; c != NULL && !gc_visit(c); c = c->CP)
+   {
+      for (int i = 0; i < c->argc; i++)
+         gc_mark_from(c->args[i]);
+      gc_mark_frames(c->FR);
+      gc_mark_frames(c->cleanup);
+   }
+}
+
+void _gc_mark_state(word w, void* ignored)
+{
+   gc_mark_choicepoints(((State)w)->choicepoint);
+}
+
+// Returns the address that p will have after compaction. p must be in [HEAP, H]
+word* gc_new_address(word* p)
+{
+   size_t i = p - HEAP;
+   uint64_t below = gc_marks[i >> 6] & (((uint64_t)1 << (i & 63)) - 1);
+   return HEAP + gc_counts[i >> 6] + __builtin_popcountll(below);
+}
+
+word gc_relocate(word w)
+{
+   word* p = COMPOUND_ADDRESS(w);
+   if ((TAGOF(w) == VARIABLE_TAG || TAGOF(w) == COMPOUND_TAG) && p >= HEAP && p <= H)
+      return (word)gc_new_address(p) | (w & ADDRESS_MASK);
+   return w;
+}
+
+void collect_garbage()
+{
+   size_t cells = H - HEAP;
+   size_t blocks = (cells >> 6) + 1;
+   gc_marks = calloc(blocks, sizeof(uint64_t));
+   gc_counts = malloc(sizeof(size_t) * blocks);
+   gc_visited = calloc(((STOP - STACK) >> 6) + 1, sizeof(uint64_t));
+   if (gc_marks == NULL || gc_counts == NULL || gc_visited == NULL)
+      fatal("Out of memory during garbage collection");
+
+   // Step 1: Mark
+   gc_mark_frames(FR);
+   gc_mark_choicepoints(CP);
+   list_apply(&saved_states, NULL, _gc_mark_state);
+   if (ARGP >= ARGS && ARGP <= ATOP)
+   {
+      for (word* p = ARGS; p < ARGP; p++)
+         gc_mark_from(*p);
+   }
+   for (uintptr_t* p = argStack; p < argStackP; p++)
+      gc_mark_from(*p & ~1);
+   gc_mark_from((word)ARGP);
+   for (int i = 0; i < heap_root_count; i++)
+      gc_mark_from(*heap_roots[i]);
+
+   // Step 2: Trail entries for unreachable cells are no longer needed
+   dead_cell = (word)&dead_cell;
+   for (word* p = TRAIL; p < TR; p++)
+   {
+      if ((Word)*p >= HEAP && (Word)*p < H && !CELL_MARKED((Word)*p - HEAP))
+         *p = (word)&dead_cell;
+   }
+
+   // Step 3: Count
+   size_t live = 0;
+   for (size_t i = 0; i < blocks; i++)
+   {
+      gc_counts[i] = live;
+      live += __builtin_popcountll(gc_marks[i]);
+   }
+
+   // Step 4: Adjust references from outside the heap
+   for (word* p = STACK; p < SP; p++)
+      *p = gc_relocate(*p);
+   for (word* p = TRAIL; p < TR; p++)
+      *p = gc_relocate(*p);
+   for (word* p = ARGS; p < ATOP; p++)
+      *p = gc_relocate(*p);
+   for (uintptr_t* p = argStack; p < argStackP; p++)
+      *p = gc_relocate(*p & ~1) | (*p & 1);
+   ARGP = (Word)gc_relocate((word)ARGP);
+   for (int i = 0; i < heap_root_count; i++)
+      *heap_roots[i] = gc_relocate(*heap_roots[i]);
+
+   // Step 5: Compact
+   word* dest = HEAP;
+   for (size_t i = 0; i < cells; i++)
+   {
+      if (CELL_MARKED(i))
+         *(dest++) = gc_relocate(HEAP[i]);
+   }
+   assert(dest == HEAP + live);
+   H = dest;
+   if (HMAX > H)
+      HMAX = H;
+
+   free(gc_marks);
+   free(gc_counts);
+   free(gc_visited);
+   gc_marks = NULL;
+   gc_counts = NULL;
+   gc_visited = NULL;
+}
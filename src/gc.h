@@ -0,0 +1,6 @@
+#include "types.h"
+
+extern int gc_enabled;
+extern int gc_threshold;
+
+void collect_garbage();
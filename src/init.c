@@ -12,6 +12,8 @@
 #include "prolog_flag.h"
 #include "record.h"
 #include "char_conversion.h"
+#include "threads.h"
+#include "operators.h"
 
 EMSCRIPTEN_KEEPALIVE
 void init_prolog()
@@ -19,7 +21,9 @@ void init_prolog()
 #ifdef MEMTRACE
    mp_set_memory_functions(trace_malloc_gmp, trace_realloc_gmp, trace_free_gmp);
 #endif
+   initialize_threads();
    initialize_constants();
+   initialize_operators();
    initialize_prolog_flags();
    initialize_database();
    initialize_modules();
@@ -9,6 +9,10 @@
    Because we already created the frame, it is too late to put the choicepoint before it (unless we move the frame up)
    In the interest of efficiency, this choicepoint is created AFTER the frame it relates to
 
+   In fact it is not even created until the head has been matched. Until then we are in 'shallow' mode: shallow_clause is the clause to try
+   next, and shallow_H and shallow_TR are what H and TR were before the head. If the head fails, we just undo it and carry on with the
+   next clause. Since ARGS is not changed by matching a head, it still holds the arguments for it
+
  */
 
 #define RECORD_HEAP_USAGE  (void)0
@@ -33,6 +37,9 @@
 #include "prolog_flag.h"
 #include "foreign.h"
 #include "checks.h"
+#include "gc.h"
+#include "arithmetic.h"
+#include "dcg.h"
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -44,7 +51,8 @@ enum MODE
 {
    READ,
    WRITE,
-} mode;
+};
+THREAD_LOCAL enum MODE mode;
 
 
 instruction_info_t instruction_info[] = {
@@ -72,40 +80,92 @@ instruction_info_t instruction_info[] = {
 int debugging = 0;
 
 
-uint8_t* PC;
-int halted = 0;
-Choicepoint CP = NULL;
-#define HEAP_SIZE 655350
+/* Engines
+
+   An engine is everything that is needed to run a query: the heap, stack, trail, ARGS and argStack, and the registers that point into
+   them. Engines share everything else: the constant table, modules and their clauses, prolog flags and the record database.
+
+   execute() and everything it calls work on the registers below as plain globals, since an extra indirection on every access to H or
+   SP would cost us on every instruction. The globals are thread-local, and each thread has at most one active engine, whose registers
+   live in these globals. The registers of every other engine are saved in its struct engine, and activate_engine() swaps them over.
+   An engine must only be active in one thread at a time. The first engine is created by initialize_kernel(), and each thread in a
+   thread pool creates its own (see threads.c). Engines must not be switched while the active engine is in the middle of execute(),
+   except from a foreign predicate, which must switch back before it returns.
+*/
+
+#define ENGINE_REGISTERS(X) \
+   X(word*, PC) \
+   X(int, halted) \
+   X(Choicepoint, CP) \
+   X(Frame, FR) \
+   X(Frame, NFR) \
+   X(word*, ARGP) \
+   X(word*, TRAIL) \
+   X(word*, TTOP) \
+   X(word*, TR) \
+   X(word*, HEAP) \
+   X(word*, HTOP) \
+   X(word*, H) \
+   X(word*, HMAX) \
+   X(word*, HLIMIT) \
+   X(size_t, heap_size) \
+   X(word*, STACK) \
+   X(word*, STOP) \
+   X(word*, SP) \
+   X(List, saved_states) \
+   X(word**, heap_roots) \
+   X(int, heap_root_count) \
+   X(int, heap_root_capacity) \
+   X(uintptr_t*, argStack) \
+   X(uintptr_t*, argStackP) \
+   X(uintptr_t*, argStackTop) \
+   X(word*, ARGS) \
+   X(word*, ATOP) \
+   X(struct call_cache**, usercall_cache) \
+   X(ExecutionCallback, current_yield_ptr) \
+   X(Module, currentModule) \
+   X(Choicepoint, initialChoicepoint) \
+   X(Clause, shallow_clause) \
+   X(word*, shallow_H) \
+   X(word*, shallow_TR) \
+   X(int, query_depth) \
+   X(word, current_exception) \
+   X(word*, exception_area) \
+   X(size_t, exception_area_size) \
+   X(size_t, exception_cells) \
+   X(Stream, current_input) \
+   X(Stream, current_output)
+
+#define DEFINE_REGISTER(type, name) THREAD_LOCAL type name;
+ENGINE_REGISTERS(DEFINE_REGISTER)
+#undef DEFINE_REGISTER
+
+struct engine
+{
+#define DEFINE_FIELD(type, name) type name;
+   ENGINE_REGISTERS(DEFINE_FIELD)
+#undef DEFINE_FIELD
+   int active;              // 1 while the engine is active in some thread, so its registers are there rather than here
+   int busy;                // 1 while the engine has a query which it might still run or backtrack into (see start_query())
+};
+
+THREAD_LOCAL Engine current_engine = NULL;
+List engines = {NULL, NULL, 0};
+Module userModule = NULL;
+
+// The heap starts out at HEAP_INITIAL_SIZE cells. Whenever H passes HLIMIT at a safe point we collect garbage, and then grow it
+// (by relocating it) if that did not free up enough space. HEAP_MARGIN is the minimum number of free cells we guarantee to be
+// available after each safe point
+#define HEAP_INITIAL_SIZE 65536
+#define HEAP_MARGIN 4096
+#define HEAP_GROWTH_LIMIT 4
 #define TRAIL_SIZE 327675
 #define STACK_SIZE 65535
 #define ARG_STACK_SIZE 512
-
-word TRAIL[TRAIL_SIZE];
-word* TTOP = &TRAIL[TRAIL_SIZE];
-word* TR = &TRAIL[0];
-word HEAP[HEAP_SIZE];
-word* HTOP = &HEAP[HEAP_SIZE];
-word* H = &HEAP[0];
-word* HMAX = &HEAP[0];
-word STACK[STACK_SIZE];
-word* STOP = &STACK[STACK_SIZE];
-word* SP = &STACK[0];
-uintptr_t argStack[ARG_STACK_SIZE];
-uintptr_t* argStackP = &argStack[0];
-uintptr_t* argStackTop = &argStack[ARG_STACK_SIZE];
-word ARGS[512];
-word* ATOP = &ARGS[512];
-
-ExecutionCallback current_yield_ptr = NULL;
-Frame FR, NFR;
-word *ARGP;
-Module currentModule = NULL;
-Module userModule = NULL;
-Choicepoint initialChoicepoint = NULL;
-word current_exception = 0;
-word* exception_local = NULL;
-Stream current_input = NULL;
-Stream current_output = NULL;
+#define USERCALL_CACHE_SIZE 256
+#define BACKTRACE_DEPTH 64
+#define EXCEPTION_AREA_SIZE 256
+#define ARGS_SIZE 512
 
 void print_choices()
 {
@@ -132,48 +192,208 @@ void fatal(char* string)
    assert(0);
 }
 
+// Words which refer to the heap are variables and compound terms whose address lies within it. Raw pointers such as
+// choicepoint->H are indistinguishable from variables, which is why the upper bound here is inclusive
+#define RELOCATE(w, from, to, delta) if ((TAGOF(w) == VARIABLE_TAG || TAGOF(w) == COMPOUND_TAG) && (uintptr_t)(w) >= (from) && (uintptr_t)(w) <= (to)) (w) += (delta)
+
+void set_heap_limit()
+{
+   // HLIMIT is gc_threshold percent of the way through the heap, but never leaves less than HEAP_MARGIN free
+   size_t limit = heap_size / 100 * gc_threshold;
+   if (heap_size - limit < HEAP_MARGIN)
+      limit = heap_size - HEAP_MARGIN;
+   HLIMIT = HEAP + limit;
+}
+
+void initialize_heap()
+{
+   heap_size = HEAP_INITIAL_SIZE;
+   HEAP = malloc(sizeof(word) * heap_size);
+   if (HEAP == NULL)
+      fatal("Unable to allocate global stack");
+   HTOP = HEAP + heap_size;
+   H = HEAP;
+   HMAX = HEAP;
+   set_heap_limit();
+}
+
+// Moves the heap to a block of new_size cells. Since the heap can move, every pointer into it must be adjusted. These are found on the
+// heap itself, the stack (frame slots, choicepoint args and choicepoint->H), the trail, ARGS, the argStack, ARGP and any registered roots.
+// The stack is scanned conservatively: anything which looks like a reference into the old heap is assumed to be one.
+// This must only be called at a point where no C code is holding on to heap references that are not in one of those places.
+void relocate_heap(size_t new_size)
+{
+   // realloc() may free the old block, so after the call its bounds are only kept as numbers, and H, HMAX and ARGP as offsets
+   uintptr_t old_heap = (uintptr_t)HEAP;
+   uintptr_t old_top = (uintptr_t)HTOP;
+   size_t h_offset = H - HEAP;
+   size_t hmax_offset = HMAX - HEAP;
+   int argp_in_heap = (uintptr_t)ARGP >= old_heap && (uintptr_t)ARGP <= old_top;
+   size_t argp_offset = argp_in_heap ? ARGP - HEAP : 0;
+   word* new_heap = realloc(HEAP, sizeof(word) * new_size);
+   if (new_heap == NULL)
+      fatal("Global stack overflow");
+   intptr_t delta = (uintptr_t)new_heap - old_heap;
+   heap_size = new_size;
+   HEAP = new_heap;
+   HTOP = HEAP + heap_size;
+   H = HEAP + h_offset;
+   HMAX = HEAP + hmax_offset;
+   if (argp_in_heap)
+      ARGP = HEAP + argp_offset;
+   set_heap_limit();
+   if (delta == 0)
+      return;
+   for (word* p = HEAP; p < H; p++)
+      RELOCATE(*p, old_heap, old_top, delta);
+   for (word* p = STACK; p < STOP; p++)
+      RELOCATE(*p, old_heap, old_top, delta);
+   for (word* p = TRAIL; p < TR; p++)
+      RELOCATE(*p, old_heap, old_top, delta);
+   for (word* p = ARGS; p < ATOP; p++)
+      RELOCATE(*p, old_heap, old_top, delta);
+   for (int i = 0; i < heap_root_count; i++)
+      RELOCATE(*heap_roots[i], old_heap, old_top, delta);
+   // The argStack holds raw pointers with the mode in the lowest bit
+   for (uintptr_t* p = argStack; p < argStackP; p++)
+   {
+      if ((*p & ~1) >= old_heap && (*p & ~1) <= old_top)
+         *p += delta;
+   }
+}
+
+// Called at safe points in execute() once H has passed HLIMIT. First try and reclaim some space. If the heap is still more than half way
+// to HLIMIT afterwards, double it until it is not, otherwise we would just end up collecting again almost immediately. With a low
+// gc_threshold that could mean a heap hundreds of times bigger than what is in it, so it is never grown past HEAP_GROWTH_LIMIT times
+// that. If the live data is then still past HLIMIT, we collect again once half of the free space has been used instead
+void grow_heap()
+{
+   if (gc_enabled)
+      collect_garbage();
+   size_t used = H - HEAP;
+   size_t new_size = heap_size;
+   while ((used > new_size / 200 * gc_threshold && new_size < used * HEAP_GROWTH_LIMIT) || new_size - used < HEAP_MARGIN)
+      new_size *= 2;
+   if (new_size != heap_size)
+      relocate_heap(new_size);
+   if (HLIMIT < H + (HTOP - H) / 2)
+      HLIMIT = H + (HTOP - H) / 2;
+}
+
+// Makes sure that at least cells words can be put on the heap, moving it if there is not enough room for them. Like relocate_heap(),
+// this must only be called when any heap references held by C code are registered roots
+void reserve_heap(size_t cells)
+{
+   size_t new_size = heap_size;
+   while (new_size - (H - HEAP) < cells + HEAP_MARGIN)
+      new_size *= 2;
+   if (new_size != heap_size)
+      relocate_heap(new_size);
+}
+
+// Returns a block of cells words at the top of the heap. See reserve_heap()
+Word allocate_heap(size_t cells)
+{
+   reserve_heap(cells);
+   Word block = H;
+   H += cells;
+   RECORD_HEAP_USAGE;
+   return block;
+}
+
+// A safe point is where we can collect garbage on the heap, reclaim code which has been retracted or replaced (see retire_code()), and
+// let other threads free what they have deferred (see defer_free())
+#define SAFE_POINT() do {if (H > HLIMIT) grow_heap(); if (reclaim_wanted) reclaim_code(); if (this_thread.epoch != ATOMIC_LOAD(&free_epoch)) pass_safe_point();} while(0)
+
+// Any C code that needs to hold on to a heap reference across a call to execute() must register it here, since the heap can move
+EMSCRIPTEN_KEEPALIVE
+void register_root(word* root)
+{
+   if (heap_root_count == heap_root_capacity)
+   {
+      heap_root_capacity = (heap_root_capacity == 0)?8:heap_root_capacity*2;
+      heap_roots = realloc(heap_roots, sizeof(word*) * heap_root_capacity);
+   }
+   heap_roots[heap_root_count++] = root;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void unregister_root(word* root)
+{
+   for (int i = heap_root_count-1; i >= 0; i--)
+   {
+      if (heap_roots[i] == root)
+      {
+         heap_roots[i] = heap_roots[--heap_root_count];
+         return;
+      }
+   }
+}
+
 EMSCRIPTEN_KEEPALIVE
 word MAKE_VAR()
 {
+   if (H >= HTOP)
+      fatal("Global stack overflow");
    word newVar = (word)H;
    *H = newVar;
-   assert(H < HTOP);
    H++;
    RECORD_HEAP_USAGE;
    return newVar;
 }
 
-word MAKE_COMPOUND(word functor)
+// Allocates a compound on the heap and returns a reference to it. *args is set to its first argument, which the caller must fill in.
+// A ./2 term is made as a list cell (see IS_LIST_CELL())
+static word allocate_compound(word functor, int arity, Word* args)
 {
+   if (H + arity >= HTOP)
+      fatal("Global stack overflow");
    word addr = (word)H;
-   *H = functor;
-   H++;
-   // Make all the args vars
-   int arity = getConstant(functor, NULL).functor_data->arity;
-   assert(H + arity < HTOP);
-   for (int i = 0; i < arity; i++)
+#ifdef COMPACT_LISTS
+   if (functor == listFunctor)
    {
-      MAKE_VAR();
+      *args = H;
+      H += 2;
+      RECORD_HEAP_USAGE;
+      return addr | LIST_TAG;
    }
+#endif
+   *H = functor;
+   *args = H+1;
+   H += arity+1;
    RECORD_HEAP_USAGE;
    return addr | COMPOUND_TAG;
 }
 
+word MAKE_COMPOUND(word functor)
+{
+   // Make all the args vars
+   int arity = FUNCTOR_ARITY(functor);
+   Word args;
+   word t = allocate_compound(functor, arity, &args);
+   for (int i = 0; i < arity; i++)
+      args[i] = (word)&args[i];
+   return t;
+}
+
+word MAKE_LIST(word head, word tail)
+{
+   Word args;
+   word t = allocate_compound(listFunctor, 2, &args);
+   args[0] = head;
+   args[1] = tail;
+   return t;
+}
+
 word MAKE_VACOMPOUND(word functor, va_list argp)
 {
-   Functor f = getConstant(functor, NULL).functor_data;
-   word addr = (word)H;
-   *H = functor;
-   H++;
-   assert(H + f->arity < HTOP);
-   for (int i = 0; i < f->arity; i++)
-   {
-      word w = va_arg(argp, word);
-      *(H++) = w;
-   }
-   RECORD_HEAP_USAGE;
+   int arity = FUNCTOR_ARITY(functor);
+   Word args;
+   word t = allocate_compound(functor, arity, &args);
+   for (int i = 0; i < arity; i++)
+      args[i] = va_arg(argp, word);
    va_end(argp);
-   return addr | COMPOUND_TAG;
+   return t;
 }
 
 word MAKE_VCOMPOUND(word functor, ...)
@@ -188,53 +408,39 @@ word MAKE_VCOMPOUND(word functor, ...)
 EMSCRIPTEN_KEEPALIVE
 word MAKE_ACOMPOUND(word functor, word* values)
 {
-   int type;
-   cdata c = getConstant(functor, &type);
-   assert(type == FUNCTOR_TYPE);
-   Functor f = c.functor_data;
-   word addr = (word)H;
-   *H = functor;
-   H++;
-   assert(H + f->arity < HTOP);
-   for (int i = 0; i < f->arity; i++)
-      *(H++) = values[i];
-   assert(H < HTOP);
-   RECORD_HEAP_USAGE;
-   return addr | COMPOUND_TAG;
+   assert(getConstantType(functor) == FUNCTOR_TYPE);
+   int arity = FUNCTOR_ARITY(functor);
+   Word args;
+   word t = allocate_compound(functor, arity, &args);
+   for (int i = 0; i < arity; i++)
+      args[i] = values[i];
+   return t;
 }
 
-void _lcompoundarg(word w, void* ignored)
+void _lcompoundarg(word w, void* args)
 {
-   *(H++) = w;
+   Word* next = (Word*)args;
+   *((*next)++) = w;
 }
 
 // You can call MAKE_LCOMPOUND with either an atom or a functor as the first arg.
 // If you call it with an atom, it will make a functor with arity list->size for you
 word MAKE_LCOMPOUND(word functor, List* list)
 {
-   int type;
-   cdata c = getConstant(functor, &type);
-   if (type == ATOM_TYPE)
+   if (getConstantType(functor) == ATOM_TYPE)
       functor = MAKE_FUNCTOR(functor, list_length(list));
-   Functor f = getConstant(functor, NULL).functor_data;
-   word addr = (word)H;
-   *(H++) = functor;
-   assert(H + list_length(list) < HTOP);
-   list_apply(list, NULL, _lcompoundarg);
-   RECORD_HEAP_USAGE;
-   return addr | COMPOUND_TAG;
-}
-
-void _make_backtrace(word cell, void* result)
-{
-   word* r = (word*)result;
-   *r = MAKE_VCOMPOUND(listFunctor, predicate_indicator(DEREF(cell)), *r);
+   Word args;
+   word t = allocate_compound(functor, list_length(list), &args);
+   list_apply(list, &args, _lcompoundarg);
+   return t;
 }
 
-word make_backtrace(List* list)
+// Makes the list of predicate indicators for the given frame functors, which are innermost first. The list is outermost first
+word make_backtrace(word* functors, int count)
 {
    word result = emptyListAtom;
-   list_apply(list, &result, _make_backtrace);
+   for (int i = 0; i < count; i++)
+      result = MAKE_VCOMPOUND(listFunctor, predicate_indicator(functors[i]), result);
    return result;
 }
 
@@ -329,6 +535,8 @@ word MAKE_BLOB(char* type, void* ptr)
 EMSCRIPTEN_KEEPALIVE
 word MAKE_INTEGER(long data)
 {
+   if (data >= SMALLINT_MIN && data <= SMALLINT_MAX)
+      return MAKE_SMALLINT(data);
    return intern(INTEGER_TYPE, long_hash(data), &data, sizeof(long), allocInteger, NULL);
 }
 
@@ -363,11 +571,43 @@ word MAKE_FUNCTOR(word name, int arity)
    return w;
 }
 
+/* A binding only has to be trailed if the variable is older than the newest choicepoint, since backtracking to that choicepoint discards
+   everything newer anyway. Heap cells are older if they are below the choicepoint's H, and frame slots are older if they are below the
+   choicepoint itself, since frames and choicepoints are allocated in order on the same stack. Variables anywhere else are always trailed.
+   A query run via push_state() starts with no CP, so there we compare against the choicepoint that push_state() saved instead.
+   unify_or_undo() needs to be able to undo everything, so it sets force_trail. While a head is matched in shallow mode (see the top of this
+   file) the choicepoint that would be made for the next clause is the newest one. It would be at SP, so everything on the stack is older
+*/
+THREAD_LOCAL int force_trail = 0;
+
+int is_conditional(word var)
+{
+   Choicepoint c = CP;
+   if (force_trail)
+      return 1;
+   if (shallow_clause != NULL)
+      return !IS_HEAP_ADDRESS(var) || (Word)var < shallow_H;
+   if (c == NULL)
+   {
+      if (saved_states.tail == NULL)
+         return 0;
+      c = ((State)saved_states.tail->data)->choicepoint;
+   }
+   if (IS_HEAP_ADDRESS(var))
+      return (Word)var < c->H;
+   if (IS_STACK_ADDRESS(var))
+      return (Word)var < (Word)c;
+   return 1;
+}
+
 void _bind(word var, word value)
 {
    //printf("TR: %d\n", TR);
-   assert(TR < TTOP);
-   *(TR++) = var;
+   if (is_conditional(var))
+   {
+      assert(TR < TTOP);
+      *(TR++) = var;
+   }
    *((Word)var) = value;
 }
 
@@ -408,7 +648,7 @@ void PORTRAY(word w)
    w = DEREF(w);
    if (TAGOF(w) == VARIABLE_TAG)
    {
-      if (w > (word)STACK)
+      if (IS_STACK_ADDRESS(w))
          printf("_L%" PRIpd, (w - (word)STACK));
       else
          printf("_G%" PRIpd, (w - (word)HEAP));
@@ -468,18 +708,18 @@ void PORTRAY(word w)
       printf("Bad tag\n");
 }
 
+// The exception is copied into an area which belongs to the engine and is reused from one exception to the next, so throwing does not
+// normally allocate anything. It is scanned for constants by AGC like the heap, instead of them being acquired and released
 int SET_EXCEPTION(word w)
 {
-   current_exception = copy_local(w, &exception_local);
+   current_exception = copy_local_into(w, &exception_area, &exception_area_size, &exception_cells);
    //printf("Exception has been set to "); PORTRAY(w); printf("\n");
    return 0;
 }
 
 void CLEAR_EXCEPTION()
 {
-   if (exception_local != NULL && TAGOF((word)exception_local) != CONSTANT_TAG)
-      free(exception_local);
-   exception_local = NULL;
+   exception_cells = 0;
    current_exception = 0;
 }
 
@@ -494,42 +734,83 @@ int safe_unify(word a, word b)
 {
    a = DEREF(a);
    b = DEREF(b);
-   if ((TAGOF(a) == COMPOUND_TAG) && (((Word)a) > HTOP || (Word)a < HEAP))
+   if ((TAGOF(a) == COMPOUND_TAG) && !IS_HEAP_ADDRESS(a))
       a = copy_term(a);
-   if ((TAGOF(b) == COMPOUND_TAG) && (((Word)b) > HTOP || (Word)b < HEAP))
+   if ((TAGOF(b) == COMPOUND_TAG) && !IS_HEAP_ADDRESS(b))
       b = copy_term(b);
    return unify(a, b);
 }
 
 
+// When binding two variables together, the younger one must point to the older one. Anything on the heap is older than anything on
+// the stack, which is in turn older than anything else (such as a local copy). Within an area, lower addresses are older.
+// This ensures a variable on the heap never points to a location on the stack
+int var_rank(word v)
+{
+   if (IS_HEAP_ADDRESS(v))
+      return 0;
+   if (IS_STACK_ADDRESS(v))
+      return 1;
+   return 2;
+}
+
+int is_younger_var(word a, word b)
+{
+   int ra = var_rank(a);
+   int rb = var_rank(b);
+   return (ra != rb)?(ra > rb):(a > b);
+}
+
+// This does not recurse, so that unifying a long list or a deeply nested term cannot overflow the C stack. The pairs of arguments still
+// to be unified are kept on a term stack. Each compound is continued with its first argument, and the rest are pushed last to first, so
+// that arguments are unified from left to right and a list needs only a constant amount of stack
 int unify(word a, word b)
 {
-   a = DEREF(a);
-   b = DEREF(b);
-   if (a == b)
-      return SUCCESS;
-   if (TAGOF(a) == VARIABLE_TAG)
-   {
-      if (TAGOF(b) == VARIABLE_TAG && b > a)
-         _bind(b, a);
-      else
-         _bind(a, b);
-      return SUCCESS;
-   }
-   if (TAGOF(b) == VARIABLE_TAG)
-   {
-      _bind(b, a);
-      return SUCCESS;
-   }
-   if ((TAGOF(a) == COMPOUND_TAG) && (TAGOF(b) == COMPOUND_TAG) && (FUNCTOROF(a) == FUNCTOROF(b)))
+   TermStack stack;
+   init_term_stack(&stack);
+   int rc = SUCCESS;
+   while (1)
    {
-      int arity = getConstant(FUNCTOROF(a), NULL).functor_data->arity;
-      for (int i = 0; i < arity; i++)
-         if (!unify(ARGOF(a, i), ARGOF(b, i)))
-            return 0;
-      return SUCCESS;
+      a = DEREF(a);
+      b = DEREF(b);
+      if (a != b)
+      {
+         if (TAGOF(a) == VARIABLE_TAG)
+         {
+            if (TAGOF(b) == VARIABLE_TAG && is_younger_var(b, a))
+               _bind(b, a);
+            else
+               _bind(a, b);
+         }
+         else if (TAGOF(b) == VARIABLE_TAG)
+            _bind(b, a);
+         else if ((TAGOF(a) == COMPOUND_TAG) && (TAGOF(b) == COMPOUND_TAG) && (FUNCTOROF(a) == FUNCTOROF(b)))
+         {
+            int arity = FUNCTOR_ARITY(FUNCTOROF(a));
+            Word args_a = ARGPOF(a);
+            Word args_b = ARGPOF(b);
+            for (int i = arity-1; i > 0; i--)
+            {
+               push_term(&stack, args_a[i]);
+               push_term(&stack, args_b[i]);
+            }
+            a = args_a[0];
+            b = args_b[0];
+            continue;
+         }
+         else
+         {
+            rc = 0;
+            break;
+         }
+      }
+      if (stack.size == 0)
+         break;
+      b = stack.items[--stack.size];
+      a = stack.items[--stack.size];
    }
-   return 0;
+   free_term_stack(&stack);
+   return rc;
 }
 
 void unwind_trail(word* from)
@@ -548,7 +829,9 @@ void unwind_trail(word* from)
 int unify_or_undo(word a, word b)
 {
    word* oldTR = TR;
+   force_trail++;
    int rc = unify(a, b);
+   force_trail--;
    if (!rc)
    {
       word* newTR = TR;
@@ -558,10 +841,37 @@ int unify_or_undo(word a, word b)
    return rc;
 }
 
+// Returns 1 if a and b unify, without binding either of them
+int unifiable(word a, word b)
+{
+   word* oldTR = TR;
+   force_trail++;
+   int rc = unify(a, b);
+   force_trail--;
+   word* newTR = TR;
+   TR = oldTR;
+   unwind_trail(newTR);
+   return rc;
+}
+
+// Once choicepoints have been cut, the trail entries made since the oldest of them for variables which are newer than the remaining CP
+// are no longer needed
+void tidy_trail(word* from)
+{
+   word* to = from;
+   for (word* p = from; p < TR; p++)
+   {
+      if (is_conditional(*p))
+         *(to++) = *p;
+   }
+   TR = to;
+}
+
 // After executing, cut_to(X), we ensure that X is the current choicepoint.
 int cut_to(Choicepoint point)
 {
    word* finalSP = SP;
+   word* tidy_from = NULL;
    while (CP > point)
    {
       if (CP == NULL) // Fatal, I guess?
@@ -592,10 +902,11 @@ int cut_to(Choicepoint point)
          finalSP = AFTER_FRAME(c->FR);
 
       CP = CP->CP;
+      tidy_from = c->TR;
       if (c->foreign_cleanup.fn != NULL)
       {
-         // The PC stored in c->PC is the original PC + 3 + sizeof(word). We want to read out the value at slot [PC + 3 + sizeof(word)]
-         word backtrack_ptr = c->FR->slots[CODE16(c->PC-2)];
+         // The PC stored in c->PC is just after the I_FOREIGN_NONDET instruction, so the last word before it is the slot holding the backtrack pointer
+         word backtrack_ptr = c->FR->slots[c->PC[-1]];
          c->foreign_cleanup.fn(c->foreign_cleanup.arg, backtrack_ptr);
       }
       else if (c->cleanup != NULL)
@@ -615,6 +926,8 @@ int cut_to(Choicepoint point)
       }
    }
    SP = finalSP;
+   if (tidy_from != NULL)
+      tidy_trail(tidy_from);
 
    /*
    word* CPS = (word*)CP + sizeof(choicepoint)/sizeof(word) + (CP != NULL?CP->argc : 0);
@@ -723,6 +1036,12 @@ int backtrack_to(Choicepoint c)
          unwind_trail(oldTR);
          return 0;
       }
+      if (CP->foreign_cleanup.fn != NULL)
+      {
+         // The foreign predicate will not be redone, so let it clean up as it would if it were cut (see cut_to())
+         word backtrack_ptr = CP->FR->slots[CP->PC[-1]];
+         CP->foreign_cleanup.fn(CP->foreign_cleanup.arg, backtrack_ptr);
+      }
       apply_choicepoint(CP); // Modifies CP
       unwind_trail(oldTR);
    }
@@ -730,44 +1049,19 @@ int backtrack_to(Choicepoint c)
 }
 
 
-word _copy_term(word t, List* variables, word* new_vars)
-{
-   if (TAGOF(t) == VARIABLE_TAG)
-   {
-      return new_vars[list_index(variables, t)];
-   }
-   else if (TAGOF(t) == COMPOUND_TAG)
-   {
-      Functor functor = getConstant(FUNCTOROF(t), NULL).functor_data;
-      word new_args[functor->arity];
-      for (int i = 0; i < functor->arity; i++)
-         new_args[i] = _copy_term(ARGOF(t, i), variables, new_vars);
-      return MAKE_ACOMPOUND(FUNCTOROF(t), new_args);
-   }
-   // For everything else, just return the term itself
-   return t;
-}
-
+// Copies term onto the heap. See copy_cells()
 word copy_term(word term)
 {
    term = DEREF(term);
-   List variables;
-   init_list(&variables);
-   find_variables(term, &variables);
-   int variable_count = list_length(&variables);
-   word* new_vars = malloc(sizeof(word) * variable_count);
-   for (int i = 0; i < variable_count; i++)
-      new_vars[i] = MAKE_VAR();
-   word result = _copy_term(term, &variables, new_vars);
-   free(new_vars);
-   free_list(&variables);
+   if (TAGOF(term) == VARIABLE_TAG)
+      return MAKE_VAR();
+   word result;
+   H = copy_cells(term, &result, H, HTOP, 0);
+   RECORD_HEAP_USAGE;
    return result;
 }
 
-
-
-
-void create_choicepoint(unsigned char* address, Clause clause, int type)
+void create_choicepoint(word* address, Clause clause, int type)
 {
    //printf("Creating a choicepoint at %p with frame %p and continuation address %p\n", SP, FR, address);
    Choicepoint c = (Choicepoint)SP;
@@ -789,7 +1083,7 @@ void create_choicepoint(unsigned char* address, Clause clause, int type)
    if (type == Head)
    {
       // We must also copy all the arguments into the choicepoint here
-      c->argc = getConstant(FR->functor, NULL).functor_data->arity;
+      c->argc = FUNCTOR_ARITY(FR->functor);
 //      printf("Saving %d args on the choicepoint\n", c->argc);
       for (int i = 0; i < c->argc; i++)
       {
@@ -803,6 +1097,27 @@ void create_choicepoint(unsigned char* address, Clause clause, int type)
 }
 
 
+// Returns the first clause after c that a call made at the given clause generation can see, or NULL if there are none. Another thread
+// may be asserting or retracting clauses, so each next pointer is only looked at once
+static inline Clause next_visible_clause(Clause c, unsigned long generation)
+{
+   do
+   {
+      c = ATOMIC_LOAD(&c->next);
+   } while (c != NULL && !clause_visible(c, generation));
+   return c;
+}
+
+// Makes the choicepoint for shallow_clause once the head it was deferred for has matched. It must restore H and TR to what they were before
+// the head, rather than what they are now
+void make_shallow_choicepoint()
+{
+   create_choicepoint(shallow_clause->code, shallow_clause, Head);
+   CP->H = shallow_H;
+   CP->TR = shallow_TR;
+   shallow_clause = NULL;
+}
+
 State push_state()
 {
    //printf("Pushing state. CP is %p, PC is %p, FR is %p, and frame locality is %d, ", CP, PC, FR, FR->is_local);
@@ -810,6 +1125,8 @@ State push_state()
    assert(FR->is_local >= 0 && FR->is_local <= 1);
    State s = malloc(sizeof(state));
    s->choicepoint = CP;
+   // Keep track of the state so the garbage collector can find the choicepoint (and frames) it refers to
+   list_append(&saved_states, (word)s);
    //printf("you can get back here by restoring %p\n", state);
    CP = 0;
    //printf("State is now %p\n", state);
@@ -823,64 +1140,109 @@ void restore_state(State state)
    //print_choices();
    // First though, we must cut any choicepoints that might be lurking on the stack
    cut_to(0);
+   for (struct cell_t* c = saved_states.head; c != NULL; c = c->next)
+   {
+      if (c->data == (word)state)
+      {
+         list_splice(&saved_states, c);
+         break;
+      }
+   }
    CP = state->choicepoint;
    //printf("Restoring state. from %p. CP is %p, PC is %p, FR is %p, and frame locality is %d\n", CP, CP->CP, CP->PC, CP->FR, CP->FR->is_local);
    apply_choicepoint(CP);
    assert(FR->is_local >= 0 && FR->is_local <= 1);
+   check_busy();
    //printf("Done. PC is now %p\n", PC);
 }
 
-uint8_t failOp = I_FAIL;
+word failOp = I_FAIL;
 clause failClause = {NULL, &failOp, NULL, 1, 0};
 
-uint8_t exitQueryOp = I_EXIT_QUERY;
+word exitQueryOp = I_EXIT_QUERY;
 clause exitQueryClause = {NULL, &exitQueryOp, NULL, 1, 0};
 
 
 Clause get_predicate_code(Predicate p)
 {
-   if (p->firstClause == NULL)
-      p->firstClause = compile_predicate(p);
-   return p->firstClause;
+   Clause code = ATOMIC_LOAD(&p->firstClause);
+   if (code == NULL)
+   {
+      LOCK_GLOBALS();
+      if (p->firstClause == NULL)
+         ATOMIC_STORE(&p->firstClause, compile_predicate(p));
+      code = p->firstClause;
+      UNLOCK_GLOBALS();
+   }
+   return code;
 }
 
 // prepare_frame fills in all the fields of the frame that make sense.
 // You must still fill in returnPC, and in the case of I_DEPART, parent
-int prepare_frame(word functor, Module optionalContext, Frame frame, Frame parent)
+// If cache is not NULL, it is the cache for the call site, which saves us looking the predicate up again next time
+int prepare_frame(word functor, Module optionalContext, Frame frame, Frame parent, struct call_cache** cache)
 {
    Module module = (optionalContext != NULL)?optionalContext:currentModule;
-   Predicate p = lookup_predicate(module, functor);
-   if (p == NULL && module != userModule)
+   Predicate p;
+   frame->generation = ATOMIC_LOAD(&clause_generation);
+   struct call_cache* entry = (cache != NULL)?ATOMIC_LOAD(cache):NULL;
+   if (entry != NULL && entry->functor == functor && entry->generation == predicate_generation && entry->module == module)
    {
-      //printf("Trying again in user\n");
-      // try again in module(user)
-      p = lookup_predicate(userModule, functor);
-      if (p != NULL)
-      {
-         currentModule = userModule;
-         frame->contextModule = userModule;
-      }
+      p = entry->predicate;
+      if (entry->context != module)
+         currentModule = entry->context;
+      frame->contextModule = entry->context;
    }
-   else if (p != NULL)
+   else
    {
-      frame->contextModule = module;
+      // Read the generation first, so that if the database changes while we are looking, the entry is just considered stale
+      unsigned int generation = ATOMIC_LOAD(&predicate_generation);
+      p = lookup_predicate(module, functor);
+      if (p == NULL && module != userModule)
+      {
+         //printf("Trying again in user\n");
+         // try again in module(user)
+         p = lookup_predicate(userModule, functor);
+         if (p != NULL)
+         {
+            currentModule = userModule;
+            frame->contextModule = userModule;
+         }
+      }
+      else if (p != NULL)
+      {
+         frame->contextModule = module;
+      }
+      if (p != NULL && cache != NULL)
+      {
+         entry = malloc(sizeof(struct call_cache));
+         entry->functor = functor;
+         entry->generation = generation;
+         entry->module = module;
+         entry->predicate = p;
+         entry->context = frame->contextModule;
+         entry = ATOMIC_EXCHANGE(cache, entry);
+         if (entry != NULL)
+            defer_free(free_memory, entry);
+      }
    }
 
    if (p == NULL)
    {
       Functor f = getConstant(functor, NULL).functor_data;
-      if (get_prolog_flag("unknown") == errorAtom)
+      word unknown = get_prolog_flag("unknown");
+      if (unknown == errorAtom)
       {
          //SET_EXCEPTION(procedureAtom);
          return existence_error(procedureAtom, MAKE_VCOMPOUND(predicateIndicatorFunctor, f->name, MAKE_INTEGER(f->arity)));
          return 0;
       }
-      else if (get_prolog_flag("unknown") == failAtom)
+      else if (unknown == failAtom)
       {
          frame->clause = &failClause;
          frame->functor = failFunctor;
       }
-      else if (get_prolog_flag("unknown") == warningAtom)
+      else if (unknown == warningAtom)
       {
          printf("Warning from the ISO committee: No such predicate "); PORTRAY(f->name); printf("/%d\n", f->arity);
          frame->clause = &failClause;
@@ -926,12 +1288,281 @@ Frame allocFrame(Frame parent)
    f->returnPC = 0;
    f->choicepoint = CP;
    f->is_local = 0;
+   f->generation = ATOMIC_LOAD(&clause_generation);
    return f;
 }
 
+// Creates a new engine with its own empty heap, stack and trail. It starts off in the same module and with the same current streams as
+// the active engine. If there is no active engine then the new one becomes active, otherwise the active engine is unchanged
+Engine create_engine()
+{
+   Engine engine = calloc(1, sizeof(struct engine));
+   if (engine == NULL)
+      fatal("Unable to allocate engine");
+   engine->TRAIL = malloc(sizeof(word) * TRAIL_SIZE);
+   engine->STACK = malloc(sizeof(word) * STACK_SIZE);
+   engine->ARGS = malloc(sizeof(word) * ARGS_SIZE);
+   engine->argStack = malloc(sizeof(uintptr_t) * ARG_STACK_SIZE);
+   engine->usercall_cache = calloc(USERCALL_CACHE_SIZE, sizeof(struct call_cache*));
+   engine->exception_area = malloc(sizeof(word) * EXCEPTION_AREA_SIZE);
+   engine->exception_area_size = EXCEPTION_AREA_SIZE;
+   if (engine->TRAIL == NULL || engine->STACK == NULL || engine->ARGS == NULL || engine->argStack == NULL || engine->usercall_cache == NULL || engine->exception_area == NULL)
+      fatal("Unable to allocate engine");
+   engine->TTOP = engine->TRAIL + TRAIL_SIZE;
+   engine->TR = engine->TRAIL;
+   engine->STOP = engine->STACK + STACK_SIZE;
+   engine->SP = engine->STACK;
+   engine->ATOP = engine->ARGS + ARGS_SIZE;
+   engine->ARGP = engine->ARGS;
+   engine->argStackTop = engine->argStack + ARG_STACK_SIZE;
+   engine->argStackP = engine->argStack;
+   engine->currentModule = (currentModule != NULL)?currentModule:userModule;
+   engine->current_input = current_input;
+   engine->current_output = current_output;
+   LOCK_GLOBALS();
+   list_append(&engines, (word)engine);
+   UNLOCK_GLOBALS();
+
+   // The heap and the dummy frame at the top of the stack are most easily set up with the engine active
+   Engine previous = activate_engine(engine);
+   initialize_heap();
+   FR = allocFrame(NULL);
+   FR->functor = systemFunctor;
+   if (previous != NULL)
+      activate_engine(previous);
+   return engine;
+}
+
+// Makes engine the active engine in this thread, and returns the one that was active before. If engine is NULL then the thread is
+// left without an active engine
+Engine activate_engine(Engine engine)
+{
+   Engine previous = current_engine;
+   if (engine == previous)
+      return previous;
+   if (previous != NULL)
+   {
+#define SAVE_REGISTER(type, name) previous->name = name;
+      ENGINE_REGISTERS(SAVE_REGISTER)
+#undef SAVE_REGISTER
+      previous->active = 0;
+   }
+   if (engine != NULL)
+   {
+#define LOAD_REGISTER(type, name) name = engine->name;
+      ENGINE_REGISTERS(LOAD_REGISTER)
+#undef LOAD_REGISTER
+      engine->active = 1;
+   }
+   current_engine = engine;
+   return previous;
+}
+
+/* An engine is busy from when it starts a query until it could not go back into it: the query has returned without leaving any
+   choicepoints or states saved by push_state(), or the engine has been reset. Only a busy engine can still be running code which
+   has been retired (see retire_code()), and then only code which one of its frames or choicepoints refers to
+*/
+void set_busy(int busy)
+{
+   if (current_engine->busy != busy)
+   {
+      LOCK_GLOBALS();
+      current_engine->busy = busy;
+      UNLOCK_GLOBALS();
+   }
+}
+
+void check_busy()
+{
+   if (query_depth == 0 && CP == NULL && saved_states.head == NULL)
+      set_busy(0);
+}
+
+void start_query()
+{
+   query_depth++;
+   set_busy(1);
+}
+
+// Called when a query started by start_query() returns, unless it yielded
+void finish_query()
+{
+   query_depth--;
+   check_busy();
+}
+
+struct clause_walk
+{
+   word* stack;
+   word* stop;
+   uint64_t* visited;       // One bit for each cell of the stack, so that we only visit each frame and choicepoint once
+   void (*fn)(Clause, void*);
+   void (*waiting)(Clause, unsigned long, void*);
+   void* data;
+};
+
+int walk_visit(struct clause_walk* walk, void* p)
+{
+   size_t i = (word*)p - walk->stack;
+   if ((word*)p < walk->stack || (word*)p >= walk->stop)
+      return 0;
+   if (walk->visited[i >> 6] & ((uint64_t)1 << (i & 63)))
+      return 1;
+   walk->visited[i >> 6] |= ((uint64_t)1 << (i & 63));
+   return 0;
+}
+
+void walk_frames(struct clause_walk* walk, Frame f)
+{
+   for (; f != NULL && !walk_visit(walk, f); f = f->parent)
+      walk->fn(f->clause, walk->data);
+}
+
+void walk_choicepoints(struct clause_walk* walk, Choicepoint c)
+{
+   for (; c != NULL && !walk_visit(walk, c); c = c->CP)
+   {
+      walk->fn(c->clause, walk->data);
+      if (c->type == Head)
+         walk->waiting(c->clause, c->FR->generation, walk->data);
+      walk_frames(walk, c->FR);
+      walk_frames(walk, c->cleanup);
+   }
+}
+
+// Frames and choicepoints are found the same way as in collect_garbage(). Everything is below sp
+void walk_engine(struct clause_walk* walk, word* stack, word* sp, Frame fr, Choicepoint cp, List* states, Clause shallow)
+{
+   walk->stack = stack;
+   walk->stop = sp;
+   walk->visited = calloc(((sp - stack) >> 6) + 1, sizeof(uint64_t));
+   if (walk->visited == NULL)
+      fatal("Out of memory while reclaiming code");
+   if (shallow != NULL)
+   {
+      walk->fn(shallow, walk->data);
+      walk->waiting(shallow, fr->generation, walk->data);
+   }
+   walk_frames(walk, fr);
+   walk_choicepoints(walk, cp);
+   for (struct cell_t* c = states->head; c != NULL; c = c->next)
+      walk_choicepoints(walk, ((State)c->data)->choicepoint);
+   free(walk->visited);
+}
+
+// Calls fn with every clause that a frame or choicepoint of a busy engine refers to (some of them more than once, and perhaps NULL), and
+// waiting with each clause that a call is waiting to try next, along with the generation of the call. Returns 0 instead if a busy engine
+// is active in another thread, since we cannot see its registers. Must be called while holding global_lock, and while no other thread is
+// running
+int forall_running_clauses(void (*fn)(Clause, void*), void (*waiting)(Clause, unsigned long, void*), void* data)
+{
+   struct clause_walk walk;
+   walk.fn = fn;
+   walk.waiting = waiting;
+   walk.data = data;
+   for (struct cell_t* c = engines.head; c != NULL; c = c->next)
+   {
+      Engine engine = (Engine)c->data;
+      if (!engine->busy)
+         continue;
+      if (engine == current_engine)
+         walk_engine(&walk, STACK, SP, FR, CP, &saved_states, shallow_clause);
+      else if (engine->active)
+         return 0;
+      else
+         walk_engine(&walk, engine->STACK, engine->SP, engine->FR, engine->CP, &engine->saved_states, engine->shallow_clause);
+   }
+   return 1;
+}
+
+// Throws away everything on the stacks of the active engine, leaving it as it was when it was created
+void reset_engine()
+{
+   cut_to(NULL);
+   query_depth = 0;
+   set_busy(0);
+   CLEAR_EXCEPTION();
+   halted = 0;
+   PC = 0;
+   CP = NULL;
+   H = HEAP;
+   TR = TRAIL;
+   SP = STACK;
+   ARGP = ARGS;
+   argStackP = argStack;
+   FR = NULL;
+   FR = allocFrame(NULL);
+   FR->functor = systemFunctor;
+}
+
+void set_engine_streams(Stream input, Stream output)
+{
+   current_input = input;
+   current_output = output;
+}
+
+Engine get_current_engine()
+{
+   return current_engine;
+}
+
+// Frees an engine and everything on its heap and stacks. The engine must not be active. Any query it was running is abandoned
+void destroy_engine(Engine engine)
+{
+   assert(engine != current_engine);
+   LOCK_GLOBALS();
+   for (struct cell_t* c = engines.head; c != NULL; c = c->next)
+   {
+      if (c->data == (word)engine)
+      {
+         list_splice(&engines, c);
+         break;
+      }
+   }
+   UNLOCK_GLOBALS();
+   for (struct cell_t* c = engine->saved_states.head; c != NULL; c = c->next)
+      free((State)c->data);
+   free_list(&engine->saved_states);
+   free(engine->exception_area);
+   free(engine->heap_roots);
+   free(engine->HEAP);
+   free(engine->TRAIL);
+   free(engine->STACK);
+   free(engine->ARGS);
+   free(engine->argStack);
+   for (int i = 0; i < USERCALL_CACHE_SIZE; i++)
+      free(engine->usercall_cache[i]);
+   free(engine->usercall_cache);
+   free(engine);
+}
+
+// Calls fn with the bounds of the used part of the heap of each engine. Engines which are active in other threads must not be running
+void forall_engine_heaps(void (*fn)(word*, word*))
+{
+   LOCK_GLOBALS();
+   for (struct cell_t* c = engines.head; c != NULL; c = c->next)
+   {
+      Engine engine = (Engine)c->data;
+      // The exception area counts as part of the heap, since the constants in it are not acquired either (see SET_EXCEPTION())
+      if (engine == current_engine)
+      {
+         fn(HEAP, H);
+         fn(exception_area, exception_area + exception_cells);
+      }
+      else
+      {
+         fn(engine->HEAP, engine->H);
+         fn(engine->exception_area, engine->exception_area + engine->exception_cells);
+      }
+   }
+   UNLOCK_GLOBALS();
+}
+
 void initialize_kernel()
 {
    userModule = create_module(userAtom);
+   if (current_engine == NULL)
+      create_engine();
    currentModule = userModule;
    current_input = nullStream();
    current_output = consoleOuputStream();
@@ -949,15 +1580,81 @@ void hard_reset()
 {
    destroy_module(userModule);
    initialize_kernel();
+   // Any other engines were in the user module too
+   for (struct cell_t* c = engines.head; c != NULL; c = c->next)
+      ((Engine)c->data)->currentModule = userModule;
 }
 
 
+/* Instruction dispatch. Each instruction ends with NEXT, which normally just goes back around the loop in execute() to the switch. If the
+   compiler supports computed gotos, we instead jump straight to the code for the next instruction through a table of labels, which saves
+   the loop and the bounds check of the switch, and gives each instruction its own indirect jump for the branch predictor to learn.
+   Emscripten does not support this, so it always uses the switch.
+   halted and debugging can only change during a call to a foreign predicate. When they are set, CHECK_DISPATCH() switches to a table
+   where every entry goes back to the top of the loop, so that we do not have to test them on every instruction
+*/
+#if defined(__GNUC__) && !defined(EMSCRIPTEN)
+#define THREADED_CODE
+#endif
+
+#ifdef THREADED_CODE
+#define CASE(a) case a: a ## _label
+#define NEXT goto *dispatch[*PC]
+#define CHECK_DISPATCH() dispatch = (halted || debugging)?slow_dispatch_table:dispatch_table
+#else
+#define CASE(a) case a
+#define NEXT continue
+#define CHECK_DISPATCH()
+#endif
+
 RC execute(int resume)
 {
+   Clause chain;
+#ifdef THREADED_CODE
+   static void* dispatch_table[] = {
+#define INSTRUCTION(a) &&a ## _label,
+#define INSTRUCTION_CONST(a) &&a ## _label,
+#define INSTRUCTION_CONST_SLOT(a) &&a ## _label,
+#define INSTRUCTION_SLOT(a) &&a ## _label,
+#define INSTRUCTION_ADDRESS(a) &&a ## _label,
+#define INSTRUCTION_SLOT_ADDRESS(a) &&a ## _label,
+#define END_INSTRUCTIONS &&illegal_instruction
+#include "instructions"
+#undef INSTRUCTION
+#undef INSTRUCTION_CONST
+#undef INSTRUCTION_CONST_SLOT
+#undef INSTRUCTION_SLOT
+#undef INSTRUCTION_ADDRESS
+#undef INSTRUCTION_SLOT_ADDRESS
+#undef END_INSTRUCTIONS
+   };
+   static void* slow_dispatch_table[] = {
+#define INSTRUCTION(a) &&slow_dispatch,
+#define INSTRUCTION_CONST(a) &&slow_dispatch,
+#define INSTRUCTION_CONST_SLOT(a) &&slow_dispatch,
+#define INSTRUCTION_SLOT(a) &&slow_dispatch,
+#define INSTRUCTION_ADDRESS(a) &&slow_dispatch,
+#define INSTRUCTION_SLOT_ADDRESS(a) &&slow_dispatch,
+#define END_INSTRUCTIONS &&slow_dispatch
+#include "instructions"
+#undef INSTRUCTION
+#undef INSTRUCTION_CONST
+#undef INSTRUCTION_CONST_SLOT
+#undef INSTRUCTION_SLOT
+#undef INSTRUCTION_ADDRESS
+#undef INSTRUCTION_SLOT_ADDRESS
+#undef END_INSTRUCTIONS
+   };
+   void** dispatch;
+#endif
+   CHECK_DISPATCH();
    if (current_exception != 0)
       goto b_throw_foreign;
    else if (resume)
       goto i_exit;
+#ifdef THREADED_CODE
+slow_dispatch:
+#endif
    while (!halted)
    {
       //print_choices();
@@ -966,28 +1663,31 @@ RC execute(int resume)
          print_instruction();
       switch(*PC)
       {
-         case I_FAIL:
+         CASE(I_FAIL):
             // Simple enough - fail
             if (backtrack())
-               continue;
+               NEXT;
             return FAIL;
-         case I_ENTER:
-            // I_ENTER happens after we have finished matching the head. At this point, all we need to do is move ARGP back to ARGS.
-            // The frame will already have been fully formed, either by the I_CALL/I_DEPART that got us here, or by TRY_ME_OR_NEXT_CLAUSE
+         CASE(I_ENTER):
+            // I_ENTER happens after we have finished matching the head. At this point, all we need to do is move ARGP back to ARGS,
+            // and make the choicepoint for the next clause if TRY_ME_OR_NEXT_CLAUSE found there was one.
+            // The frame will already have been fully formed by the I_CALL/I_DEPART that got us here
+            if (shallow_clause != NULL)
+               make_shallow_choicepoint();
             ARGP = ARGS;
             PC++;
-            continue;
-         case I_EXIT_QUERY:
+            NEXT;
+         CASE(I_EXIT_QUERY):
             // Exit from the toplevel
             if (CP == initialChoicepoint)
                return SUCCESS;
             return SUCCESS_WITH_CHOICES;
-         case I_EXITCATCH:
+         CASE(I_EXITCATCH):
             // If there was no (additional) choicepoint created by the catch/3 goal then we can remove the (fake) one created by I_CATCH
-            if (FR->slots[CODE16(PC+1)] == (word)CP)
+            if (FR->slots[PC[1]] == (word)CP)
                CP = CP->CP;
             goto i_exit;
-         case I_FOREIGN:
+         CASE(I_FOREIGN):
          {
             // A call to a deterministic, native (ie C) predicate
             RC rc = FAIL;
@@ -995,28 +1695,29 @@ RC execute(int resume)
             Functor f = getConstant(FR->functor, NULL).functor_data;
             switch(f->arity)
             {
-               case 0: rc = ((int (*)())((word)(CODEPTR(PC+1))))(); break;
-               case 1: rc = ((int (*)(word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP)); break;
-               case 2: rc = ((int (*)(word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1))); break;
-               case 3: rc = ((int (*)(word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2))); break;
-               case 4: rc = ((int (*)(word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3))); break;
-               case 5: rc = ((int (*)(word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4))); break;
-               case 6: rc = ((int (*)(word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5))); break;
-               case 7: rc = ((int (*)(word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6))); break;
-               case 8: rc = ((int (*)(word,word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7))); break;
-               case 9: rc = ((int (*)(word,word,word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7)), DEREF(*(ARGP+8))); break;
+               case 0: rc = ((int (*)())((word)(PC[1])))(); break;
+               case 1: rc = ((int (*)(word))((word)(PC[1])))(DEREF(*ARGP)); break;
+               case 2: rc = ((int (*)(word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1))); break;
+               case 3: rc = ((int (*)(word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2))); break;
+               case 4: rc = ((int (*)(word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3))); break;
+               case 5: rc = ((int (*)(word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4))); break;
+               case 6: rc = ((int (*)(word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5))); break;
+               case 7: rc = ((int (*)(word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6))); break;
+               case 8: rc = ((int (*)(word,word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7))); break;
+               case 9: rc = ((int (*)(word,word,word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7)), DEREF(*(ARGP+8))); break;
                default:
                   // Too many args! This should be impossible since the installer would have rejected it
                   rc = SET_EXCEPTION(existence_error(procedureAtom, MAKE_VCOMPOUND(predicateIndicatorFunctor, f->name, MAKE_INTEGER(f->arity))));
             }
             current_yield_ptr = yp; // Restore the yield pointer
+            CHECK_DISPATCH();
             // Now handle the consequences. If the exception is non-zero, then assume that the predicate raised it
             if (current_exception != 0)
                goto b_throw_foreign;
             if (rc == FAIL)         // Failure
             {
                if (backtrack())
-                  continue;
+                  NEXT;
                return FAIL;
             }
             else if (rc == SUCCESS) // Success (deterministic)
@@ -1026,15 +1727,15 @@ RC execute(int resume)
             else if (rc == ERROR)   // If the predicate explicitly returns ERROR then we also accept that
                goto b_throw_foreign;
          }
-         case I_FOREIGN_NONDET:
-         case I_FOREIGN_JS:
+         CASE(I_FOREIGN_NONDET):
+         CASE(I_FOREIGN_JS):
             // A call to a nondeterministic foreign predicate. This includes all Javascript predicates - they are all assumed to be nondet.
-            FR->slots[CODE16(PC+1+sizeof(word))] = (word)0;
+            FR->slots[PC[2]] = (word)0;
             // We have to move PC forward since the retry step that we fall-through just below will rewind it
-            PC += (3+sizeof(word));
+            PC += 3;
             // fall-through
-         case I_FOREIGN_JS_RETRY:
-         case I_FOREIGN_RETRY:
+         CASE(I_FOREIGN_JS_RETRY):
+         CASE(I_FOREIGN_RETRY):
          {
             RC rc = FAIL;
             Functor f = getConstant(FR->functor, NULL).functor_data;
@@ -1042,20 +1743,19 @@ RC execute(int resume)
             if (*PC == I_FOREIGN_RETRY || *PC == I_FOREIGN_NONDET) // Native (ie C)
             {
                // Go back to the actual FOREIGN_NONDET or FOREIGN_JS call
-               PC -= (3+sizeof(word));
-               unsigned char* foreign_ptr = PC+1+sizeof(word);
+               PC -= 3;
                switch(f->arity)
                {
-                  case 0: rc = ((int (*)(word))((word)(CODEPTR(PC+1))))(FR->slots[CODE16(foreign_ptr)]); break;
-                  case 1: rc = ((int (*)(word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 2: rc = ((int (*)(word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 3: rc = ((int (*)(word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 4: rc = ((int (*)(word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 5: rc = ((int (*)(word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 6: rc = ((int (*)(word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 7: rc = ((int (*)(word,word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 8: rc = ((int (*)(word,word,word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7)), FR->slots[CODE16(foreign_ptr)]); break;
-                  case 9: rc = ((int (*)(word,word,word,word,word,word,word,word,word,word))((word)(CODEPTR(PC+1))))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7)), DEREF(*(ARGP+8)), FR->slots[CODE16(foreign_ptr)]); break;
+                  case 0: rc = ((int (*)(word))((word)(PC[1])))(FR->slots[PC[2]]); break;
+                  case 1: rc = ((int (*)(word,word))((word)(PC[1])))(DEREF(*ARGP), FR->slots[PC[2]]); break;
+                  case 2: rc = ((int (*)(word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), FR->slots[PC[2]]); break;
+                  case 3: rc = ((int (*)(word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), FR->slots[PC[2]]); break;
+                  case 4: rc = ((int (*)(word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), FR->slots[PC[2]]); break;
+                  case 5: rc = ((int (*)(word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), FR->slots[PC[2]]); break;
+                  case 6: rc = ((int (*)(word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), FR->slots[PC[2]]); break;
+                  case 7: rc = ((int (*)(word,word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), FR->slots[PC[2]]); break;
+                  case 8: rc = ((int (*)(word,word,word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7)), FR->slots[PC[2]]); break;
+                  case 9: rc = ((int (*)(word,word,word,word,word,word,word,word,word,word))((word)(PC[1])))(DEREF(*ARGP), DEREF(*(ARGP+1)), DEREF(*(ARGP+2)), DEREF(*(ARGP+3)), DEREF(*(ARGP+4)), DEREF(*(ARGP+5)), DEREF(*(ARGP+6)), DEREF(*(ARGP+7)), DEREF(*(ARGP+8)), FR->slots[PC[2]]); break;
                   default:
                      // Too many args! This should be impossible since the installer would have rejected it
                      rc = SET_EXCEPTION(existence_error(procedureAtom, MAKE_VCOMPOUND(predicateIndicatorFunctor, f->name, MAKE_INTEGER(f->arity))));
@@ -1064,22 +1764,22 @@ RC execute(int resume)
             else  // Javascript call
             {
 #ifdef EMSCRIPTEN
-               PC -= (3+sizeof(word));
-               unsigned char* foreign_ptr = PC+1+sizeof(word);
+               PC -= 3;
 
-               rc = EM_ASM_INT({return _foreign_call($0, $1, $2, $3)}, FR->slots[CODE16(foreign_ptr)], CODEPTR(PC+1), f->arity, ARGP);
+               rc = EM_ASM_INT({return _foreign_call($0, $1, $2, $3)}, FR->slots[PC[2]], PC[1], f->arity, ARGP);
 #else
                rc = SET_EXCEPTION(existence_error(procedureAtom, MAKE_VCOMPOUND(predicateIndicatorFunctor, f->name, MAKE_INTEGER(f->arity))));
 #endif
             }
             current_yield_ptr = yp;
+            CHECK_DISPATCH();
             // Handle the consequences. See the comments in I_FOREIGN
             if (current_exception != 0)
                goto b_throw_foreign;
             if (rc == FAIL)
             {
                if (backtrack())
-                  continue;
+                  NEXT;
                return FAIL;
             }
             else if (rc == SUCCESS)
@@ -1089,9 +1789,13 @@ RC execute(int resume)
             else if (rc == ERROR)
                goto b_throw_foreign;
          }
+         CASE(I_EXIT_FACT):
+            // The end of the head of a fact, so the same as I_ENTER followed by I_EXIT
+            if (shallow_clause != NULL)
+               make_shallow_choicepoint();
+            // fall-through
          i_exit:
-         case I_EXIT:
-         case I_EXIT_FACT:
+         CASE(I_EXIT):
          {
             // Exit from the current frame. We need to hop back to the parent frame and continue execution from there
             // If, as we move the frame pointer back to the parent, we don't pass any choicepoints, we can trim the stack back to that point
@@ -1117,14 +1821,17 @@ RC execute(int resume)
             NFR = (Frame)SP;
             // Now we are about to start preparing the next subgoal, so set ARGP back to ARGS
             ARGP = ARGS;
-            continue;
+            NEXT;
          }
-         case I_DEPART:
+         CASE(I_DEPART):
          {
             // I_DEPART is like I_CALL except it destroys the current frame
-            word functor = FR->clause->constants[CODE16(PC+1)];
+            SAFE_POINT();
+            word functor = FR->clause->constants[PC[1]];
+            // The clause (and its call cache) is freed below if it was only ever used by this frame
+            struct call_cache** cache = FR->is_local?NULL:&FR->clause->call_cache[PC[1]];
             // We need to save some things which are about to be clobbered since the current frame gets overwritten
-            unsigned char* returnPC = FR->returnPC;
+            word* returnPC = FR->returnPC;
             Frame parent = FR->parent;
             assert(parent != FR);
             Module contextModule = FR->contextModule;
@@ -1147,7 +1854,7 @@ RC execute(int resume)
             }
             NFR = (Frame)SP; // If there are no choicepoints, NFR will equal FR. Otherwise, NFR will be after the choicepoint.
             // From this point on, the old frame is possibly going to be scribbled all over. Do not try to use it!
-            if (!prepare_frame(functor, contextModule, NFR, parent))
+            if (!prepare_frame(functor, contextModule, NFR, parent, cache))
                goto b_throw_foreign;
             SP = AFTER_FRAME(NFR);
             NFR->returnPC = returnPC;
@@ -1157,37 +1864,40 @@ RC execute(int resume)
             FR->choicepoint = CP;
             PC = FR->clause->code;
             /*
-            for (int i = 0; i < getConstant(FR->functor, NULL).functor_data->arity; i++)
+            for (int i = 0; i < FUNCTOR_ARITY(FR->functor); i++)
             {
                printf("Arg %d: %08lx = ", i, ARGS[i]); PORTRAY(ARGS[i]); printf("\n");
             }
             */
-            continue;
+            NEXT;
          }
-         case B_CLEANUP_CHOICEPOINT:
+         CASE(B_CLEANUP_CHOICEPOINT):
          {
             // This just leaves a fake choicepoint (one you cannot backtrack onto) with a .cleanup value set to the cleanup handler
             create_choicepoint(NULL, FR->clause, Body);
             CP->cleanup = FR;
             PC++;
-            continue;
+            NEXT;
          }
-         case B_THROW:
+         CASE(B_THROW):
             //printf("Setting exception from: "); PORTRAY(*(ARGP-1)); printf("\n");
             SET_EXCEPTION(*(ARGP-1));
             // fall-through
-         case B_THROW_FOREIGN:
+         CASE(B_THROW_FOREIGN):
          b_throw_foreign:
          {
             assert(current_exception != 0 && "throw but no exception set?");
-            // We build up a backtrace regardless of whether we actually need it
-            List backtrace;
-            init_list(&backtrace);
+            // The backtrace is only wanted if the ball is error(_, Context) with Context unbound, and then only the innermost
+            // BACKTRACE_DEPTH frames are kept. The frames have to be noted as we go, since backtracking to a catcher discards them
+            int want_backtrace = (TAGOF(current_exception) == COMPOUND_TAG && FUNCTOROF(current_exception) == errorFunctor && (TAGOF(ARGOF(current_exception, 1)) == VARIABLE_TAG));
+            word backtrace[BACKTRACE_DEPTH];
+            int backtrace_length = 0;
             Frame f = FR;
             while(f != NULL)
             {
                //printf("Checking for catch/3 in %p\n", f); PORTRAY(f->functor); printf("\n");
-               list_append(&backtrace, f->functor);
+               if (want_backtrace && backtrace_length < BACKTRACE_DEPTH)
+                  backtrace[backtrace_length++] = f->functor;
                if (f->functor == catchFunctor)
                {
                   //printf("Found a catch/3 in %p with choicepoint %p\n", f, f->choicepoint);
@@ -1199,11 +1909,8 @@ RC execute(int resume)
                   if (unify(copy_term(current_exception), f->slots[1]))
                   {
                      // Success! Exception is successfully handled. First unify the backtrace if possible (ignoring it if not)
-                     if (TAGOF(current_exception) == COMPOUND_TAG && FUNCTOROF(current_exception) == errorFunctor && (TAGOF(ARGOF(current_exception, 1)) == VARIABLE_TAG))
-                     {
-                        unify(ARGOF(DEREF(f->slots[1]), 1), make_backtrace(&backtrace));
-                     }
-                     free_list(&backtrace);
+                     if (want_backtrace)
+                        unify(ARGOF(DEREF(f->slots[1]), 1), make_backtrace(backtrace, backtrace_length));
                      CLEAR_EXCEPTION();
 
                      // Now we just have to do i_usercall to execute the handler. To do that, we must first adjust the state so we are pointing to it
@@ -1211,7 +1918,6 @@ RC execute(int resume)
                      // it off in a totally different place. We have to reset ARGP and PC then pretend the next instruction was i_usercall
                      // ARGP is going to point to the third variable in the frame, which is unusual (it usually points to the heap or ARGS)
                      ARGP = f->slots + 3;
-                     PC = &f->clause->code[12];
                      // We also invalidate the functor so that we cannot unify with this catcher frame again
                      f->functor = caughtFunctor;
                      // Adjust for USERCALL so it sets up the right return address - we want to pretend this is where we are current executing
@@ -1223,40 +1929,41 @@ RC execute(int resume)
                f = f->parent;
             }
             // Failed to handle. Return to top level. But first, try to unify the stack trace with the actual error term (and not a copy)
-            if (TAGOF(current_exception) == COMPOUND_TAG && FUNCTOROF(current_exception) == errorFunctor && (TAGOF(ARGOF(current_exception, 1)) == VARIABLE_TAG))
-            {
-               unify(ARGOF(current_exception, 1), make_backtrace(&backtrace));
-            }
+            if (want_backtrace)
+               unify(ARGOF(current_exception, 1), make_backtrace(backtrace, backtrace_length));
             // Remember to push FR back otherwise we might end up trying to clean up (now discarded) frames
             FR = f;
-            free_list(&backtrace);
+            // Whatever was being built when the error happened (such as the operands of an arithmetic instruction) is abandoned too
+            ARGP = ARGS;
+            argStackP = &argStack[0];
             return ERROR;
          }
-         case I_SWITCH_MODULE:
+         CASE(I_SWITCH_MODULE):
          {
             // This just changes the current module
-            word moduleName = FR->clause->constants[CODE16(PC+1)];
+            word moduleName = FR->clause->constants[PC[1]];
             currentModule = find_module(moduleName);
             FR->contextModule = currentModule;
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case I_EXITMODULE:
+         CASE(I_EXITMODULE):
          {
             // Current this is a NOP
             PC++;
-            continue;
+            NEXT;
          }
-         case I_CALL:
+         CASE(I_CALL):
          {
             // I_CALL creates a new frame at SP (later, at SP - N, where N is the number of slots we can reclaim from this frame for environment trimming)
+            SAFE_POINT();
             NFR = (Frame)SP;
-            word functor = FR->clause->constants[CODE16(PC+1)];
+            word functor = FR->clause->constants[PC[1]];
             assert((word*)NFR < STOP);  // Make sure there is space!
             // Build the frame
-            if (!prepare_frame(functor, FR->contextModule, NFR, FR))
+            if (!prepare_frame(functor, FR->contextModule, NFR, FR, &FR->clause->call_cache[PC[1]]))
                goto b_throw_foreign;
-            NFR->returnPC = PC+3;
+            NFR->returnPC = PC+2;
             ARGP = ARGS;
             FR = NFR;
             // We must also ensure that there is enough space. prepare_frame does not push up SP
@@ -1264,26 +1971,29 @@ RC execute(int resume)
             FR->choicepoint = CP;
             PC = FR->clause->code;
             /*
-            for (int i = 0; i < getConstant(FR->functor, NULL).functor_data->arity; i++)
+            for (int i = 0; i < FUNCTOR_ARITY(FR->functor); i++)
             {
                printf("Arg %d: ", i); PORTRAY(ARGS[i]); printf("\n");
             }
             */
-            continue;
+            NEXT;
          }
-         case I_CATCH:
+         CASE(I_CATCH):
          {
             // I_CATCH creates a (fake) choicepoint then goes straight to i_usercall
             create_choicepoint(0, FR->clause, Head);
             FR->choicepoint = CP;
-            FR->slots[CODE16(PC+1)] = (word)CP;
+            FR->slots[PC[1]] = (word)CP;
             // ARGP is set to slot 1 so that we try and execute the first arg as a goal. (I_USERCALL subtracts a word from ARGP, so we actually execute slot[0])
             ARGP = &FR->slots[1];
             // printf("Slots[0] is %08lx\n", FR->slots[0]); PORTRAY(FR->slots[0]); printf("\n");
-            PC+=2; // i_usercall returns to PC+1, and we want to return to PC+3, so add 2 here
+            PC++; // i_usercall returns to PC+1, and we want to return to PC+2, so add 1 here
             goto i_usercall;
          }
-         case I_USERCALL:
+         CASE(I_USERCALL):
+            // This is not a safe point if we arrive here via i_usercall, since ARGP may then point into a frame that is no longer linked
+            // to FR (for example when we are calling the recovery goal of a catch/3 or the cleanup goal of setup_call_cleanup/3)
+            SAFE_POINT();
          i_usercall:
          {
             word goal = DEREF(*(ARGP-1));
@@ -1293,32 +2003,60 @@ RC execute(int resume)
                instantiation_error();
                goto b_throw_foreign;
             }
-            Query query = compile_query(goal);
-            if (query == NULL)
+            // A goal which is just a call of a predicate, possibly in some module, is called directly as if by I_CALL
+            Module module = NULL;
+            word target = goal;
+            if (TAGOF(goal) == COMPOUND_TAG && FUNCTOROF(goal) == crossModuleCallFunctor)
+            {
+               word moduleName = ARGOF(goal, 0);
+               if (TAGOF(moduleName) == CONSTANT_TAG && !IS_SMALLINT(moduleName) && getConstantType(moduleName) == ATOM_TYPE)
+                  module = find_module(moduleName);
+               target = (module == NULL)?0:ARGOF(goal, 1);
+            }
+            if (target != 0 && is_plain_goal(target))
+            {
+               if (module != NULL)
+                  currentModule = module;
+               NFR = (Frame)SP;
+               assert(NFR != FR);
+               word functor = (TAGOF(target) == CONSTANT_TAG)?MAKE_FUNCTOR(target, 0):FUNCTOROF(target);
+               // There is no call site to keep the predicate in, so the engine keeps a table of them instead, indexed by the functor's
+               // place in the constant table. prepare_frame() only uses an entry for the same functor, and replaces it otherwise
+               if (!prepare_frame(functor, module, NFR, FR, &usercall_cache[(functor >> CONSTANT_BITS) % USERCALL_CACHE_SIZE]))
+                  goto b_throw_foreign;
+               for (int i = 0; i < FUNCTOR_ARITY(functor); i++)
+                  ARGS[i] = ARGOF(target, i);
+               NFR->returnPC = PC+1;
+               ARGP = ARGS;
+               FR = NFR;
+               SP = AFTER_FRAME(FR);
+               PC = FR->clause->code;
+               NEXT;
+            }
+            // The arguments of the goal go straight into ARGS. goal has already been read, so it does not matter if ARGP-1 is in there
+            int arg_count;
+            int is_local;
+            Clause clause = compile_meta_call(goal, ARGS, &arg_count, &is_local);
+            if (clause == NULL)
                goto b_throw_foreign;
             NFR = (Frame)SP;
             assert(NFR != FR);
             NFR->parent = FR;
             NFR->functor = metaCallFunctor;
-            NFR->clause = query->clause;
+            NFR->clause = clause;
             //printf("Allocated frame %p with local clause %p\n", NFR, NFR->clause);
             NFR->contextModule = NULL; // CHECKME: Is this right?
-            NFR->is_local = 1;
+            NFR->is_local = is_local;
             NFR->returnPC = PC+1;
             NFR->choicepoint = CP;
+            NFR->generation = ATOMIC_LOAD(&clause_generation);
             ARGP = ARGS;
-            for (int i = 0; i < query->variable_count; i++)
-            {
-               //printf("Populating meta-call arg %d at location %p\n", i, &NFR->slots[i]);
-               ARGS[i] = query->variables[i];
-            }
             FR = NFR;
             SP = AFTER_FRAME(FR);
             PC = FR->clause->code;
-            free_query(query);
-            continue;
+            NEXT;
          }
-         case I_CUT:
+         CASE(I_CUT):
          {
             // I_CUT is a normal body cut. We just have to cut to the choicepoint that was around when the frame was created
             RC rc = cut_to(FR->choicepoint);
@@ -1330,28 +2068,28 @@ RC execute(int resume)
             assert(CP == FR->choicepoint);
             ARGP = ARGS;
             PC++;
-            continue;
+            NEXT;
          }
-         case C_CUT:
+         CASE(C_CUT):
          {
             // C_CUT is the cut you get in an if-then-else. We must cut to the /given/ choicepoint (which was saved as part of IF-THEN or IF-THEN-ELSE)
-            RC rc = cut_to(((Choicepoint)FR->slots[CODE16(PC+1)]));
+            RC rc = cut_to(((Choicepoint)FR->slots[PC[1]]));
             if (rc == YIELD)
                return YIELD;
             if (rc == AGAIN) // We get AGAIN if we had to stop cutting so we could execute a cleanup
                goto i_usercall;
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case C_LCUT:
+         CASE(C_LCUT):
          {
             // C_LCUT is a cut in the if-part of an if-then-else. We must cut to the choicepoint AFTER the given one.
             Choicepoint C = CP;
             int found = 0;
-            while (C > ((Choicepoint)FR->slots[CODE16(PC+1)]))
+            while (C > ((Choicepoint)FR->slots[PC[1]]))
             {
                assert(C != NULL); // The choicepoint we are looking for is gone
-               if (C->CP == ((Choicepoint)FR->slots[CODE16(PC+1)]))
+               if (C->CP == ((Choicepoint)FR->slots[PC[1]]))
                {
                   // Good, we found it
                   RC rc = cut_to(C);
@@ -1359,32 +2097,32 @@ RC execute(int resume)
                      return YIELD;
                   if (rc == AGAIN)
                      goto i_usercall;
-                  PC+=3;
+                  PC+=2;
                   found = 1;
                   break;
                }
             }
             assert(found);
-            continue;
+            NEXT;
          }
-         case C_IF_THEN:
+         CASE(C_IF_THEN):
          {
             // C_IF_THEN just has to save the current choicepoint so we can cut it later with C_CUT
-            FR->slots[CODE16(PC+1)] = (word)CP;
-            PC+=3;
-            continue;
+            FR->slots[PC[1]] = (word)CP;
+            PC+=2;
+            NEXT;
          }
-         case C_IF_THEN_ELSE:
+         CASE(C_IF_THEN_ELSE):
          {
             // C_IF_THEN has to save the current choicepoint so we can cut it later with C_CUT, then also create a new choicepoint
             // to try the ELSE part if the IF part fails
-            FR->slots[CODE16(PC+1+sizeof(word))] = (word)CP;
-            unsigned char* address = PC+CODEPTR(PC+1);
+            FR->slots[PC[2]] = (word)CP;
+            word* address = PC+PC[1];
             create_choicepoint(address, FR->clause, Body);
-            PC+=3 + sizeof(word);
-            continue;
+            PC+=3;
+            NEXT;
          }
-         case I_UNIFY:
+         CASE(I_UNIFY):
          {
             // I_UNIFY just tries to unify 2 arguments
             word t1 = *(ARGP-1);
@@ -1393,33 +2131,33 @@ RC execute(int resume)
             if (unify(t1, t2))
             {
                PC++;
-               continue;
+               NEXT;
             }
             else if (backtrack())
-               continue;
+               NEXT;
             return FAIL;
          }
-         case B_FIRSTVAR:
+         CASE(B_FIRSTVAR):
             // This is a variable which we have not seen before (ie was not present in the head) and is being used now for the first time
             // We can make a local variable on the frame, since if this were unsafe we would have instead gotten B_UNSAFEVAR
-            FR->slots[CODE16(PC+1)] = (word)&FR->slots[CODE16(PC+1)];
-            *(ARGP++) = FR->slots[CODE16(PC+1)];
-            //printf("Slot %d now holds %08lx, a local variable\n", CODE16(PC+1), FR->slots[CODE16(PC+1)]);
-            PC+=3;
-            continue;
-         case B_ARGFIRSTVAR:
+            FR->slots[PC[1]] = (word)&FR->slots[PC[1]];
+            *(ARGP++) = FR->slots[PC[1]];
+            //printf("Slot %d now holds %08lx, a local variable\n", PC[1], FR->slots[PC[1]]);
+            PC+=2;
+            NEXT;
+         CASE(B_ARGFIRSTVAR):
             // B_ARGFIRSTVAR is a variable which we have not seen before and is now being used for the first time as an argument of a compound term
             // We cannot just make a local variable here since ARGP is pointing to the heap, and that means it could live on well past the lifetime of
             // this frame. Instead, make a variable on the heap and set our slot to point to that.
             (*ARGP) = MAKE_VAR();
-            FR->slots[CODE16(PC+1)] = *ARGP;
+            FR->slots[PC[1]] = *ARGP;
             ARGP++;
-            PC+=3;
-            continue;
-         case B_ARGVAR:
+            PC+=2;
+            NEXT;
+         CASE(B_ARGVAR):
          {
             // B_ARGVAR is a variable that we have already initialized and is now being used as the argument of a compound term.
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             word arg = DEREF(FR->slots[slot]);
             // If the slot is already bound, just write the value into the heap cell
             if (TAGOF(arg) != VARIABLE_TAG)
@@ -1430,7 +2168,7 @@ RC execute(int resume)
             {
                // Otherwise, we may have a problem. If the variable is on the heap we can just write it directly to ARPG, but if it is local
                // then we need to globalize it since otherwise we would be writing a local variable to the heap
-               if (arg > (word)STACK)
+               if (!IS_HEAP_ADDRESS(arg))
                {
                   *ARGP = MAKE_VAR();
                   _bind(arg, *(ARGP++));
@@ -1438,50 +2176,50 @@ RC execute(int resume)
                else
                   *(ARGP++) = arg;
             }
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case B_VAR:
+         CASE(B_VAR):
          {
             // B_VAR is a variable that we have already initialized and is now being used as the argument of a subgoal
             // It is always safe to just copy the value. If the variable were about to be trimmed from the local environment
             // then instead we would get B_UNSAFEVAR
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             assert (FR->slots[slot] != 0 && "Suspicious lack of variable initialization!");
             //printf("Value: %08lx\n   ", FR->slots[slot]); PORTRAY(FR->slots[slot]);printf(" written to %p\n", ARGP);
             *(ARGP++) = FR->slots[slot];
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case B_VOID:
+         CASE(B_VOID):
          {
             // B_VOID is a singleton variable.
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             // The slot is going to be uninitialized. That doesnt matter since we will never read it back
             FR->slots[slot] = (word)&FR->slots[slot];
             *(ARGP++) = FR->slots[slot];
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case B_FIRSTUNSAFEVAR:
+         CASE(B_FIRSTUNSAFEVAR):
          {
             // B_FIRSTUNSAFEVAR is a variable that we are seeing for the first time but is unsafe (ie this is also the last time we are
             // going to see it). For example, foo(X, a(X))
             // We know it is still a variable because it is fresh, but we also know we must allocate it on the heap since the frame is
             // about to be destroyed
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             FR->slots[slot] = MAKE_VAR();
             *(ARGP++) = FR->slots[slot];
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case B_UNSAFEVAR:
+         CASE(B_UNSAFEVAR):
          {
             // B_UNSAFEVAR is a variable that we have already initialized but is about to be trimmed from the environment
             // If it is already bound, then that is OK - just copy the value
             // If it is a variable, but on the heap - that is also OK
             // Otherwise we must globalize it as with B_ARGVAR
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             word arg = DEREF(FR->slots[slot]);
             if (TAGOF(arg) != VARIABLE_TAG)
             {
@@ -1489,7 +2227,7 @@ RC execute(int resume)
             }
             else
             {
-               if (arg > (word)STACK)
+               if (!IS_HEAP_ADDRESS(arg))
                {
                   *ARGP = MAKE_VAR();
                   _bind(FR->slots[slot], *ARGP);
@@ -1498,55 +2236,75 @@ RC execute(int resume)
                else
                   *(ARGP++) = arg;
             }
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case B_POP:
+         CASE(B_POP):
          {
             // This just restores ARGP
             ARGP = (word*)*(--argStackP);
             PC++;
-            continue;
+            NEXT;
          }
-         case B_ATOM:
+         CASE(B_ATOM):
          {
             // Put an atom
-            *(ARGP++) = FR->clause->constants[CODE16(PC+1)];
-            PC+=3;
-            continue;
+            *(ARGP++) = FR->clause->constants[PC[1]];
+            PC+=2;
+            NEXT;
          }
-         case B_FUNCTOR:
+         CASE(B_FUNCTOR):
          {
             // Put a reference to a compound. Move ARGP to the first arg of that term
-            word t = MAKE_COMPOUND(FR->clause->constants[CODE16(PC+1)]);
+            word t = MAKE_COMPOUND(FR->clause->constants[PC[1]]);
             *(ARGP++) = t;
             assert(argStackP < argStackTop);
             *(argStackP++) = (uintptr_t)ARGP;
             ARGP = ARGPOF(t);
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case B_RFUNCTOR:
+         CASE(B_RFUNCTOR):
          {
             // Like B_FUNCTOR except it does not need to push to the argStack since it is the last arg in the word
             // When we do the B_POP for the last non-rfunctor we will reset ARGP to the next place in the list
-            word t = MAKE_COMPOUND(FR->clause->constants[CODE16(PC+1)]);
+            word t = MAKE_COMPOUND(FR->clause->constants[PC[1]]);
             *(ARGP++) = t;
             ARGP = ARGPOF(t);
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
+         }
+         CASE(B_LIST):
+         {
+            // B_FUNCTOR for a list cell
+            word t = MAKE_COMPOUND(listFunctor);
+            *(ARGP++) = t;
+            assert(argStackP < argStackTop);
+            *(argStackP++) = (uintptr_t)ARGP;
+            ARGP = ARGPOF(t);
+            PC++;
+            NEXT;
+         }
+         CASE(B_RLIST):
+         {
+            // B_RFUNCTOR for a list cell. This is what builds all but the first cell of a list
+            word t = MAKE_COMPOUND(listFunctor);
+            *(ARGP++) = t;
+            ARGP = ARGPOF(t);
+            PC++;
+            NEXT;
          }
-         case H_FIRSTVAR:
+         CASE(H_FIRSTVAR):
          {
             // ARGP is pointing to something we must match with a variable in the head that we have not seen until now (and is not an arg)
-            // It will necessarily be on the heap, however we do not need to trail so long as we make sure FR->slots[CODE16(PC+1)] points to
+            // It will necessarily be on the heap, however we do not need to trail so long as we make sure FR->slots[PC[1]] points to
             // ARGP, and not the other way around.
             if (mode == WRITE)
             {
                // We are writing, so first make ARGP (which will be one of the args of the term we are constructing on the heap) into a fresh var
                *ARGP = MAKE_VAR();
                // Then make a our frame variable a pointer to that var so we link them together
-               FR->slots[CODE16(PC+1)] = (word)ARGP;
+               FR->slots[PC[1]] = (word)ARGP;
                ARGP++;
             }
             else
@@ -1557,26 +2315,26 @@ RC execute(int resume)
                {
                   //printf("Value: %08lx from %p\n   ", *ARGP, ARGP); PORTRAY(*ARGP);printf("\n");
                   word w = *(ARGP++);
-                  FR->slots[CODE16(PC+1)] = w;
+                  FR->slots[PC[1]] = w;
                   // The variable must either be on the heap (safe) or have been made local via a call to make_local (risky - you can free this memory later and
                   // end up with a pointer to nowhere)
-                  assert(w < (word)FR || w > (word)TTOP);
+                  assert(!IS_STACK_ADDRESS(w) || w < (word)FR);
                }
                else
                {
                   //printf("Bound value: %08lx from %p\n    ", *ARGP, ARGP); PORTRAY(*ARGP); printf("\n");
-                  FR->slots[CODE16(PC+1)] = *(ARGP++);
+                  FR->slots[PC[1]] = *(ARGP++);
                }
             }
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case H_FUNCTOR:
+         CASE(H_FUNCTOR):
          {
             // Matching a functor. We switch to write mode if ARGP is a variable.
-            word functor = FR->clause->constants[CODE16(PC+1)];
+            word functor = FR->clause->constants[PC[1]];
             word arg = DEREF(*(ARGP++));
-            PC+=3;
+            PC+=2;
             if (TAGOF(arg) == COMPOUND_TAG)
             {
                if (FUNCTOROF(arg) == functor)
@@ -1584,7 +2342,7 @@ RC execute(int resume)
                   assert(argStackP < argStackTop);
                   *(argStackP++) = (uintptr_t)ARGP | mode;
                   ARGP = ARGPOF(arg);
-                  continue;
+                  NEXT;
                }
             }
             else if (TAGOF(arg) == VARIABLE_TAG)
@@ -1595,111 +2353,292 @@ RC execute(int resume)
                _bind(arg, t);
                ARGP = ARGPOF(t);
                mode = WRITE;
-               continue;
+               NEXT;
             }
-            if (backtrack()) // Failed to match
+            goto head_fail;
+         }
+         CASE(H_LIST):
+         {
+            // H_FUNCTOR for a list cell. A list cell can be recognised from the reference to it, without loading the functor
+            word arg = DEREF(*(ARGP++));
+            PC++;
+            if (IS_LIST_CELL(arg) || (TAGOF(arg) == COMPOUND_TAG && FUNCTOROF(arg) == listFunctor))
             {
-               continue;
+               assert(argStackP < argStackTop);
+               *(argStackP++) = (uintptr_t)ARGP | mode;
+               ARGP = ARGPOF(arg);
+               NEXT;
             }
-            return FAIL;
+            else if (TAGOF(arg) == VARIABLE_TAG)
+            {
+               assert(argStackP < argStackTop);
+               *(argStackP++) = (uintptr_t)ARGP | mode;
+               word t = MAKE_COMPOUND(listFunctor);
+               _bind(arg, t);
+               ARGP = ARGPOF(t);
+               mode = WRITE;
+               NEXT;
+            }
+            goto head_fail;
          }
-         case H_POP:
+         CASE(H_POP):
          {
             // H_POP just restores ARGP after a detour to a compound
             uintptr_t t = *--argStackP;
             mode = t & 1;
             ARGP = (word*)(t & ~1);
             PC++;
-            continue;
+            NEXT;
          }
-         case H_ATOM:
+         CASE(H_ATOM):
          {
             // H_ATOM tries to match an atom in the head. If the target is a variable, then we bind.
-            word atom = FR->clause->constants[CODE16(PC+1)];
+            word atom = FR->clause->constants[PC[1]];
             word arg = DEREF(*(ARGP++));
-            PC+=3;
+            PC+=2;
             if (arg == atom)
-               continue;
+               NEXT;
             else if (TAGOF(arg) == VARIABLE_TAG)
             {
                _bind(arg, atom);
-               continue;
+               NEXT;
             }
-            else
-            {
-               if (backtrack())
-               continue;
-            }
-            return FAIL;
+            goto head_fail;
          }
-         case H_VOID:
+         CASE(H_VOID):
             assert(0 && "This should never be executed since the LCO change");
-            FR->slots[CODE16(PC+1)] = (word)ARGP;
+            FR->slots[PC[1]] = (word)ARGP;
             ARGP++;
             PC++;
-            continue;
-         case H_VAR:
+            NEXT;
+         CASE(H_VAR):
          {
             // H_VAR is a variable we have seen before. Just use general-purpose unification
-            if (!unify(DEREF(*(ARGP++)), FR->slots[CODE16(PC+1)]))
+            if (!unify(DEREF(*(ARGP++)), FR->slots[PC[1]]))
+               goto head_fail;
+            PC+=2;
+            NEXT;
+         }
+         head_fail:
+         {
+            // A head instruction failed to match. In shallow mode there is no choicepoint to go back to yet: we just undo the bindings
+            // made by the head and try the next clause straight away
+            if (shallow_clause != NULL)
             {
-               if (backtrack())
-                  continue;
-               return FAIL;
+               word* oldTR = TR;
+               TR = shallow_TR;
+               unwind_trail(oldTR);
+               H = shallow_H;
+               FR->clause = shallow_clause;
+               PC = shallow_clause->code;
+               shallow_clause = NULL;
+               mode = READ;
+               ARGP = ARGS;
+               argStackP = &argStack[0];
+               SP = AFTER_FRAME(FR);
+               NEXT;
             }
-            PC+=3;
-            continue;
+            if (backtrack())
+               NEXT;
+            return FAIL;
          }
-         case C_JUMP:
+         CASE(C_JUMP):
          {
             // C_JUMP is just a jump. Used by control structures like IF_THEN_ELSE
-            PC += CODEPTR(PC+1);
-            continue;
+            PC += PC[1];
+            NEXT;
          }
-         case C_OR:
+         CASE(C_OR):
          {
             // C_OR creates a 'Body' choicepoint
-            create_choicepoint(PC+CODEPTR(PC+1), FR->clause, Body);
-            PC += 1 + sizeof(word);
-            continue;
+            create_choicepoint(PC+PC[1], FR->clause, Body);
+            PC += 2;
+            NEXT;
          }
-         case TRY_ME_OR_NEXT_CLAUSE:
+         CASE(TRY_ME_OR_NEXT_CLAUSE):
          {
-            // TRY_ME_OR_NEXT_CLAUSE creates a 'Head' choicepoint.
-            create_choicepoint(FR->clause->next->code, FR->clause->next, Head);
+            // TRY_ME_OR_NEXT_CLAUSE notes that there is a next clause to try, unless the first-argument index has already ruled out every
+            // later clause. The 'Head' choicepoint for it is only made if the head matches (see the top of this file)
+            // The call only sees the clauses which were there when it was made, so any asserted or retracted since then are passed over
+            Clause next = next_visible_clause(FR->clause, FR->generation);
+            if (next != NULL)
+            {
+               shallow_clause = next;
+               shallow_H = H;
+               shallow_TR = TR;
+            }
             PC++;
-            continue;
+            NEXT;
          }
-         case TRUST_ME:
+         CASE(TRUST_ME):
          {
             // This is currently a NOP
             PC++;
-            continue;
+            NEXT;
          }
-         case S_QUALIFY:
+         CASE(NEXT_CLAUSE):
+         {
+            // This replaces TRY_ME_OR_NEXT_CLAUSE in a clause which has been retracted, but cannot be unlinked yet (see retract_clause())
+            // A call made before then still sees it, so for that call this is just TRY_ME_OR_NEXT_CLAUSE. Any other call carries on with
+            // the next clause it can see as if this one had failed. Nothing has been done yet, so there is nothing to undo
+            Clause next = next_visible_clause(FR->clause, FR->generation);
+            if (clause_visible(FR->clause, FR->generation))
+            {
+               if (next != NULL)
+               {
+                  shallow_clause = next;
+                  shallow_H = H;
+                  shallow_TR = TR;
+               }
+               PC++;
+               NEXT;
+            }
+            if (next != NULL)
+            {
+               FR->clause = next;
+               PC = next->code;
+               SP = AFTER_FRAME(FR);
+               NEXT;
+            }
+            goto head_fail;
+         }
+         CASE(SWITCH_ON_TERM):
+         {
+            // SWITCH_ON_TERM chooses which clauses to try based on the type of the first argument. If it is unbound, try the other arguments
+            word arg = DEREF(ARGS[0]);
+            int indexed = ATOMIC_LOAD(&FR->clause->index->args[0]) != NULL;
+            if (indexed && TAGOF(arg) == CONSTANT_TAG)
+               PC += 2;
+            else if (indexed && TAGOF(arg) == COMPOUND_TAG)
+               PC += 3;
+            else
+               PC += PC[1];
+            NEXT;
+         }
+         CASE(SWITCH_ON_CONSTANT):
+            chain = lookup_clause_index(FR->clause, DEREF(ARGS[0]));
+            goto switch_to_chain;
+         CASE(SWITCH_ON_FUNCTOR):
+            chain = lookup_clause_index(FR->clause, FUNCTOROF(DEREF(ARGS[0])));
+            goto switch_to_chain;
+         CASE(SWITCH_ON_ARGUMENTS):
+            chain = select_clauses(FR->clause, ARGS);
+         switch_to_chain:
+         {
+            // The frame was built for the switch clause, which has no slots of its own
+            if (chain == NULL)
+            {
+               if (backtrack())
+                  NEXT;
+               return FAIL;
+            }
+            FR->clause = chain;
+            SP = AFTER_FRAME(FR);
+            PC = FR->clause->code;
+            NEXT;
+         }
+         CASE(S_QUALIFY):
          {
             // S_QUALIFY turns the nth argument from X -> Module:X
             // Used by meta-predicates
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             word value = DEREF(ARGS[slot]);
             if (!(TAGOF(value) == COMPOUND_TAG && FUNCTOROF(value) == crossModuleCallFunctor))
                ARGS[slot] = MAKE_VCOMPOUND(crossModuleCallFunctor, FR->parent->contextModule->name, value);
             //printf("Arg %d is now ", slot); PORTRAY(ARGS[slot]); printf("\n");
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
          }
-         case C_VAR:
+         CASE(C_VAR):
          {
             // C_VAR is a variable that we would have initialized if we had taken another branch in an if-then-else, but since we took the branch we did, it is not initialized
             // We can initialize it now to a local var
-            unsigned int slot = CODE16(PC+1);
+            unsigned int slot = PC[1];
             FR->slots[slot] = (word)&FR->slots[slot];
-            PC+=3;
-            continue;
+            PC+=2;
+            NEXT;
+         }
+         CASE(A_ADD):
+         CASE(A_SUBTRACT):
+         CASE(A_MULTIPLY):
+         CASE(A_INTDIV):
+         {
+            // Compiled arithmetic. The two operands are on top of the argument stack, and are replaced by the result
+            word functor;
+            switch(*PC)
+            {
+               case A_ADD: functor = addFunctor; break;
+               case A_SUBTRACT: functor = subtractFunctor; break;
+               case A_MULTIPLY: functor = multiplyFunctor; break;
+               default: functor = intDivFunctor; break;
+            }
+            ARGP--;
+            if (!evaluate_operation(functor, DEREF(*(ARGP-1)), DEREF(*ARGP), ARGP-1))
+               goto b_throw_foreign;
+            PC++;
+            NEXT;
+         }
+         CASE(A_NEGATE):
+         {
+            if (!evaluate_operation(negateFunctor, DEREF(*(ARGP-1)), 0, ARGP-1))
+               goto b_throw_foreign;
+            PC++;
+            NEXT;
+         }
+         CASE(A_EVAL):
+         {
+            // Evaluate an expression that was not compiled (or was just a variable). A small integer is already its own value
+            word expression = DEREF(*(ARGP-1));
+            if (IS_SMALLINT(expression))
+               *(ARGP-1) = expression;
+            else if (!evaluate_term(expression, ARGP-1))
+               goto b_throw_foreign;
+            PC++;
+            NEXT;
+         }
+         CASE(A_FIRSTVAR):
+         {
+            // The result of is/2 where the left hand side is a variable we have not seen before. Since the value is a number we can just
+            // store it in the slot, which saves creating a variable only to bind (and trail) it immediately
+            FR->slots[PC[1]] = *(--ARGP);
+            PC+=2;
+            NEXT;
+         }
+         CASE(A_EQUAL):
+         CASE(A_NOT_EQUAL):
+         CASE(A_LESS):
+         CASE(A_LESS_EQUAL):
+         CASE(A_GREATER):
+         CASE(A_GREATER_EQUAL):
+         {
+            int result, success;
+            ARGP-=2;
+            if (!compare_numbers(DEREF(*ARGP), DEREF(*(ARGP+1)), &result))
+               goto b_throw_foreign;
+            switch(*PC)
+            {
+               case A_EQUAL: success = (result == 0); break;
+               case A_NOT_EQUAL: success = (result != 0); break;
+               case A_LESS: success = (result < 0); break;
+               case A_LESS_EQUAL: success = (result <= 0); break;
+               case A_GREATER: success = (result > 0); break;
+               default: success = (result >= 0); break;
+            }
+            if (success)
+            {
+               PC++;
+               NEXT;
+            }
+            else if (backtrack())
+               NEXT;
+            return FAIL;
          }
          default:
+#ifdef THREADED_CODE
+         illegal_instruction:
+#endif
          {
-            printf("Illegal instruction %d\n", *PC);
+            printf("Illegal instruction %d\n", (int)*PC);
             assert(0 && "Illegal instruction\n");
          }
       }
@@ -1712,7 +2651,11 @@ void resume_execution(ExecutionCallback callback, int resume)
 {
    current_yield_ptr = callback;
    //printf("Executing with %d\n", resume);
+   begin_running();
    RC rc = execute(resume);
+   if (rc != YIELD)
+      finish_query();
+   end_running();
    if (rc != YIELD)
    {
       // FIXME: Er, we cannot free these if there are choicepoints?!
@@ -1739,7 +2682,10 @@ void resume_yield(RC status, ExecutionCallback y)
       else if (backtrack())
          resume_execution(y, 0);
       else
+      {
+         finish_query();
          y(FAIL);
+      }
    }
    else if (status == SUCCESS)
    {
@@ -1795,31 +2741,46 @@ RC prepare_query(word goal)
 
 RC execute_query_sync(word goal)
 {
+   start_query();
    RC rc = prepare_query(goal);
    if (rc != SUCCESS)
+   {
+      finish_query();
       return rc;
+   }
+   begin_running();
    rc = execute(0);
+   finish_query();
+   end_running();
    assert(rc != YIELD); // Do not do this.
    return rc;
 }
 
 void execute_query(word goal, ExecutionCallback callback)
 {
+   start_query();
    RC rc = prepare_query(goal);
    if (rc != SUCCESS)
+   {
+      finish_query();
       callback(rc);
+   }
    else
       resume_execution(callback, 0);
 }
 
 void backtrack_query(ExecutionCallback callback)
 {
+   start_query();
    if (backtrack())
    {
       resume_execution(callback, 0);
    }
    else
+   {
+      finish_query();
       callback(FAIL);
+   }
 }
 
 
@@ -1849,7 +2810,8 @@ int clause_functor(word t, word* functor)
 
 void consult_stream(Stream s)
 {
-   word* savedH = H;
+   // Directives may cause the heap to move or be compacted, so we must remember H as an offset rather than a pointer
+   ptrdiff_t savedH = H - HEAP;
    word* savedSP = SP;
    word clause;
    while (1)
@@ -1970,6 +2932,12 @@ void consult_stream(Stream s)
       }
       else
       {
+         if (TAGOF(clause) == COMPOUND_TAG && FUNCTOROF(clause) == dcgRuleFunctor && !dcg_translate_rule(clause, &clause))
+         {
+            printf("Error: Illegal grammar rule\n");
+            CLEAR_EXCEPTION();
+            continue;
+         }
          // Ordinary clause
          word functor;
          if (clause_functor(clause, &functor))
@@ -1984,7 +2952,10 @@ void consult_stream(Stream s)
    // In case this has changed, set it back after consulting any file
    currentModule = userModule;
    // Restore H and SP
-   H = savedH;
+   // If a directive caused a garbage collection then H may already be below savedH. Since compaction never moves anything up, there
+   // is nothing from before the consult above H
+   if (H > HEAP + savedH)
+      H = HEAP + savedH;
    // AGC: release any constants between H and savedH
    SP = savedSP;
 
@@ -2018,69 +2989,48 @@ void consult_string_of_length(char* string, int length)
 }
 
 
+// Prints the operands of the instruction at code, and returns the number of words they occupy
+int print_operands(Clause clause, word* code)
+{
+   word* ptr = code+1;
+   int flags = instruction_info[*code].flags;
+   if (flags & HAS_CONST)
+   {
+      PORTRAY(clause->constants[*(ptr++)]); printf(" ");
+   }
+   if (flags & HAS_ADDRESS)
+      printf("%"PRIpd" ", *(ptr++));
+   if (flags & HAS_SLOT)
+      printf("%d ", (int)*(ptr++));
+   printf("\n");
+   return ptr - code - 1;
+}
+
 void print_clause(Clause clause)
 {
    for (int i = 0; i < clause->code_size; i++)
    {
-      int flags = instruction_info[clause->code[i]].flags;
       printf("@%d: %s ", i, instruction_info[clause->code[i]].name);
-      if (flags & HAS_CONST)
-      {
-         int index = (clause->code[i+1] << 8) | (clause->code[i+2]);
-         i+=2;
-         PORTRAY(clause->constants[index]); printf(" ");
-      }
-      if (flags & HAS_ADDRESS)
-      {
-         uintptr_t address = CODEPTR(&clause->code[i+1]);
-         i+=sizeof(word);
-         printf("%" PRIpd " ", address);
-      }
-      if (flags & HAS_SLOT)
-      {
-         int slot = (clause->code[i+1] << 8) | (clause->code[i+2]);
-         i+=2;
-         printf("%d ", slot);
-      }
-      printf("\n");
+      i += print_operands(clause, &clause->code[i]);
    }
 }
 
 void print_instruction()
 {
    printf("@%p: ", PC); PORTRAY(FR->functor); printf(" (FR=%p CP=%p, SP=%p(%"PRIpd"), ARGP=%p, H=%p(%"PRIpd"), TR=%p(%"PRIpd")) %s ", FR, CP, SP, (SP-STACK), ARGP, H, (H-HEAP), TR, (TR-TRAIL), instruction_info[*PC].name);
-   unsigned char* ptr = PC+1;
-   if (instruction_info[*PC].flags & HAS_CONST)
-   {
-      int index = CODE16(ptr);
-      ptr+=2;
-      PORTRAY(FR->clause->constants[index]); printf(" ");
-   }
-   if (instruction_info[*PC].flags & HAS_ADDRESS)
-   {
-      uintptr_t address = CODEPTR(ptr);
-      ptr+=sizeof(word);
-      printf("%"PRIpd" ", address);
-   }
-   if (instruction_info[*PC].flags & HAS_SLOT)
-   {
-      int slot = CODE16(ptr);
-      ptr+=2;
-      printf("%d ", slot);
-   }
-   printf("\n");
+   print_operands(FR->clause, PC);
 }
 
 // Note that this is not tested and may not work very well!
 void make_foreign_cleanup_choicepoint_h(word* h, word w, void (*fn)(int, word), int arg)
 {
-      //printf("Saving foreign pointer to %p\n", &FR->slots[CODE16(PC+1+sizeof(word))]);
-   FR->slots[CODE16(PC+1+sizeof(word))] = w;
+      //printf("Saving foreign pointer to %p\n", &FR->slots[PC[2]]);
+   FR->slots[PC[2]] = w;
    //printf("Allocating a foreign choicepoint at %p (top = %p, bottom = %p)\n", SP, STOP, STACK);
    Choicepoint c = (Choicepoint)SP;
    c->SP = SP;
    c->CP = CP;
-   c->argc = getConstant(FR->functor, NULL).functor_data->arity;
+   c->argc = FUNCTOR_ARITY(FR->functor);
    //printf("Saving %d args on the choicepoint\n", c->argc);
    for (int i = 0; i < c->argc; i++)
    {
@@ -2100,8 +3050,8 @@ void make_foreign_cleanup_choicepoint_h(word* h, word w, void (*fn)(int, word),
    c->NFR = NFR;
    c->functor = FR->functor;
    c->TR = TR;
-   c->PC = PC+3+sizeof(word);
-   assert(FR->slots[CODE16(PC+1+sizeof(word))] == w);
+   c->PC = PC+3;
+   assert(FR->slots[PC[2]] == w);
 }
 
 void make_foreign_cleanup_choicepoint(word w, void (*fn)(int, word), int arg)
@@ -2199,7 +3149,7 @@ word get_choicepoint_depth()
 
 long heap_usage() // Returns heap usage in bytes
 {
-   return ((unsigned int)H - (unsigned int)HEAP) / sizeof(void*);
+   return (H - HEAP) * sizeof(word);
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -5,6 +5,7 @@
 #include "list.h"
 #include "types.h"
 #include "stream.h"
+#include "threads.h"
 #include <gmp.h>
 #include <stdarg.h>
 
@@ -13,10 +14,6 @@
 // FR is a pointer to the current frame
 // ARGP is now a pointer. There is no longer an ARGI
 
-#define CODE16(t) ((*(t) << 8) | (*(t+1)))
-#define CODE32(t) ((*(t) << 24) | ((*(t+1)) << 16) | ((*(t+2)) << 8) | (*(t+3)))
-#define CODE64(t) ((((word)*(t)) << 56)| (((word)*(t+1)) << 48)| (((word)*(t+2)) << 40)| (((word)*(t+3)) << 32)| (((word)*(t+4)) << 24)| (((word)*(t+5)) << 16)| (((word)*(t+6)) <<  8)| (((word)*(t+7)) <<  0))
-
 #ifdef __EMSCRIPTEN__
 // From version 1.38.48 emscripten changed the type of uintptr_t from unsigned int -> unsigned long
 // But sadly they did not change the PRI_PTR macros. In the PR at https://github.com/emscripten-core/emscripten/pull/5916
@@ -30,19 +27,6 @@
 #define PRIpd PRIuPTR
 #endif
 
-#if UINTPTR_MAX == 0xffffffffffffffff
-#define CODEPTR(t) CODE64(t)
-#elif UINTPTR_MAX == 0xffffffff
-#define CODEPTR(t) CODE32(t)
-#elif UINTPTR_MAX == 0xffff
-#define CODEPTR(t) CODE16(t)
-#endif
-
-#define FUNCTOR_VALUE(t) ((Functor)CTable[t])
-#define FUNCTOROF(t) (*((Word)(t & ~TAG_MASK)))
-#define ARGOF(t, i) DEREF(((word)(((Word*)(DEREF(t) & ~TAG_MASK))+i+1)))
-#define ARGPOF(t) ((Word)(((Word*)(t & ~TAG_MASK))+1)) // FIXME: These cannot both be right!
-
 #define VARIABLE_TAG 0b00
 #define POINTER_TAG  0b01
 #define COMPOUND_TAG 0b10
@@ -50,6 +34,47 @@
 #define TAG_MASK     0b11
 #define TAGOF(t) (t & TAG_MASK)
 
+// When words are 64 bits every cell is 8-byte aligned, so bit 2 of a reference to a compound is always clear. A list cell [H|T] is then a
+// reference with that bit set as well, to just two cells holding H and T, rather than a functor cell for ./2 followed by them. It still
+// looks like a COMPOUND_TAG to anything that only checks TAGOF(), and FUNCTOROF() and ARGOF() hide the difference. Every ./2 term is
+// made like this: code which builds terms itself must use LIST_TAG and LIST_FUNCTOR_CELLS rather than writing listFunctor into a cell.
+// With 32-bit words lists are ordinary compounds, LIST_TAG is just COMPOUND_TAG and IS_LIST_CELL() is always 0
+#if UINTPTR_MAX > 0xffffffff
+#define COMPACT_LISTS
+#define LIST_TAG           0b110
+#define ADDRESS_MASK       0b111
+#define LIST_FUNCTOR_CELLS 0
+#define IS_LIST_CELL(t) (((t) & ADDRESS_MASK) == LIST_TAG)
+#else
+#define LIST_TAG           COMPOUND_TAG
+#define ADDRESS_MASK       TAG_MASK
+#define LIST_FUNCTOR_CELLS 1
+#define IS_LIST_CELL(t) 0
+#endif
+
+extern word listFunctor;
+
+#define COMPOUND_ADDRESS(t) ((Word)((t) & ~(word)ADDRESS_MASK))
+#define FUNCTOROF(t) (IS_LIST_CELL(t)?listFunctor:*COMPOUND_ADDRESS(t))
+#define ARGPOF(t) compound_arguments(t)
+#define ARGOF(t, i) DEREF((word)(compound_arguments(DEREF(t))+(i)))
+
+// Returns the address of the first argument of the compound t
+static inline Word compound_arguments(word t)
+{
+   return COMPOUND_ADDRESS(t) + (IS_LIST_CELL(t)?0:1);
+}
+
+// Integers which fit in a word less 3 bits are not interned. They are stored directly in the word with the low bits set to 111, which
+// still looks like a CONSTANT_TAG to anything that only checks TAGOF(). Constants in the table are stored as index << 3 | 011
+#define SMALLINT_TAG  0b111
+#define SMALLINT_MASK 0b111
+#define IS_SMALLINT(t) (((t) & SMALLINT_MASK) == SMALLINT_TAG)
+#define MAKE_SMALLINT(i) ((((word)(i)) << 3) | SMALLINT_TAG)
+#define SMALLINT_VALUE(t) (((intptr_t)(t)) >> 3)
+#define SMALLINT_MIN (INTPTR_MIN >> 3)
+#define SMALLINT_MAX (INTPTR_MAX >> 3)
+
 word DEREF(word t);
 word MAKE_VAR();
 word MAKE_BIGINTEGER(mpz_t data);
@@ -60,6 +85,8 @@ word MAKE_BLOB(char* type, void* data);
 word MAKE_INTEGER(long data);
 word MAKE_FLOAT(double data);
 word MAKE_FUNCTOR(word name, int arity);
+word MAKE_COMPOUND(word functor);
+word MAKE_LIST(word head, word tail);
 word MAKE_VCOMPOUND(word functor, ...);
 word MAKE_VACOMPOUND(word functor, va_list args);
 word MAKE_LCOMPOUND(word functor, List* args);
@@ -114,6 +141,7 @@ typedef enum
 
 #define PREDICATE_FOREIGN 1
 #define PREDICATE_DYNAMIC 2
+#define PREDICATE_ABOLISHED 4
 
 typedef void(*ExecutionCallback)(RC);
 
@@ -131,6 +159,7 @@ void print_clause(Clause);
 void initialize_kernel();
 int unify(word a, word b);
 int unify_or_undo(word a, word b);
+int unifiable(word a, word b);
 int safe_unify(word a, word b); // Handles a or b being local copies
 word copy_term(word term);
 #define NON_DETERMINISTIC 1
@@ -150,12 +179,57 @@ void halt(int code);
 ExecutionCallback current_yield();
 void resume_yield(RC status, ExecutionCallback y);
 
-extern Stream current_input;
-extern Stream current_output;
-extern word HEAP[];
-extern word* H;
+extern THREAD_LOCAL Stream current_input;
+extern THREAD_LOCAL Stream current_output;
+extern THREAD_LOCAL word* HEAP;
+extern THREAD_LOCAL word* HTOP;
+extern THREAD_LOCAL word* H;
+extern THREAD_LOCAL word* HMAX;
+extern THREAD_LOCAL word* STACK;
+extern THREAD_LOCAL word* STOP;
+extern THREAD_LOCAL word* SP;
+extern THREAD_LOCAL word* TRAIL;
+extern THREAD_LOCAL word* TR;
+extern THREAD_LOCAL word* ARGS;
+extern THREAD_LOCAL word* ATOP;
+extern THREAD_LOCAL word* ARGP;
+extern THREAD_LOCAL uintptr_t* argStack;
+extern THREAD_LOCAL uintptr_t* argStackP;
+extern THREAD_LOCAL Frame FR;
+extern THREAD_LOCAL Choicepoint CP;
+extern THREAD_LOCAL List saved_states;
+extern THREAD_LOCAL word** heap_roots;
+extern THREAD_LOCAL int heap_root_count;
+#define IS_HEAP_ADDRESS(t) ((Word)(t) >= HEAP && (Word)(t) < HTOP)
+#define IS_STACK_ADDRESS(t) ((Word)(t) >= STACK && (Word)(t) < STOP)
 #endif
 
+void fatal(char* string);
+void set_heap_limit();
+void register_root(word* root);
+void unregister_root(word* root);
+void reserve_heap(size_t cells);
+Word allocate_heap(size_t cells);
+
+typedef struct engine* Engine;
+Engine create_engine();
+Engine activate_engine(Engine engine);
+Engine get_current_engine();
+void destroy_engine(Engine engine);
+void reset_engine();
+void set_engine_streams(Stream input, Stream output);
+void forall_engine_heaps(void (*fn)(word*, word*));
+int forall_running_clauses(void (*fn)(Clause, void*), void (*waiting)(Clause, unsigned long, void*), void* data);
+void start_query();
+void finish_query();
+void check_busy();
+
+typedef struct thread_pool* ThreadPool;
+ThreadPool create_thread_pool(int thread_count);
+int thread_pool_submit(ThreadPool pool, word goal, void (*done)(RC, word, void*), void* data);
+void thread_pool_wait(ThreadPool pool);
+void destroy_thread_pool(ThreadPool pool);
+
 word get_choicepoint_depth();
 State push_state();
 void restore_state(State state);
@@ -1,75 +1,198 @@
 #include "local.h"
 #include "compiler.h"
+#include <string.h>
 #ifdef EMSCRIPTEN
 #include <emscripten/emscripten.h>
 #else
 #define EMSCRIPTEN_KEEPALIVE
 #endif
 
+/* Terms are copied without recursion, so that a deep term cannot overflow the C stack. Instead the cells still to be copied are kept
+   on a term stack. Each variable is looked up in a variable map, which is an open-addressed hash table from the address of the variable
+   to its copy, so copying takes time proportional to the size of the term however many variables it has. We cannot mark the variables
+   in place by binding them to their copies instead, since the term may be a clause or a record which another thread is reading.
+   The first occurrence of a variable becomes the copy itself: the cell it is copied into is made an unbound variable, just as
+   MAKE_COMPOUND() does for the arguments of a new term, and later occurrences refer to that cell.
+*/
 
+void init_term_stack(TermStack* stack)
+{
+   stack->items = stack->initial;
+   stack->size = 0;
+   stack->capacity = sizeof(stack->initial) / sizeof(word);
+}
 
-static int count_compounds(word t)
+void push_term(TermStack* stack, word w)
 {
-   t = DEREF(t);
-   if (TAGOF(t) == COMPOUND_TAG)
+   if (stack->size == stack->capacity)
    {
-      int i = 1;
-      Functor f = getConstant(FUNCTOROF(t), NULL).functor_data;
-      for (int j = 0; j < f->arity; j++)
-         i+=count_compounds(ARGOF(t, j));
-      return i + f->arity;
+      stack->capacity *= 2;
+      if (stack->items == stack->initial)
+      {
+         stack->items = malloc(sizeof(word) * stack->capacity);
+         memcpy(stack->items, stack->initial, sizeof(stack->initial));
+      }
+      else
+         stack->items = realloc(stack->items, sizeof(word) * stack->capacity);
    }
-   return 0;
+   stack->items[stack->size++] = w;
+}
+
+void free_term_stack(TermStack* stack)
+{
+   if (stack->items != stack->initial)
+      free(stack->items);
 }
 
+void init_variable_map(VariableMap* map)
+{
+   map->keys = map->initial_keys;
+   map->values = map->initial_values;
+   map->count = 0;
+   map->capacity = sizeof(map->initial_keys) / sizeof(word);
+   memset(map->keys, 0, sizeof(map->initial_keys));
+}
+
+static size_t variable_hash(word key, size_t capacity)
+{
+   // Variables are word-aligned, so the low bits of the address are always 0
+   return (size_t)(((uint64_t)(key >> 3) * 0x9e3779b97f4a7c15ULL) >> 32) & (capacity - 1);
+}
+
+static Word variable_map_slot(word* keys, word key, size_t capacity)
+{
+   size_t i = variable_hash(key, capacity);
+   while (keys[i] != 0 && keys[i] != key)
+      i = (i + 1) & (capacity - 1);
+   return &keys[i];
+}
 
-void make_local_(word t, List* variables, word* heap, int* ptr, int size, word* target, int mark_constants)
+// Returns the value for var, which is 0 if it is not in the map yet. In that case the caller must set it, through the pointer returned
+Word variable_map_lookup(VariableMap* map, word var)
 {
-   // This do-while construct is used to make the COMPOUND_TAG case right-recursive
-   // This means that processing a list uses O(1) C-stack rather than O(n).
-   do
+   if (2 * (map->count + 1) > map->capacity)
    {
-      t = DEREF(t);
-      switch(TAGOF(t))
+      size_t capacity = map->capacity * 2;
+      word* keys = calloc(capacity, sizeof(word));
+      word* values = malloc(sizeof(word) * capacity);
+      for (size_t i = 0; i < map->capacity; i++)
       {
-         case CONSTANT_TAG:
-            if (mark_constants)
-               acquire_constant("constant in local copy", t);
-         case POINTER_TAG:
-            *target = t;
-            return;
-         case COMPOUND_TAG:
+         if (map->keys[i] != 0)
+         {
+            Word slot = variable_map_slot(keys, map->keys[i], capacity);
+            *slot = map->keys[i];
+            values[slot - keys] = map->values[i];
+         }
+      }
+      free_variable_map(map);
+      map->keys = keys;
+      map->values = values;
+      map->capacity = capacity;
+   }
+   Word slot = variable_map_slot(map->keys, var, map->capacity);
+   if (*slot == 0)
+   {
+      *slot = var;
+      map->values[slot - map->keys] = 0;
+      map->count++;
+   }
+   return &map->values[slot - map->keys];
+}
+
+void free_variable_map(VariableMap* map)
+{
+   if (map->keys != map->initial_keys)
+   {
+      free(map->keys);
+      free(map->values);
+   }
+}
+
+// Returns the number of cells needed for a copy of t, not including the one which refers to it
+static size_t count_cells(word t)
+{
+   size_t size = 0;
+   TermStack stack;
+   init_term_stack(&stack);
+   push_term(&stack, t);
+   while (stack.size > 0)
+   {
+      t = DEREF(stack.items[--stack.size]);
+      while (TAGOF(t) == COMPOUND_TAG)
+      {
+         int arity = FUNCTOR_ARITY(FUNCTOROF(t));
+         size += arity + (IS_LIST_CELL(t)?0:1);
+         for (int i = arity-1; i > 0; i--)
+            push_term(&stack, ARGOF(t, i));
+         t = ARGOF(t, 0);
+      }
+   }
+   free_term_stack(&stack);
+   return size;
+}
+
+// Copies t into target, putting the cells of any compounds in it from cells onwards, and returns the first cell after the copy. If the copy
+// would go past limit it is a fatal error. If t is a variable then target must be a cell which can become the copy of it
+Word copy_cells(word t, Word target, Word cells, Word limit, int mark_constants)
+{
+   TermStack stack;
+   VariableMap variables;
+   init_term_stack(&stack);
+   init_variable_map(&variables);
+   // The stack holds pairs of a term and the cell to copy it into. The first argument of a compound is copied straight away and the
+   // rest are pushed last to first, so that copying a list needs only a constant amount of stack
+   push_term(&stack, t);
+   push_term(&stack, (word)target);
+   while (stack.size > 0)
+   {
+      target = (Word)stack.items[--stack.size];
+      t = stack.items[--stack.size];
+      while (1)
+      {
+         t = DEREF(t);
+         if (TAGOF(t) == COMPOUND_TAG)
          {
-            *target = (word)(&heap[*ptr]) | COMPOUND_TAG;
-            heap[*ptr] = FUNCTOROF(t);
-            (*ptr)++;
-            int argp = *ptr;
-            if (mark_constants)
-               acquire_constant("functor in local copy", FUNCTOROF(t));
-            Functor f = getConstant(FUNCTOROF(t), NULL).functor_data;
-            (*ptr) += f->arity;
-            for (int i = 0; i < f->arity-1; i++)
+            int arity = FUNCTOR_ARITY(FUNCTOROF(t));
+            if (cells + arity + (IS_LIST_CELL(t)?0:1) > limit)
+               fatal("Global stack overflow");
+            if (IS_LIST_CELL(t))
+               *target = (word)cells | LIST_TAG;
+            else
             {
-               make_local_(ARGOF(t, i), variables, heap, ptr, size, &heap[argp], mark_constants);
-               argp++;
+               if (mark_constants)
+                  acquire_constant("functor in local copy", FUNCTOROF(t));
+               *target = (word)cells | COMPOUND_TAG;
+               *(cells++) = FUNCTOROF(t);
             }
-            t = ARGOF(t, f->arity-1);
-            target = &heap[argp];
+            for (int i = arity-1; i > 0; i--)
+            {
+               push_term(&stack, ARGOF(t, i));
+               push_term(&stack, (word)&cells[i]);
+            }
+            target = &cells[0];
+            t = ARGOF(t, 0);
+            cells += arity;
             continue;
-            return;
          }
-         case VARIABLE_TAG:
+         if (TAGOF(t) == VARIABLE_TAG)
+         {
+            Word copy = variable_map_lookup(&variables, t);
+            if (*copy == 0)
+               *copy = (word)target;
+            *target = *copy;
+         }
+         else
          {
-            // The variables appear, backwards, at the end of the heap. This is so that
-            // The term we want is also identifiable as (word)heap
-            int i = list_index(variables, t);
-            heap[size-i-1] = (word)&heap[size-i-1];
-            *target = (word)&heap[size-i-1];
-            return;
+            if (TAGOF(t) == CONSTANT_TAG && mark_constants)
+               acquire_constant("constant in local copy", t);
+            *target = t;
          }
+         break;
       }
-      assert(0);
-   } while(1);
+   }
+   free_variable_map(&variables);
+   free_term_stack(&stack);
+   return cells;
 }
 
 void free_local(word w)
@@ -82,43 +205,21 @@ word copy_local_with_extra_space(word t, word** local, int extra, int mark_const
 {
    t = DEREF(t);
    // First, if extra is 0 we can do some simple optimisations:
-   if (extra == 0)
+   if (extra == 0 && (TAGOF(t) == CONSTANT_TAG || TAGOF(t) == POINTER_TAG))
    {
-      if (TAGOF(t) == CONSTANT_TAG || TAGOF(t) == POINTER_TAG)
-      {
-         if (TAGOF(t) == CONSTANT_TAG && mark_constants)
-            acquire_constant("simple constant in local copy", t);
-         *local = (word*)t;
-         return t;
-      }
-      if (TAGOF(t) == VARIABLE_TAG)
-      {
-         word* localptr = malloc(sizeof(word));
-         localptr[0] = (word)&localptr[0];
-         return (word)&localptr[0];
-      }
-      // For compounds we must do the normal complicated process
+      if (TAGOF(t) == CONSTANT_TAG && mark_constants)
+         acquire_constant("simple constant in local copy", t);
+      *local = (word*)t;
+      return t;
    }
-
-
-   List variables;
-   init_list(&variables);
-   int i = count_compounds(t);
-   find_variables(t, &variables);
-   i += list_length(&variables);
-   i += extra;
-   i++;
-   word* localptr = malloc(sizeof(word) * i);
+   // The extra space comes first, then the cell which refers to the copy, and then the copy itself. That way the copy of a variable is
+   // the cell after the extra space
+   size_t size = extra + 1 + count_cells(t);
+   word* localptr = malloc(sizeof(word) * size);
    assert(local != NULL);
-   //printf("Allocated buffer for "); PORTRAY(t); printf(" at %d\n", (int)localptr);
    *local = localptr;
-
-   int ptr = extra + 1;
-   word w;
-   make_local_(t, &variables, localptr, &ptr, i, &w, mark_constants);
-   localptr[extra] = w;
-   free_list(&variables);
-   return w;
+   copy_cells(t, &localptr[extra], &localptr[extra+1], &localptr[size], mark_constants);
+   return localptr[extra];
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -127,3 +228,26 @@ word copy_local(word t, word** local)
    return copy_local_with_extra_space(t, local, 0, 1);
 }
 
+// Copies t into *area, which has room for *capacity cells, replacing whatever was there. The area is only reallocated if the copy does not
+// fit, or if t is itself in the area. *used is set to the number of cells in the copy. The constants in the copy are not acquired, so
+// whoever owns the area must make sure AGC sees them (see forall_engine_heaps())
+word copy_local_into(word t, word** area, size_t* capacity, size_t* used)
+{
+   t = DEREF(t);
+   size_t size = 1 + count_cells(t);
+   word* old = NULL;
+   word* address = (TAGOF(t) == COMPOUND_TAG)?COMPOUND_ADDRESS(t):(word*)t;
+   if (size > *capacity || (TAGOF(t) != CONSTANT_TAG && address >= *area && address < *area + *capacity))
+   {
+      old = *area;
+      if (size > *capacity)
+         *capacity = size;
+      *area = malloc(sizeof(word) * *capacity);
+      if (*area == NULL)
+         fatal("Unable to allocate local copy");
+   }
+   copy_cells(t, &(*area)[0], &(*area)[1], &(*area)[size], 0);
+   free(old);
+   *used = size;
+   return (*area)[0];
+}
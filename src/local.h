@@ -6,8 +6,36 @@
 #include "kernel.h"
 #include "ctable.h"
 
+// A stack of the cells still to be visited when walking a term. Small terms need no memory to be allocated
+typedef struct
+{
+   word* items;
+   size_t size;
+   size_t capacity;
+   word initial[64];
+} TermStack;
+
+// A map from the address of each variable in a term to a word, such as its copy. 0 means the variable is not in the map
+typedef struct
+{
+   word* keys;
+   word* values;
+   size_t count;
+   size_t capacity;
+   word initial_keys[32];
+   word initial_values[32];
+} VariableMap;
+
+void init_term_stack(TermStack* stack);
+void push_term(TermStack* stack, word w);
+void free_term_stack(TermStack* stack);
+void init_variable_map(VariableMap* map);
+Word variable_map_lookup(VariableMap* map, word var);
+void free_variable_map(VariableMap* map);
+Word copy_cells(word t, Word target, Word cells, Word limit, int mark_constants);
 void free_local(word t);
 word copy_local_with_extra_space(word t, word** local, int extra, int mark_constants);
 word copy_local(word t, word** local);
+word copy_local_into(word t, word** area, size_t* capacity, size_t* used);
 
 #endif
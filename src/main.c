@@ -7,7 +7,6 @@
 int main(int argc, char** argv)
 {
    init_prolog();
-   do_test(argc, argv);
-   return 0;
+   return do_test(argc, argv);
 }
 
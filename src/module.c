@@ -15,10 +15,12 @@
 #include "compiler.h"
 #include "checks.h"
 #include "local.h"
+#include "threads.h"
 #include <stdio.h>
 #include <assert.h>
 
 wmap_t modules = NULL;
+unsigned int predicate_generation = 1;
 
 void initialize_modules()
 {
@@ -33,10 +35,21 @@ void free_clause(Clause c)
    {
       //printf("Releasing constants from freed clause %p\n", c);
       for (int i = 0; i < c->constant_size; i++)
-         release_constant("freed clause constant", c->constants[i]);
+      {
+         if (TAGOF(c->constants[i]) == CONSTANT_TAG)
+            release_constant("freed clause constant", c->constants[i]);
+      }
       free(c->constants);
       //printf("... done\n");
    }
+   if (c->index != NULL)
+      free_clause_index(c->index);
+   if (c->call_cache != NULL)
+   {
+      for (int i = 0; i < c->constant_size; i++)
+         free(c->call_cache[i]);
+      free(c->call_cache);
+   }
    free(c);
 }
 
@@ -50,6 +63,244 @@ void free_clauses(Clause c)
    }
 }
 
+void _free_clauses(void* c)
+{
+   free_clauses((Clause)c);
+}
+
+/* Code which has been retracted or replaced may still be in use: a frame may be part way through one of its clauses, or a choicepoint
+   may be waiting to try one, in any engine. Rather than being freed it is retired, and reclaim_code() frees it once no frame or
+   choicepoint can reach it. A clause which was retracted still leads on to the clauses which followed it when it was unlinked, and a
+   copy in the chain of an index leads back to its original, so those are kept too. Reclaiming looks at the stacks of every busy engine
+   (see forall_running_clauses()), so it can only be done at a safe point, and only while no other thread is running. Code retired
+   while this thread is running is reclaimed at the next safe point once enough has built up, or once no thread is running.
+   A retracted clause cannot even be unlinked while a call made before it was retracted is waiting to try a clause in front of it, since
+   that call must still see it. So retracted clauses stay in the code (see retract_clause()) until reclaim_code() finds that no such
+   call is waiting, and only then are they unlinked and retired
+*/
+struct retired_code
+{
+   void* code;
+   void (*free)(void*);
+   void (*forall_clauses)(void*, ClauseVisitor, void*);  // Calls the visitor with each clause which belongs to code
+   int reachable;
+};
+
+struct reclaim_state
+{
+   wmap_t owners;                                        // The retired_code each retired clause belongs to
+   struct retired_code* code;
+   wmap_t waited;                                        // The oldest generation of a waiting call which has been past each clause
+   wmap_t visible;                                       // The retracted clauses which a waiting call can still see
+};
+
+#define RECLAIM_MIN 256
+#define ERASE_MIN 32
+List retired_code = {NULL, NULL, 0};
+int reclaim_threshold = RECLAIM_MIN;
+List erasing = {NULL, NULL, 0};                          // The predicates which have retracted clauses still in their code
+int erased_count = 0;                                    // ... and how many clauses that is in all
+int erase_threshold = ERASE_MIN;
+int reclaiming = 0;
+THREAD_LOCAL int reclaim_wanted = 0;
+
+// c itself, along with its copies in the chains of any index
+void forall_copies(Clause c, ClauseVisitor fn, void* data)
+{
+   fn(c, data);
+   for (Clause copy = c->copies; copy != NULL; copy = copy->copies)
+      fn(copy, data);
+}
+
+void _forall_copies(void* c, ClauseVisitor fn, void* data)
+{
+   forall_copies((Clause)c, fn, data);
+}
+
+// Every clause in the chain starting at first, along with their copies
+void forall_chain_clauses(void* first, ClauseVisitor fn, void* data)
+{
+   for (Clause c = (Clause)first; c != NULL; c = c->next)
+      forall_copies(c, fn, data);
+}
+
+void _forall_predicate_clauses(void* p, ClauseVisitor fn, void* data)
+{
+   forall_chain_clauses(((Predicate)p)->firstClause, fn, data);
+}
+
+void note_owner(Clause c, void* data)
+{
+   struct reclaim_state* state = (struct reclaim_state*)data;
+   whashmap_put(state->owners, (word)c, state->code);
+}
+
+// Marks the retired code that a frame or choicepoint in c can get to as reachable. Once a clause has been followed, its entry in owners
+// has the bottom bit set so that we do not follow it again
+void mark_reachable(Clause c, void* data)
+{
+   wmap_t owners = ((struct reclaim_state*)data)->owners;
+   struct retired_code* r;
+   while (c != NULL && whashmap_get(owners, (word)c, (any_t*)&r) == MAP_OK && ((uintptr_t)r & 1) == 0)
+   {
+      r->reachable = 1;
+      whashmap_put(owners, (word)c, (any_t)((uintptr_t)r | 1));
+      if (c->original != NULL)
+         mark_reachable(c->original, data);
+      c = c->next;
+   }
+}
+
+// Notes the retracted clauses that a call made at generation can still see, now that it is waiting to try c. A call which has already
+// been past a clause with the same or an older generation has seen everything after it that this one can
+void mark_visible(Clause c, unsigned long generation, void* data)
+{
+   struct reclaim_state* state = (struct reclaim_state*)data;
+   if (erasing.head == NULL)
+      return;
+   for (; c != NULL; c = c->next)
+   {
+      any_t waited;
+      if (whashmap_get(state->waited, (word)c, &waited) == MAP_OK && (uintptr_t)waited <= generation)
+         return;
+      whashmap_put(state->waited, (word)c, (any_t)(uintptr_t)generation);
+      if (c->died > generation)
+         whashmap_put(state->visible, (word)((c->original != NULL)?c->original:c), NULL);
+   }
+}
+
+// Unlinks the retracted clauses which nothing can see any more, unless clause/2 or retract/1 are part way through their predicate
+void erase_invisible_clauses(wmap_t visible)
+{
+   struct cell_t* cell = erasing.head;
+   while (cell != NULL)
+   {
+      struct cell_t* next = cell->next;
+      Predicate p = (Predicate)cell->data;
+      struct cell_t* e = p->erased.head;
+      while (e != NULL && p->cursors == 0)
+      {
+         struct cell_t* next_erased = e->next;
+         Clause c = (Clause)e->data;
+         any_t ignored;
+         if (whashmap_get(visible, (word)c, &ignored) != MAP_OK)
+         {
+            list_splice(&p->erased, e);
+            erased_count--;
+            erase_clause(p, c);
+         }
+         e = next_erased;
+      }
+      if (p->erased.head == NULL)
+         list_splice(&erasing, cell);
+      cell = next;
+   }
+}
+
+// Frees any retired code that nothing can reach any more, and unlinks any retracted clauses that nothing can see. Must only be called at
+// a safe point
+void reclaim_code()
+{
+   LOCK_GLOBALS();
+   reclaim_wanted = 0;
+   if ((retired_code.head != NULL || erasing.head != NULL) && !reclaiming && threads_running() == 0)
+   {
+      struct reclaim_state state;
+      // Unlinking clauses retires them, which must not start reclaiming again
+      reclaiming = 1;
+      state.owners = whashmap_new();
+      state.waited = whashmap_new();
+      state.visible = whashmap_new();
+      for (struct cell_t* cell = retired_code.head; cell != NULL; cell = cell->next)
+      {
+         state.code = (struct retired_code*)cell->data;
+         state.code->reachable = 0;
+         state.code->forall_clauses(state.code->code, note_owner, &state);
+      }
+      // If a busy engine is active in another thread we cannot see what it is doing, so everything must wait until next time
+      if (forall_running_clauses(mark_reachable, mark_visible, &state))
+      {
+         struct cell_t* cell = retired_code.head;
+         while (cell != NULL)
+         {
+            struct cell_t* next = cell->next;
+            struct retired_code* r = (struct retired_code*)cell->data;
+            if (!r->reachable)
+            {
+               list_splice(&retired_code, cell);
+               r->free(r->code);
+               free(r);
+            }
+            cell = next;
+         }
+         // The clauses unlinked here are retired, and freed by the next reclaim_code() if nothing can reach them
+         erase_invisible_clauses(state.visible);
+         reclaim_threshold = list_length(&retired_code) * 2;
+         if (reclaim_threshold < RECLAIM_MIN)
+            reclaim_threshold = RECLAIM_MIN;
+         erase_threshold = erased_count * 2;
+         if (erase_threshold < ERASE_MIN)
+            erase_threshold = ERASE_MIN;
+      }
+      whashmap_free(state.owners);
+      whashmap_free(state.waited);
+      whashmap_free(state.visible);
+      reclaiming = 0;
+   }
+   UNLOCK_GLOBALS();
+}
+
+// Reclaims code straight away outside execute(), since every point is a safe point there, or at the next safe point once enough has built
+// up. Must be called while holding global_lock
+void want_reclaim()
+{
+   if (running_depth == 0)
+      reclaim_code();
+   else if (list_length(&retired_code) >= reclaim_threshold || erased_count >= erase_threshold)
+      reclaim_wanted = 1;
+}
+
+// Frees code with free_fn(code) once nothing can be running it. forall_clauses says which clauses belong to it. Must be called while
+// holding global_lock
+void retire_code(void* code, void (*free_fn)(void*), void (*forall_clauses)(void*, ClauseVisitor, void*))
+{
+   struct retired_code* r = malloc(sizeof(struct retired_code));
+   r->code = code;
+   r->free = free_fn;
+   r->forall_clauses = forall_clauses;
+   list_append(&retired_code, (word)r);
+   want_reclaim();
+}
+
+// Forgets the retracted clauses still in the code for p, since p is about to be retired along with all of them
+void forget_erased_clauses(Predicate p)
+{
+   if (p->erased.head != NULL)
+   {
+      erased_count -= list_length(&p->erased);
+      free_list(&p->erased);
+      init_list(&p->erased);
+      for (struct cell_t* cell = erasing.head; cell != NULL; cell = cell->next)
+      {
+         if ((Predicate)cell->data == p)
+         {
+            list_splice(&erasing, cell);
+            break;
+         }
+      }
+   }
+}
+
+// Replaces the compiled code for p after its clauses have changed. The old code is retired, since it might still be running. Must be called
+// while holding global_lock
+void recompile_predicate(Predicate p)
+{
+   Clause old = p->firstClause;
+   ATOMIC_STORE(&p->firstClause, compile_predicate(p));
+   if (old != NULL)
+      retire_code(old, _free_clauses, forall_chain_clauses);
+}
+
 void release_source_constants(word w, void* ignored)
 {
    forall_term_constants(w, "source constant", release_constant);
@@ -57,26 +308,41 @@ void release_source_constants(word w, void* ignored)
 
 void free_predicate(Predicate p)
 {
+   forget_erased_clauses(p);
    // Release constants contained in the source for the predicate
    list_apply(&p->clauses, NULL, release_source_constants);
    free_clauses(p->firstClause);
    if ((p->flags & PREDICATE_FOREIGN) == 0)
       free_list(&p->clauses);
+   if (p->bound_calls != NULL)
+      free(p->bound_calls);
    free(p);
 }
 
 int define_foreign_predicate_c(Module module, word functor, int(*func)(), int flags)
 {
    Predicate p;
+   LOCK_GLOBALS();
    if (whashmap_get(module->predicates, functor, (any_t)&p) == MAP_OK)
+   {
+      UNLOCK_GLOBALS();
       return 0;
+   }
    //printf("Defining foreign (C) predicate "); PORTRAY(module->name); printf(":"); PORTRAY(functor); printf(" as %p\n", func);
    p = malloc(sizeof(predicate));
    p->meta = NULL;
    p->flags = PREDICATE_FOREIGN;
    p->firstClause = foreign_predicate_c(func, getConstant(functor, NULL).functor_data->arity, flags);
+   p->lastClause = NULL;
+   p->cursors = 0;
+   init_list(&p->erased);
+   init_list(&p->dropped_indexes);
+   p->bound_calls = NULL;
+   p->indexed_args = 0;
    acquire_constant("predicate name", functor);
    whashmap_put(module->predicates, functor, p);
+   predicate_generation++;
+   UNLOCK_GLOBALS();
    return 1;
 }
 
@@ -94,8 +360,15 @@ int define_foreign_predicate_js(Module module, word functor, word func)
    p->flags = PREDICATE_FOREIGN;
    Functor f = getConstant(functor, NULL).functor_data;
    p->firstClause = foreign_predicate_js(func, f->arity, NON_DETERMINISTIC);
+   p->lastClause = NULL;
+   p->cursors = 0;
+   init_list(&p->erased);
+   init_list(&p->dropped_indexes);
+   p->bound_calls = NULL;
+   p->indexed_args = 0;
    acquire_constant("predicate name", functor);
    whashmap_put(module->predicates, functor, p);
+   predicate_generation++;
    return 1;
 }
 
@@ -103,10 +376,12 @@ int define_foreign_predicate_js(Module module, word functor, word func)
 Predicate lookup_predicate(Module module, word functor)
 {
    Predicate p;
-   if (whashmap_get(module->predicates, functor, (any_t)&p) == MAP_OK)
-      return p;
-   //printf("Unable to find "); PORTRAY(module->name); printf(":"); PORTRAY(functor); printf("\n");
-   return NULL;
+   LOCK_GLOBALS();
+   if (whashmap_get(module->predicates, functor, (any_t)&p) != MAP_OK)
+      p = NULL;
+   UNLOCK_GLOBALS();
+   //if (p == NULL) { printf("Unable to find "); PORTRAY(module->name); printf(":"); PORTRAY(functor); printf("\n"); }
+   return p;
 }
 
 static
@@ -120,8 +395,11 @@ void destroy_module(Module m)
 {
    printf("Destroying module "); PORTRAY(m->name); printf("\n");
    // CHECKME: Could there be references to this module or the predicates elsewhere?
+   LOCK_GLOBALS();
    whashmap_iterate(m->predicates, _destroy_module_predicate, NULL);
    whashmap_free(m->predicates);
+   predicate_generation++;
+   UNLOCK_GLOBALS();
    free(m);
 }
 
@@ -130,8 +408,11 @@ Module create_module(word name)
    Module m = malloc(sizeof(module));
    Module old_module = NULL;
    m->name = name;
-   whashmap_put(modules, name, m);
    m->predicates = whashmap_new();
+   LOCK_GLOBALS();
+   whashmap_put(modules, name, m);
+   predicate_generation++;
+   UNLOCK_GLOBALS();
    return m;
    //printf("Created a module: "); PORTRAY(name); printf("\n");
 }
@@ -140,13 +421,15 @@ EMSCRIPTEN_KEEPALIVE
 Module find_module(word name)
 {
    Module m;
-   if (whashmap_get(modules, name, (any_t)&m) == MAP_OK)
-      return m;
-//   printf("Could not find module "); PORTRAY(name); printf("\n");
-   return NULL;
+   LOCK_GLOBALS();
+   if (whashmap_get(modules, name, (any_t)&m) != MAP_OK)
+      m = NULL;
+   UNLOCK_GLOBALS();
+//   if (m == NULL) { printf("Could not find module "); PORTRAY(name); printf("\n"); }
+   return m;
 }
 
-int set_meta(Module module, word functor, char* meta)
+int _set_meta(Module module, word functor, char* meta)
 {
    Predicate p;
    if (whashmap_get(module->predicates, functor, (any_t)&p) == MAP_OK)
@@ -160,18 +443,37 @@ int set_meta(Module module, word functor, char* meta)
       p->flags = 0;
       p->meta = meta;
       p->firstClause = NULL;
+      p->lastClause = NULL;
+      p->cursors = 0;
+      init_list(&p->erased);
+      init_list(&p->dropped_indexes);
+      p->bound_calls = NULL;
+      p->indexed_args = 0;
       acquire_constant("predicate name", functor);
       whashmap_put(module->predicates, functor, p);
+      predicate_generation++;
    }
    return 1;
 }
 
-int set_dynamic(Module module, word functor)
+int set_meta(Module module, word functor, char* meta)
+{
+   LOCK_GLOBALS();
+   int rc = _set_meta(module, functor, meta);
+   UNLOCK_GLOBALS();
+   return rc;
+}
+
+int _set_dynamic(Module module, word functor)
 {
    Predicate p;
    if (whashmap_get(module->predicates, functor, (any_t)&p) == MAP_OK)
    {
+      int was_dynamic = (p->flags & PREDICATE_DYNAMIC) != 0;
       p->flags = PREDICATE_DYNAMIC;
+      // The last clause of a dynamic predicate must try the next clause, in case one is added after it
+      if (!was_dynamic && p->firstClause != NULL)
+         recompile_predicate(p);
    }
    else
    {
@@ -180,13 +482,28 @@ int set_dynamic(Module module, word functor)
       p->flags = PREDICATE_DYNAMIC;
       p->meta = NULL;
       p->firstClause = NULL;
+      p->lastClause = NULL;
+      p->cursors = 0;
+      init_list(&p->erased);
+      init_list(&p->dropped_indexes);
+      p->bound_calls = NULL;
+      p->indexed_args = 0;
       acquire_constant("predicate name", functor);
       whashmap_put(module->predicates, functor, p);
+      predicate_generation++;
    }
    return 1;
 }
 
-void add_clause(Module module, word functor, word clause)
+int set_dynamic(Module module, word functor)
+{
+   LOCK_GLOBALS();
+   int rc = _set_dynamic(module, functor);
+   UNLOCK_GLOBALS();
+   return rc;
+}
+
+void _add_clause(Module module, word functor, word clause)
 {
    Predicate p;
    //printf("Adding clause to "); PORTRAY(functor); printf("\n");
@@ -217,7 +534,19 @@ void add_clause(Module module, word functor, word clause)
          free_local((word)local);
          return;
       }
-      list_append(&p->clauses, clause);
+      struct cell_t* cell = list_append(&p->clauses, clause);
+      if (p->firstClause != NULL)
+      {
+         // The predicate has already been called, so its code must include the new clause
+         if ((p->flags & PREDICATE_DYNAMIC) == 0)
+            recompile_predicate(p);
+         else if (!add_dynamic_clause(p, cell, 1))
+         {
+            forall_term_constants(clause, "uncompiled clause", release_constant);
+            free_local((word)local);
+            list_splice(&p->clauses, cell);
+         }
+      }
    }
    else
    {
@@ -227,13 +556,27 @@ void add_clause(Module module, word functor, word clause)
       p->flags = 0;
       p->meta = NULL;
       p->firstClause = NULL;
+      p->lastClause = NULL;
+      p->cursors = 0;
+      init_list(&p->erased);
+      init_list(&p->dropped_indexes);
+      p->bound_calls = NULL;
+      p->indexed_args = 0;
       acquire_constant("predicate name", functor);
       whashmap_put(module->predicates, functor, p);
+      predicate_generation++;
    }
 }
 
+void add_clause(Module module, word functor, word clause)
+{
+   LOCK_GLOBALS();
+   _add_clause(module, functor, clause);
+   UNLOCK_GLOBALS();
+}
 
-int asserta(Module module, word clause)
+
+int _asserta(Module module, word clause)
 {
    word functor;
    if (!clause_functor(clause, &functor))
@@ -272,13 +615,17 @@ int asserta(Module module, word clause)
       cell = list_unshift(&p->clauses, clause);
       p->meta = NULL;
       p->firstClause = NULL;
+      p->lastClause = NULL;
+      p->cursors = 0;
+      init_list(&p->erased);
+      init_list(&p->dropped_indexes);
+      p->bound_calls = NULL;
+      p->indexed_args = 0;
       acquire_constant("predicate name", functor);
       whashmap_put(module->predicates, functor, p);
+      predicate_generation++;
    }
-   free_clauses(p->firstClause);
-   p->firstClause = compile_predicate(p);
-   //printf("Assert complete: %p\n", p->firstClause);
-   if (p->firstClause == NULL)
+   if (!add_dynamic_clause(p, cell, 0))
    {
       // Compilation failed. Scrub out that clause
       free_local((word)local);
@@ -288,7 +635,15 @@ int asserta(Module module, word clause)
    return SUCCESS;
 }
 
-int assertz(Module module, word clause)
+int asserta(Module module, word clause)
+{
+   LOCK_GLOBALS();
+   int rc = _asserta(module, clause);
+   UNLOCK_GLOBALS();
+   return rc;
+}
+
+int _assertz(Module module, word clause)
 {
    word functor;
    if (!clause_functor(clause, &functor))
@@ -318,12 +673,17 @@ int assertz(Module module, word clause)
       cell = list_append(&p->clauses, clause);
       p->meta = NULL;
       p->firstClause = NULL;
+      p->lastClause = NULL;
+      p->cursors = 0;
+      init_list(&p->erased);
+      init_list(&p->dropped_indexes);
+      p->bound_calls = NULL;
+      p->indexed_args = 0;
       acquire_constant("predicate name", functor);
       whashmap_put(module->predicates, functor, p);
+      predicate_generation++;
    }
-   free_clauses(p->firstClause);
-   p->firstClause = compile_predicate(p);
-   if (p->firstClause == NULL)
+   if (!add_dynamic_clause(p, cell, 1))
    {
       // Compilation failed. Scrub out that clause
       free_local((word)local);
@@ -333,13 +693,38 @@ int assertz(Module module, word clause)
    return SUCCESS;
 }
 
+int assertz(Module module, word clause)
+{
+   LOCK_GLOBALS();
+   int rc = _assertz(module, clause);
+   UNLOCK_GLOBALS();
+   return rc;
+}
+
 void _free_asserted_terms(word term, void* ignored)
 {
-   if (term != 0)
+   // An atom is its own local copy (see copy_local_with_extra_space())
+   if (term != 0 && TAGOF(term) == VARIABLE_TAG)
       free((void*)term);
 }
 
-int abolish(Module module, word indicator)
+void _free_asserted_term(void* term)
+{
+   _free_asserted_terms((word)term, NULL);
+}
+
+void _free_abolished_predicate(void* data)
+{
+   Predicate p = (Predicate)data;
+   // free_predicate releases the constants in the clauses, so we must do that before freeing them
+   list_apply(&p->clauses, NULL, release_source_constants);
+   list_apply(&p->clauses, NULL, _free_asserted_terms);
+   free_list(&p->clauses);
+   init_list(&p->clauses);
+   free_predicate(p);
+}
+
+int _abolish(Module module, word indicator)
 {
    if (!must_be_predicate_indicator(indicator))
    {
@@ -350,27 +735,154 @@ int abolish(Module module, word indicator)
    if ((p->flags & PREDICATE_DYNAMIC) == 0)
       return permission_error(modifyAtom, staticProcedureAtom, indicator);
    whashmap_remove(module->predicates, functor);
-   list_apply(&p->clauses, NULL, _free_asserted_terms);
-   free_predicate(p);
+   predicate_generation++;
+   // A clause/2 or retract/1 call may still be looking at the clauses, in which case the last one to finish retires p
+   if (p->cursors > 0)
+      p->flags |= PREDICATE_ABOLISHED;
+   else
+      retire_code(p, _free_abolished_predicate, _forall_predicate_clauses);
    return SUCCESS;
 }
 
-void retract(Module module, word clause)
+int abolish(Module module, word indicator)
 {
-   word functor;
-   if (!clause_functor(clause, &functor))
+   LOCK_GLOBALS();
+   int rc = _abolish(module, indicator);
+   UNLOCK_GLOBALS();
+   return rc;
+}
+
+/* clause/2 and retract/1 walk the clauses of a predicate with a cursor, rather than making a list of them all first. They see the
+   clauses as they were when they were called (the logical update view): each clause is stamped with the clause generation when it is
+   added and when it is retracted, and the cursor only looks at the clauses which were there at the generation when it was opened.
+   Other calls see the clauses the same way, using the generation in their frame. While a predicate has any open cursors, retracted
+   clauses are left where they are so that the cursors can carry on past them, and they are only unlinked once the last cursor has been
+   closed and no call can still see them (see reclaim_code()).
+*/
+unsigned long clause_generation = 0;
+
+struct clause_cursor
+{
+   Predicate predicate;
+   unsigned long generation;
+   word* local;             // A local copy of the Head :- Body term that the clauses must unify with
+   word pattern;
+   Clause next;             // The next clause (or copy in the chain of an index) which unifies, or NULL if there are no more
+};
+
+// Returns 1 if the clause term source unifies with pattern, which is a term Head :- Body. A fact is taken to have a body of true.
+// Neither of them is bound, and source is not even touched, since other threads may be looking at it
+int clause_unifies(word source, word pattern)
+{
+   word* local;
+   word copy = copy_local_with_extra_space(source, &local, 3, 0); // Do not acquire constants - the copy is not kept
+   if (!(TAGOF(copy) == COMPOUND_TAG && FUNCTOROF(copy) == clauseFunctor))
    {
-      CLEAR_EXCEPTION();
-      return;
+      local[0] = clauseFunctor;
+      local[1] = copy;
+      local[2] = trueAtom;
+      copy = (word)local | COMPOUND_TAG;
    }
-   Predicate p;
-   if (whashmap_get(module->predicates, functor, (any_t)&p) == MAP_OK)
+   int rc = unifiable(copy, pattern);
+   free(local);
+   return rc;
+}
+
+// Returns the first clause from c onwards that the cursor should return. Must be called while holding global_lock
+static Clause next_match(ClauseCursor cursor, Clause c)
+{
+   for (; c != NULL; c = c->next)
+   {
+      Clause original = (c->original != NULL)?c->original:c;
+      if (clause_visible(original, cursor->generation) && clause_unifies(original->source->data, cursor->pattern))
+         return c;
+   }
+   return NULL;
+}
+
+// Opens a cursor on the clauses of the dynamic predicate p which unify with clause, a term Head :- Body. It must be closed once it is no
+// longer needed, since until then no clause of p can be unlinked
+ClauseCursor open_clause_cursor(Predicate p, word clause)
+{
+   ClauseCursor cursor = malloc(sizeof(struct clause_cursor));
+   LOCK_GLOBALS();
+   if (p->firstClause == NULL)
+      ATOMIC_STORE(&p->firstClause, compile_predicate(p));
+   p->cursors++;
+   cursor->predicate = p;
+   cursor->generation = clause_generation;
+   cursor->pattern = copy_local(clause, &cursor->local);
+   cursor->next = next_match(cursor, candidate_clauses(p, ARGOF(cursor->pattern, 0)));
+   UNLOCK_GLOBALS();
+   return cursor;
+}
+
+// Returns the next clause, or NULL if there are no more
+Clause next_clause(ClauseCursor cursor)
+{
+   LOCK_GLOBALS();
+   Clause c = cursor->next;
+   if (c != NULL)
+   {
+      cursor->next = next_match(cursor, c->next);
+      if (c->original != NULL)
+         c = c->original;
+   }
+   UNLOCK_GLOBALS();
+   return c;
+}
+
+int has_next_clause(ClauseCursor cursor)
+{
+   return cursor->next != NULL;
+}
+
+// Removes c from p now that nothing can see it (see reclaim_code())
+void erase_clause(Predicate p, Clause c)
+{
+   word term = c->source->data;
+   list_splice(&p->clauses, c->source);
+   remove_dynamic_clause(p, c);
+   defer_free(_free_asserted_term, (void*)term);
+}
+
+// Retracts c, which the cursor has just returned. Returns 0 if something else retracted it first
+int retract_clause(ClauseCursor cursor, Clause c)
+{
+   Predicate p = cursor->predicate;
+   LOCK_GLOBALS();
+   if (c->died != 0)
+   {
+      UNLOCK_GLOBALS();
+      return 0;
+   }
+   ATOMIC_STORE(&c->died, ++clause_generation);
+   for (Clause copy = c->copies; copy != NULL; copy = copy->copies)
+      ATOMIC_STORE(&copy->died, c->died);
+   // Calls made from now on skip c, but it stays in the code until no call made before now can be waiting to get to it
+   assert(c->code[0] == TRY_ME_OR_NEXT_CLAUSE);
+   ATOMIC_STORE(&c->code[0], NEXT_CLAUSE);
+   if (p->erased.head == NULL)
+      list_append(&erasing, (word)p);
+   list_append(&p->erased, (word)c);
+   erased_count++;
+   UNLOCK_GLOBALS();
+   return 1;
+}
+
+void close_clause_cursor(ClauseCursor cursor)
+{
+   Predicate p = cursor->predicate;
+   LOCK_GLOBALS();
+   if (--p->cursors == 0)
    {
-      // Retract the *first* value for clause that unifies
-      word deleted_term = list_delete_first(&p->clauses, DEREF(clause));
-      if (deleted_term != 0)
-         free((void*)deleted_term);
-      free_clauses(p->firstClause);
-      p->firstClause = compile_predicate(p);
+      if (p->erased.head != NULL)
+         want_reclaim();
+      free_dropped_indexes(p);
+      if (p->flags & PREDICATE_ABOLISHED)
+         retire_code(p, _free_abolished_predicate, _forall_predicate_clauses);
    }
+   UNLOCK_GLOBALS();
+   free_local((word)cursor->local);
+   free(cursor);
 }
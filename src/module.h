@@ -2,23 +2,62 @@
 #define _MODULE_H
 
 #include "types.h"
+#include "threads.h"
 typedef struct
 {
    List clauses;
    Clause firstClause;
+   Clause lastClause;        // The last clause in the chain which follows any switch clause, or NULL if there are none
    char* meta;
    int flags;
-
+   int* bound_calls;         // For each argument, the number of calls that had it bound but not the first argument. -1 if not worth indexing
+   uint32_t indexed_args;    // Bit i is set if argument i has a just-in-time index
+   int cursors;              // The number of clause/2 and retract/1 calls which are part way through the clauses (see open_clause_cursor())
+   List erased;              // Clauses which have been retracted but are still in the code, since something may still see them
+   List dropped_indexes;     // Argument indexes which were dropped while cursors was not 0, and are freed once it is
 } predicate;
 
 typedef predicate* Predicate;
 
+// Remembers which predicate a call site resolved to. The entry is only valid if generation is the same as predicate_generation,
+// which changes whenever a predicate or module is created or destroyed, and if the call is made from the same module.
+// Entries are never changed once they are made, since another thread may be reading them. Instead a new one replaces the old one
+struct call_cache
+{
+   word functor;
+   unsigned int generation;
+   Module module;
+   Predicate predicate;
+   Module context;
+};
+
+extern unsigned int predicate_generation;
+extern unsigned long clause_generation;
+
+typedef struct clause_cursor* ClauseCursor;
+typedef void (*ClauseVisitor)(Clause, void*);
+
+extern THREAD_LOCAL int reclaim_wanted;
+
+// Returns 1 if a call made at the given clause generation can see c. Another thread may be retracting c
+static inline int clause_visible(Clause c, unsigned long generation)
+{
+   unsigned long died = ATOMIC_LOAD(&c->died);
+   return c->born <= generation && (died == 0 || died > generation);
+}
+
 Predicate lookup_predicate(Module module, word functor);
 Module create_module(word name);
 void destroy_module(Module m);
 Module find_module(word name);
 void add_clause(Module module, word functor, word clause);
 void free_clause(Clause c);
+void _free_clauses(void* c);
+void retire_code(void* code, void (*free_fn)(void*), void (*forall_clauses)(void*, ClauseVisitor, void*));
+void reclaim_code();
+void forall_copies(Clause c, ClauseVisitor fn, void* data);
+void forall_chain_clauses(void* first, ClauseVisitor fn, void* data);
+void _forall_copies(void* c, ClauseVisitor fn, void* data);
 void initialize_modules();
 int define_foreign_predicate_c(Module module, word functor, int(*func)(), int flags);
 int set_meta(Module module, word functor, char* meta);
@@ -26,6 +65,11 @@ int set_dynamic(Module module, word functor);
 int asserta(Module, word);
 int assertz(Module, word);
 int abolish(Module, word);
-void retract(Module, word);
+ClauseCursor open_clause_cursor(Predicate p, word clause);
+Clause next_clause(ClauseCursor cursor);
+int has_next_clause(ClauseCursor cursor);
+int retract_clause(ClauseCursor cursor, Clause c);
+void erase_clause(Predicate p, Clause c);
+void close_clause_cursor(ClauseCursor cursor);
 
 #endif
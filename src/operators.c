@@ -4,13 +4,12 @@
 #include "kernel.h"
 #include "constants.h"
 
+/* The operator table is read without locking, since parsing and writing terms happen in every thread. op/3 changes it while holding
+   global_lock: a new cell is filled in before it is linked on, and a replaced operator is freed with defer_free(), so that a thread which
+   has just looked it up can finish using it
+*/
 op_cell_t* operator_table = NULL;
 
-void freeOperator(Operator op)
-{
-   free(op);
-}
-
 Operator allocOperator(word functor, int precedence, Fixity fixity)
 {
    Operator op = malloc(sizeof(operator_t));
@@ -38,24 +37,29 @@ void add_operator(char* name, int precedence, Fixity fixity)
       case YF:
          position = Postfix; arity = 3; break;
    }
+   LOCK_GLOBALS();
+   Operator op = allocOperator(acquire_constant("operator", MAKE_FUNCTOR(MAKE_ATOM(name), arity)), precedence, fixity);
    while(*cell != NULL)
    {
       if (strcmp(name, (*cell)->name) == 0)
       {
-         if ((*cell)->op[position] != NULL)
-            freeOperator((*cell)->op[position]);
-         (*cell)->op[position] = allocOperator(acquire_constant("operator", MAKE_FUNCTOR(MAKE_ATOM(name), arity)), precedence, fixity);
+         Operator old = ATOMIC_EXCHANGE(&(*cell)->op[position], op);
+         if (old != NULL)
+            defer_free(free_memory, old);
+         UNLOCK_GLOBALS();
          return;
       }
       cell = &((*cell)->next);
    }
-   *cell = malloc(sizeof(op_cell_t));
-   (*cell)->name = strdup(name);
-   (*cell)->next = NULL;
-   (*cell)->op[Prefix] = NULL;
-   (*cell)->op[Infix] = NULL;
-   (*cell)->op[Postfix] = NULL;
-   (*cell)->op[position] = allocOperator(acquire_constant("operator", MAKE_FUNCTOR(MAKE_ATOM(name), arity)), precedence, fixity);
+   op_cell_t* new_cell = malloc(sizeof(op_cell_t));
+   new_cell->name = strdup(name);
+   new_cell->next = NULL;
+   new_cell->op[Prefix] = NULL;
+   new_cell->op[Infix] = NULL;
+   new_cell->op[Postfix] = NULL;
+   new_cell->op[position] = op;
+   ATOMIC_STORE(cell, new_cell);
+   UNLOCK_GLOBALS();
 }
 
 void initialize_operators()
@@ -125,17 +129,15 @@ void initialize_operators()
 
 int find_operator(char* name, Operator* op, OperatorPosition position)
 {
-   if (operator_table == NULL)
-      initialize_operators();
-   op_cell_t* cell = operator_table;
+   op_cell_t* cell = ATOMIC_LOAD(&operator_table);
    while(cell != NULL)
    {
       if (strcmp(name, cell->name) == 0)
       {
-         *op = cell->op[position];
+         *op = ATOMIC_LOAD(&cell->op[position]);
          return (*op != NULL);
       }
-      cell = cell->next;
+      cell = ATOMIC_LOAD(&cell->next);
    }
    return 0;
 }
@@ -145,18 +147,18 @@ char* fixity_name[7] = {"FX", "FY", "XFX", "XFY", "YFX", "XF", "YF"};
 word make_op_list()
 {
    word result = emptyListAtom;
-   op_cell_t* cell = operator_table;
+   op_cell_t* cell = ATOMIC_LOAD(&operator_table);
    while(cell != NULL)
    {
       for (int i = 0; i <3; i++)
       {
-         Operator op = cell->op[i];
+         Operator op = ATOMIC_LOAD(&cell->op[i]);
          if (op != NULL)
          {
             result = MAKE_VCOMPOUND(listFunctor, MAKE_VCOMPOUND(opFunctor, MAKE_INTEGER(op->precedence), MAKE_ATOM(fixity_name[op->fixity]), MAKE_ATOM(cell->name)), result);
          }
       }
-      cell = cell->next;
+      cell = ATOMIC_LOAD(&cell->next);
    }
    return result;
 }
@@ -30,6 +30,7 @@ typedef enum
    Prefix, Infix, Postfix
 } OperatorPosition;
 
+void initialize_operators();
 int find_operator(char* name, Operator* op, OperatorPosition position);
 void add_operator(char* name, int precedence, Fixity fixity);
 word make_op_list();
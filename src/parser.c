@@ -128,7 +128,7 @@ int is_graphic_char(char c)
       c == '\\'; // graphic-token-char is either graphic-char or backslash-char
 }
 
-int lookahead = -1;
+THREAD_LOCAL int lookahead = -1;
 void unget_raw_char(int c)
 {
     lookahead = c;
@@ -574,8 +574,8 @@ Token lex(Stream s)
 }
 
 
-Token token_lookahead[3];
-int token_lookahead_index = 0;
+THREAD_LOCAL Token token_lookahead[3];
+THREAD_LOCAL int token_lookahead_index = 0;
 
 Token read_token(Stream s)
 {
@@ -5,6 +5,7 @@
 #include "ctable.h"
 #include "list.h"
 #include "errors.h"
+#include "gc.h"
 
 
 typedef struct
@@ -23,6 +24,8 @@ int set_char_conversion(word name, word value);
 int set_debug(word name, word value);
 int set_unknown(word name, word value);
 int set_double_quotes(word name, word value);
+int set_gc(word name, word value);
+int set_gc_threshold(word name, word value);
 
 map_t flags = NULL;
 
@@ -37,6 +40,8 @@ prolog_flag_t char_conversion_flag = {"char_conversion", set_char_conversion};
 prolog_flag_t debug_flag = {"debug", set_debug};
 prolog_flag_t unknown_flag = {"unknown", set_unknown};
 prolog_flag_t double_quotes_flag = {"double_quotes", set_double_quotes};
+prolog_flag_t gc_flag = {"gc", set_gc};
+prolog_flag_t gc_threshold_flag = {"gc_threshold", set_gc_threshold};
 
 
 
@@ -92,6 +97,34 @@ int set_double_quotes(word name, word value)
 }
 
 
+int set_gc(word name, word value)
+{
+   if (value == trueAtom)
+      gc_enabled = 1;
+   else if (value == falseAtom)
+      gc_enabled = 0;
+   else
+      return domain_error(flagValueAtom, MAKE_VCOMPOUND(addFunctor, name, value));
+   gc_flag.value = value;
+   return 1;
+}
+
+// gc_threshold is the percentage of the heap that can be used before we try to collect garbage
+int set_gc_threshold(word name, word value)
+{
+   int type = -1;
+   cdata c;
+   if (TAGOF(value) == CONSTANT_TAG)
+      c = getConstant(value, &type);
+   if (type != INTEGER_TYPE || c.integer_data < 1 || c.integer_data > 99)
+      return domain_error(flagValueAtom, MAKE_VCOMPOUND(addFunctor, name, value));
+   release_constant("gc_threshold flag", gc_threshold_flag.value);
+   gc_threshold_flag.value = acquire_constant("gc_threshold flag", value);
+   gc_threshold = c.integer_data;
+   set_heap_limit();
+   return 1;
+}
+
 
 word get_prolog_flag(char* name)
 {
@@ -128,6 +161,10 @@ void initialize_prolog_flags()
    hashmap_put(flags, "unknown", &unknown_flag);
    double_quotes_flag.value = codesAtom;
    hashmap_put(flags, "double_quotes", &double_quotes_flag);
+   gc_flag.value = trueAtom;
+   hashmap_put(flags, "gc", &gc_flag);
+   gc_threshold_flag.value = acquire_constant("gc_threshold flag", MAKE_INTEGER(gc_threshold));
+   hashmap_put(flags, "gc_threshold", &gc_threshold_flag);
 }
 
 int build_prolog_flag_key_list(void* list, char* name, void* value)
@@ -8,114 +8,398 @@
 #include "kernel.h"
 #include "compiler.h"
 #include "local.h"
+#include "threads.h"
 #include <assert.h>
 #include <stdio.h>
 
-wmap_t database;
+/* The records for each key are kept in a doubly-linked list, so that recorda/3 and recordz/3 can add one to either end and erase/1 can
+   unlink one without looking for it. A database reference is a pointer holding the serial number of the record rather than its address,
+   so a reference to an erased record is just not found in the table of records instead of pointing at freed memory.
+   recorded/3 walks the records with a cursor, which is kept in the foreign choicepoint. Like clause/2 (see open_clause_cursor()) it
+   only sees the records which were there when it was opened, and an erased record stays linked in until every cursor on its key has
+   been closed, so that the cursors can carry on past it. Once a key has RECORD_INDEX_MIN records and recorded/3 is called with the first
+   argument of the term bound, the records are also hashed on their first argument: each record with a constant or compound there is
+   linked into a chain for that key, and all the others into the unkeyed chain. A cursor then merges the chain for its key with the
+   unkeyed chain, using the order of the records to keep them in sequence.
+*/
+
+#define RECORD_INDEX_MIN 8
 
-struct record_t
+struct record_chain
+{
+   Record first;
+   Record last;
+};
+
+struct record_key
 {
-   List* list;
-   struct cell_t* cell;
-   word* local;
    word key;
+   Record first;
+   Record last;
+   long first_order;        // The order of the first and last records. recorda/3 goes before the first, and recordz/3 after the last
+   long last_order;
+   int count;
+   int cursors;             // The number of recorded/3 calls which are part way through the records
+   Record erased;           // Records erased while cursors was not 0, linked through next_erased
+   wmap_t index;            // The chain for each first-argument key, or NULL if the records are not hashed
+   struct record_chain unkeyed;
 };
 
+struct record
+{
+   struct record_key* owner;
+   Record next;
+   Record prev;
+   Record next_same;        // The next and previous records in the same chain of the index
+   Record prev_same;
+   Record next_erased;
+   word* local;
+   word term;
+   word ref;
+   long order;
+   unsigned long born;      // The record generation when the record was added, and when it was erased (0 if it has not been)
+   unsigned long died;
+};
+
+struct record_cursor
+{
+   struct record_key* owner;
+   unsigned long generation;
+   word* local;             // A local copy of the term which the records must unify with
+   word pattern;
+   Record keyed;            // The next record to look at in the main list, or in the chain for the key if the records are hashed
+   Record unkeyed;          // The next record to look at in the unkeyed chain, if the records are hashed
+   int indexed;
+   Record next;             // The next record which unifies, or NULL if there are no more
+};
+
+wmap_t database;
+wmap_t records;             // The record for the serial number of each database reference, until it is erased
+unsigned long record_generation = 0;
+uintptr_t record_serial = 0;
 
 void initialize_database()
 {
    database = whashmap_new();
+   records = whashmap_new();
 }
 
+// Returns the key that a term is hashed on, or 0 if it has none
+word record_index_key(word term)
+{
+   if (TAGOF(term) != COMPOUND_TAG)
+      return 0;
+   word arg = DEREF(ARGOF(term, 0));
+   if (TAGOF(arg) == CONSTANT_TAG)
+      return arg;
+   if (TAGOF(arg) == COMPOUND_TAG)
+      return FUNCTOROF(arg);
+   return 0;
+}
 
+struct record_chain* find_chain(struct record_key* owner, word index_key, int create)
+{
+   struct record_chain* chain;
+   if (index_key == 0)
+      return &owner->unkeyed;
+   if (whashmap_get(owner->index, index_key, (any_t)&chain) == MAP_OK)
+      return chain;
+   if (!create)
+      return NULL;
+   chain = malloc(sizeof(struct record_chain));
+   chain->first = NULL;
+   chain->last = NULL;
+   whashmap_put(owner->index, index_key, chain);
+   return chain;
+}
 
-word make_dbref(word t, word** local, word** slot)
+void link_into_index(struct record_key* owner, Record record, int at_end)
 {
-   word w = copy_local_with_extra_space(t, local, 3, 1);
-   // Write the functor
-   (*local)[0] = dbCellFunctor;
-   (*local)[1] = w;
-   // Make slot a variable for now so that the term isnt temporary garbage
-   (*local)[2] = (word)&((*local)[2]);
-   // Pass it out so we can fill it in later
-   *slot = &((*local)[2]);
-   return (word)(*local) | COMPOUND_TAG;
+   struct record_chain* chain = find_chain(owner, record_index_key(record->term), 1);
+   if (chain->first == NULL)
+   {
+      record->next_same = NULL;
+      record->prev_same = NULL;
+      chain->first = record;
+      chain->last = record;
+   }
+   else if (at_end)
+   {
+      record->next_same = NULL;
+      record->prev_same = chain->last;
+      chain->last->next_same = record;
+      chain->last = record;
+   }
+   else
+   {
+      record->next_same = chain->first;
+      record->prev_same = NULL;
+      chain->first->prev_same = record;
+      chain->first = record;
+   }
+}
+
+void unlink_from_index(struct record_key* owner, Record record)
+{
+   struct record_chain* chain = find_chain(owner, record_index_key(record->term), 0);
+   if (record->prev_same == NULL)
+      chain->first = record->next_same;
+   else
+      record->prev_same->next_same = record->next_same;
+   if (record->next_same == NULL)
+      chain->last = record->prev_same;
+   else
+      record->next_same->prev_same = record->prev_same;
 }
 
-word intern_record(List* list, word key, struct cell_t* cell, word* ptr)
+void build_record_index(struct record_key* owner)
 {
-   struct record_t* record = malloc(sizeof(struct record_t));
-   record->list = list;
-   record->cell = cell;
-   record->local = ptr;
-   record->key = key;
-   return MAKE_POINTER(record);
+   owner->index = whashmap_new();
+   owner->unkeyed.first = NULL;
+   owner->unkeyed.last = NULL;
+   for (Record record = owner->first; record != NULL; record = record->next)
+      link_into_index(owner, record, 1);
 }
 
-word recorda(word key, word term)
+word add_record(word key, word term, int at_end)
 {
-   List* list;
-   struct cell_t* cell;
-   word* ptr;
-   word* slot;
-   if (whashmap_get(database, key, (any_t)&list) == MAP_OK)
+   struct record_key* owner;
+   Record record = malloc(sizeof(struct record));
+   // Allocate a word of extra space so that the copy is always in allocated memory, even if term is atomic or a variable
+   record->term = copy_local_with_extra_space(term, &record->local, 1, 1);
+   LOCK_GLOBALS();
+   if (whashmap_get(database, key, (any_t)&owner) != MAP_OK)
    {
-      word cx = make_dbref(term, &ptr, &slot);
-      cell = list_unshift(list, cx);
+      owner = malloc(sizeof(struct record_key));
+      owner->key = acquire_constant("record key", key);
+      owner->first = NULL;
+      owner->last = NULL;
+      owner->first_order = 0;
+      owner->last_order = 0;
+      owner->count = 0;
+      owner->cursors = 0;
+      owner->erased = NULL;
+      owner->index = NULL;
+      whashmap_put(database, key, owner);
+   }
+   record->owner = owner;
+   record->born = ++record_generation;
+   record->died = 0;
+   record->ref = MAKE_POINTER((void*)(++record_serial << 2));
+   whashmap_put(records, record->ref, record);
+   if (owner->first == NULL)
+   {
+      record->next = NULL;
+      record->prev = NULL;
+      record->order = 0;
+      owner->first_order = 0;
+      owner->last_order = 0;
+      owner->first = record;
+      owner->last = record;
+   }
+   else if (at_end)
+   {
+      record->next = NULL;
+      record->prev = owner->last;
+      record->order = ++owner->last_order;
+      owner->last->next = record;
+      owner->last = record;
    }
    else
    {
-      list = malloc(sizeof(List));
-      init_list(list);
-      whashmap_put(database, key, list);
-      cell = list_unshift(list, make_dbref(term, &ptr, &slot));
+      record->next = owner->first;
+      record->prev = NULL;
+      record->order = --owner->first_order;
+      owner->first->prev = record;
+      owner->first = record;
    }
-   *slot = intern_record(list, key, cell, ptr);
-   return *slot;
+   owner->count++;
+   if (owner->index != NULL)
+      link_into_index(owner, record, at_end);
+   word ref = record->ref;
+   UNLOCK_GLOBALS();
+   return ref;
+}
+
+word recorda(word key, word term)
+{
+   return add_record(key, term, 0);
 }
+
 word recordz(word key, word term)
 {
-   List* list;
-   struct cell_t* cell;
-   word* ptr;
-   word* slot;
-   if (whashmap_get(database, key, (any_t)&list) == MAP_OK)
-      cell = list_append(list, make_dbref(term, &ptr, &slot));
+   return add_record(key, term, 1);
+}
+
+void free_record(void* data)
+{
+   Record record = (Record)data;
+   forall_term_constants(record->term, "recorded constant", release_constant);
+   free(record->local);
+   free(record);
+}
+
+// Unlinks an erased record now that no cursor can be walking past it
+void unlink_record(Record record)
+{
+   struct record_key* owner = record->owner;
+   if (record->prev == NULL)
+      owner->first = record->next;
    else
-   {
-      list = malloc(sizeof(List));
-      init_list(list);
-      whashmap_put(database, key, list);
-      cell = list_append(list, make_dbref(term, &ptr, &slot));
-   }
-   *slot = intern_record(list, key, cell, ptr);
-   return *slot;
+      record->prev->next = record->next;
+   if (record->next == NULL)
+      owner->last = record->prev;
+   else
+      record->next->prev = record->prev;
+   if (owner->index != NULL)
+      unlink_from_index(owner, record);
+   // Another thread may be copying the term
+   defer_free(free_record, record);
 }
 
 int _erase(word ref)
 {
-   struct record_t* record = (struct record_t*)GET_POINTER(ref);
-   list_splice(record->list, record->cell);
-   if (record->local != NULL)
+   Record record;
+   LOCK_GLOBALS();
+   if (whashmap_get(records, ref, (any_t)&record) != MAP_OK)
    {
-      free(record->local);
+      // It has already been erased
+      UNLOCK_GLOBALS();
+      return FAIL;
    }
-   free(record);
+   whashmap_remove(records, ref);
+   record->died = ++record_generation;
+   record->owner->count--;
+   if (record->owner->cursors == 0)
+      unlink_record(record);
+   else
+   {
+      record->next_erased = record->owner->erased;
+      record->owner->erased = record;
+   }
+   UNLOCK_GLOBALS();
    return SUCCESS;
 }
 
+// Copies the key and term of the record that ref refers to onto the heap. Returns 0 if it has been erased
 int recorded(word ref, word* key, word* value)
 {
-   struct record_t* record = (struct record_t*)GET_POINTER(ref);
-   *key = record->key;
-   *value = record->cell->data;
+   Record record;
+   LOCK_GLOBALS();
+   if (whashmap_get(records, ref, (any_t)&record) != MAP_OK)
+   {
+      UNLOCK_GLOBALS();
+      return 0;
+   }
+   *key = record->owner->key;
+   *value = copy_term(record->term);
+   UNLOCK_GLOBALS();
    return 1;
 }
 
-List* find_records(word key)
+// Returns the first record from the given one onwards that the cursor should return, or NULL if there are none. If the records are hashed
+// this merges the chain for the key of the cursor with the unkeyed chain, and the next records to look at in both are left in the cursor
+static Record next_match(RecordCursor cursor, Record record)
+{
+   while (1)
+   {
+      if (cursor->indexed)
+      {
+         if (cursor->keyed != NULL && (cursor->unkeyed == NULL || cursor->keyed->order < cursor->unkeyed->order))
+         {
+            record = cursor->keyed;
+            cursor->keyed = record->next_same;
+         }
+         else if (cursor->unkeyed != NULL)
+         {
+            record = cursor->unkeyed;
+            cursor->unkeyed = record->next_same;
+         }
+         else
+            return NULL;
+      }
+      else if (record == NULL)
+         return NULL;
+      if (record->born <= cursor->generation && record->died == 0 && unifiable(record->term, cursor->pattern))
+         return record;
+      if (!cursor->indexed)
+         record = record->next;
+   }
+}
+
+// Opens a cursor on the records for key which unify with term, or returns NULL if there are none. It must be closed once it is no
+// longer needed, since until then no record for key can be unlinked
+RecordCursor open_record_cursor(word key, word term)
 {
-   List* list;
-   if (whashmap_get(database, key, (any_t)&list) == MAP_OK)
-      return list;
-   return NULL;
+   struct record_key* owner;
+   LOCK_GLOBALS();
+   if (whashmap_get(database, key, (any_t)&owner) != MAP_OK || owner->first == NULL)
+   {
+      UNLOCK_GLOBALS();
+      return NULL;
+   }
+   RecordCursor cursor = malloc(sizeof(struct record_cursor));
+   owner->cursors++;
+   cursor->owner = owner;
+   cursor->generation = record_generation;
+   cursor->pattern = copy_local_with_extra_space(term, &cursor->local, 1, 1);
+   word index_key = record_index_key(cursor->pattern);
+   cursor->indexed = 0;
+   if (index_key != 0 && owner->index == NULL && owner->count >= RECORD_INDEX_MIN)
+      build_record_index(owner);
+   if (index_key != 0 && owner->index != NULL)
+   {
+      struct record_chain* chain = find_chain(owner, index_key, 0);
+      cursor->indexed = 1;
+      cursor->keyed = (chain == NULL)?NULL:chain->first;
+      cursor->unkeyed = owner->unkeyed.first;
+   }
+   cursor->next = next_match(cursor, owner->first);
+   UNLOCK_GLOBALS();
+   return cursor;
+}
+
+// Returns the next record, or NULL if there are no more. Its term stays valid until the cursor is closed
+Record next_record(RecordCursor cursor)
+{
+   LOCK_GLOBALS();
+   Record record = cursor->next;
+   if (record != NULL)
+      cursor->next = next_match(cursor, record->next);
+   UNLOCK_GLOBALS();
+   return record;
+}
+
+int has_next_record(RecordCursor cursor)
+{
+   return cursor->next != NULL;
+}
+
+word record_term(Record record)
+{
+   return record->term;
+}
+
+word record_ref(Record record)
+{
+   return record->ref;
+}
+
+void close_record_cursor(RecordCursor cursor)
+{
+   struct record_key* owner = cursor->owner;
+   LOCK_GLOBALS();
+   if (--owner->cursors == 0)
+   {
+      while (owner->erased != NULL)
+      {
+         Record record = owner->erased;
+         owner->erased = record->next_erased;
+         unlink_record(record);
+      }
+   }
+   UNLOCK_GLOBALS();
+   forall_term_constants(cursor->pattern, "constant in local copy", release_constant);
+   free(cursor->local);
+   free(cursor);
 }
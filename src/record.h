@@ -1,7 +1,20 @@
+#ifndef _RECORD_H
+#define _RECORD_H
 #include "types.h"
+
+typedef struct record* Record;
+typedef struct record_cursor* RecordCursor;
+
 word recorda(word key, word term);
 word recordz(word key, word term);
 int _erase(word ref);
 void initialize_database();
 int recorded(word ref, word* key, word* value);
-List* find_records(word);
+RecordCursor open_record_cursor(word key, word term);
+Record next_record(RecordCursor cursor);
+int has_next_record(RecordCursor cursor);
+word record_term(Record record);
+word record_ref(Record record);
+void close_record_cursor(RecordCursor cursor);
+
+#endif
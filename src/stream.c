@@ -240,7 +240,7 @@ Stream allocStream(int(*read)(struct stream*, int, unsigned char*),
    s->data = data;
    s->buffer_ptr = 0;
    s->filled_buffer_size = 0;
-   s->id = id++;
+   s->id = ATOMIC_ADD(&id, 1) - 1;
    s->term = MAKE_BLOB("stream", s);
    s->flags = 0;
    return s;
@@ -18,12 +18,14 @@
 #endif
 
 State qxz = NULL;
+int tests_failed = 0;        // Set if anything went wrong, so that do_test() can say so
 
 void query_complete3(RC result)
 {
    if (result == ERROR)
    {
       printf("Error reached the top-level: "); PRETTY_PORTRAY(getException()); printf("\n");
+      tests_failed = 1;
    }
    else if (result == FAIL)
    {
@@ -50,10 +52,12 @@ void query_complete(RC result)
    if (result == ERROR)
    {
       printf("Error reached the top-level: "); PRETTY_PORTRAY(getException()); printf("\n");
+      tests_failed = 1;
    }
    else if (result == FAIL)
    {
       printf("Top level Failed\n");
+      tests_failed = 1;
    }
    else if (result == SUCCESS_WITH_CHOICES)
    {
@@ -72,13 +76,97 @@ void do_nothing(RC result)
 {
 }
 
+RC last_result;
+void save_result(RC result)
+{
+   last_result = result;
+}
+
+// Runs a query in each of two engines, and checks that backtracking into one does not disturb the other
+#ifdef HAVE_THREADS
+int most_deferred;
+void count_thread_result(RC result, word goal, void* data)
+{
+   // thread_work(N, R) counts up to 100 in R
+   if ((result == SUCCESS || result == SUCCESS_WITH_CHOICES) && DEREF(ARGOF(goal, 1)) == MAKE_INTEGER(100))
+      ATOMIC_ADD((int*)data, 1);
+   // It also erases 100 records. They should be freed while the other threads carry on, not only once the pool is idle
+   LOCK_GLOBALS();
+   if (deferred_free_count() > most_deferred)
+      most_deferred = deferred_free_count();
+   UNLOCK_GLOBALS();
+}
+
+// Runs the same set of goals in pools of different sizes, and checks that they all succeed
+int test_threads()
+{
+   int ok = 1;
+   int tasks = 64;
+   int sizes[] = {1, 2, 4, 8};
+   for (int i = 0; i < 4; i++)
+   {
+      int succeeded = 0;
+      most_deferred = 0;
+      struct timespec t0, t1;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      ThreadPool pool = create_thread_pool(sizes[i]);
+      for (int j = 0; j < tasks; j++)
+         thread_pool_submit(pool, MAKE_VCOMPOUND(MAKE_FUNCTOR(MAKE_ATOM("thread_work"), 2), MAKE_INTEGER(j), MAKE_VAR()), count_thread_result, &succeeded);
+      thread_pool_wait(pool);
+      destroy_thread_pool(pool);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+      printf("%d threads: %d of %d goals succeeded in %ld milliseconds, with at most %d frees deferred\n", sizes[i], succeeded, tasks, ms, most_deferred);
+      ok &= (succeeded == tasks);
+      ok &= (most_deferred < tasks * 50);
+   }
+   return ok;
+}
+#endif
+
+int test_engines()
+{
+   int ok = 1;
+   word x = MAKE_VAR();
+   register_root(&x);
+   execute_query(MAKE_VCOMPOUND(MAKE_FUNCTOR(MAKE_ATOM("first_engine_goal"), 1), x), save_result);
+   ok &= (last_result == SUCCESS_WITH_CHOICES && DEREF(x) == MAKE_INTEGER(1));
+
+   Engine first = get_current_engine();
+   Engine second = create_engine();
+   activate_engine(second);
+   word y = MAKE_VAR();
+   register_root(&y);
+   execute_query(MAKE_VCOMPOUND(MAKE_FUNCTOR(MAKE_ATOM("second_engine_goal"), 1), y), save_result);
+   ok &= (last_result == SUCCESS_WITH_CHOICES && DEREF(y) == MAKE_ATOM("a"));
+
+   activate_engine(first);
+   backtrack_query(save_result);
+   ok &= (last_result == SUCCESS_WITH_CHOICES && DEREF(x) == MAKE_INTEGER(2));
+
+   activate_engine(second);
+   backtrack_query(save_result);
+   ok &= (last_result != FAIL && last_result != ERROR && DEREF(y) == MAKE_ATOM("b"));
+   unregister_root(&y);
+
+   activate_engine(first);
+   destroy_engine(second);
+   backtrack_query(save_result);
+   ok &= (last_result != FAIL && last_result != ERROR && DEREF(x) == MAKE_INTEGER(3));
+   unregister_root(&x);
+   return ok;
+}
+
 
+// Returns 0 if the tests passed, and 1 if they did not
 EMSCRIPTEN_KEEPALIVE
-void do_test(int argc, char** argv)
+int do_test(int argc, char** argv)
 {
    int do_inria = 0;
    int do_yield = 0;
    int do_agc = 0;
+   int do_engines = 0;
+   int do_threads = 0;
    int explicit_test = 0;
    for (int i = 1; i < argc; i++)
    {
@@ -88,13 +176,20 @@ void do_test(int argc, char** argv)
          do_yield = 1;
       else if (strcmp(argv[i], "--agc") == 0)
          do_agc = 1;
+      else if (strcmp(argv[i], "--engines") == 0)
+         do_engines = 1;
+      else if (strcmp(argv[i], "--threads") == 0)
+         do_threads = 1;
       else
       {
          printf("Consulting %s\n", argv[i]);
          if (consult_file(argv[i]))
             printf("Consulted %s\n", argv[i]);
          else
+         {
             printf("Failed to load %s\n", argv[i]);
+            tests_failed = 1;
+         }
          explicit_test = 1;
       }
    }
@@ -107,6 +202,14 @@ void do_test(int argc, char** argv)
    {
       consult_file("tests/agc.pl");
    }
+   else if (do_engines)
+   {
+      consult_file("tests/engines.pl");
+   }
+   else if (do_threads)
+   {
+      consult_file("tests/threads.pl");
+   }
    else if (!explicit_test)
    {
       if (consult_file("test.pl"))
@@ -118,6 +221,7 @@ void do_test(int argc, char** argv)
    if (do_yield)
    {
       word ptr1 = MAKE_VAR();
+      register_root(&ptr1);
       word goal1 = MAKE_VCOMPOUND(MAKE_FUNCTOR(MAKE_ATOM("yield_test"), 2), MAKE_ATOM("first_goal"), ptr1);
       execute_query(goal1, query_complete);
       printf("execute_query has returned\n");
@@ -128,6 +232,7 @@ void do_test(int argc, char** argv)
       State saved = push_state();
 
       word ptr2 = MAKE_VAR();
+      register_root(&ptr2);
       word goal2 = MAKE_VCOMPOUND(MAKE_FUNCTOR(MAKE_ATOM("yield_test"), 2), MAKE_ATOM("second_goal"), ptr2);
       execute_query(goal2, query_complete);
       printf("execute_query has returned\n");
@@ -138,6 +243,30 @@ void do_test(int argc, char** argv)
       restore_state(saved);
 
       resume_yield(SUCCESS, cb1);
+      unregister_root(&ptr2);
+      unregister_root(&ptr1);
+   }
+#ifdef HAVE_THREADS
+   else if (do_threads)
+   {
+      if (test_threads())
+         printf("Success!\n");
+      else
+      {
+         printf("Thread test failed\n");
+         tests_failed = 1;
+      }
+   }
+#endif
+   else if (do_engines)
+   {
+      if (test_engines())
+         printf("Success!\n");
+      else
+      {
+         printf("Engine test failed\n");
+         tests_failed = 1;
+      }
    }
    else if (do_agc)
    {
@@ -169,5 +298,6 @@ void do_test(int argc, char** argv)
       printf("Atoms after AGC: %d\n", get_constant_count());
       printf("Initial atoms: %d\n", initial_atoms);
    }
+   return tests_failed;
 }
 
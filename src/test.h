@@ -1 +1 @@
-void do_test(int argc, char** argv);
+int do_test(int argc, char** argv);
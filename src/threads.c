@@ -0,0 +1,302 @@
+#include "global.h"
+#include "kernel.h"
+#include "threads.h"
+#include "local.h"
+#include "list.h"
+#include "errors.h"
+#include "module.h"
+#include <stdio.h>
+#include <assert.h>
+
+// This is just free(), but as a function so that it can be passed to defer_free() even when free() is a macro (see global.h)
+void free_memory(void* ptr)
+{
+   free(ptr);
+}
+
+/* Some shared things, such as a call-site cache entry which has just been replaced, or a record which has just been erased, may still be
+   being read by another thread which is running Prolog. These are passed to defer_free() rather than being freed straight away. Every
+   thread counts as running from when it enters execute() until it returns from it (a pool thread counts for the whole of each task, see
+   pool_thread()), whichever engine it is using. Nothing passed to defer_free() is held on to across a safe point in execute(), so once
+   every running thread has passed one since something was deferred, none of them can still be reading it. To tell when that is, each
+   deferral advances free_epoch, and each running thread notes the value it has seen at every safe point (see pass_safe_point()). Threads
+   which are not running do not count, and if no other thread is running at all then defer_free() frees things straight away
+*/
+
+// The number of threads which are running. Only changed while holding global_lock
+int running_threads = 0;
+
+// How many times begin_running() has been called in this thread without a matching end_running()
+THREAD_LOCAL int running_depth = 0;
+
+// The threads which are running. Only changed while holding global_lock
+struct running_thread* running_list = NULL;
+THREAD_LOCAL struct running_thread this_thread;
+
+// Advanced by every defer_free() which cannot free its argument straight away
+unsigned long free_epoch = 0;
+
+struct deferred_free
+{
+   void (*fn)(void*);
+   void* ptr;
+   unsigned long epoch;
+};
+List deferred_frees = {NULL, NULL, 0};
+
+// Frees whatever every running thread has passed a safe point since. Must be called while holding global_lock
+void run_deferred_frees()
+{
+   unsigned long seen = ATOMIC_LOAD(&free_epoch);
+   for (struct running_thread* t = running_list; t != NULL; t = t->next)
+   {
+      unsigned long epoch = ATOMIC_LOAD(&t->epoch);
+      if (epoch < seen)
+         seen = epoch;
+   }
+   // Things are deferred in order of epoch, so we can stop at the first one which is still too new
+   while (deferred_frees.head != NULL && ((struct deferred_free*)deferred_frees.head->data)->epoch <= seen)
+   {
+      struct deferred_free* d = (struct deferred_free*)list_shift(&deferred_frees);
+      d->fn(d->ptr);
+      free(d);
+   }
+}
+
+// Called by SAFE_POINT() in execute() once something has been deferred since this thread last passed one
+void pass_safe_point()
+{
+   LOCK_GLOBALS();
+   ATOMIC_STORE(&this_thread.epoch, ATOMIC_LOAD(&free_epoch));
+   run_deferred_frees();
+   UNLOCK_GLOBALS();
+}
+
+// Returns how many things are waiting to be freed. Must be called while holding global_lock
+int deferred_free_count()
+{
+   return list_length(&deferred_frees);
+}
+
+// Returns the number of threads, other than this one, which are running
+int threads_running()
+{
+   return ATOMIC_LOAD(&running_threads) - (running_depth > 0);
+}
+
+// Called around each call to execute(). Calls may be nested, and may be for different engines
+void begin_running()
+{
+   if (running_depth++ == 0)
+   {
+      LOCK_GLOBALS();
+      running_threads++;
+      // Anything deferred before now cannot be reached from this thread
+      this_thread.epoch = free_epoch;
+      this_thread.prev = NULL;
+      this_thread.next = running_list;
+      if (running_list != NULL)
+         running_list->prev = &this_thread;
+      running_list = &this_thread;
+      UNLOCK_GLOBALS();
+   }
+}
+
+void end_running()
+{
+   if (--running_depth == 0)
+   {
+      LOCK_GLOBALS();
+      if (this_thread.prev == NULL)
+         running_list = this_thread.next;
+      else
+         this_thread.prev->next = this_thread.next;
+      if (this_thread.next != NULL)
+         this_thread.next->prev = this_thread.prev;
+      run_deferred_frees();
+      if (--running_threads == 0)
+         reclaim_code();
+      UNLOCK_GLOBALS();
+   }
+}
+
+// Calls fn(ptr) now if no other thread is running, and otherwise once every thread which is running has passed a safe point
+void defer_free(void (*fn)(void*), void* ptr)
+{
+   LOCK_GLOBALS();
+   if (threads_running() == 0)
+      fn(ptr);
+   else
+   {
+      struct deferred_free* d = malloc(sizeof(struct deferred_free));
+      d->fn = fn;
+      d->ptr = ptr;
+      d->epoch = ATOMIC_ADD(&free_epoch, 1);
+      list_append(&deferred_frees, (word)d);
+   }
+   UNLOCK_GLOBALS();
+}
+
+#ifdef HAVE_THREADS
+
+/* A thread pool runs queries on a fixed number of threads, each of which has its own engine. Goals are copied when they are
+   submitted, and copied again onto the heap of whichever engine runs them, so the submitting thread can carry on (or backtrack)
+   as it likes. Once the goal has finished, done() is called on the pool thread with the result and the goal, so it can inspect the
+   bindings, and then the engine is reset for the next task.
+*/
+
+pthread_mutex_t global_lock;
+
+struct task
+{
+   word goal;
+   word* local;
+   void (*done)(RC, word, void*);
+   void* data;
+};
+
+struct thread_pool
+{
+   pthread_t* threads;
+   int thread_count;
+   List tasks;
+   int pending;          // Tasks which have been submitted but not finished
+   int shutdown;
+   pthread_mutex_t lock;
+   pthread_cond_t task_ready;
+   pthread_cond_t all_done;
+   Stream input;
+   Stream output;
+};
+
+void initialize_threads()
+{
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&global_lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+}
+
+void run_task(struct task* task)
+{
+   word goal = copy_term(task->goal);
+   register_root(&goal);
+   RC rc = execute_query_sync(goal);
+   if (task->done != NULL)
+      task->done(rc, goal, task->data);
+   unregister_root(&goal);
+   reset_engine();
+   if (TAGOF(task->goal) == CONSTANT_TAG)
+      release_constant("thread pool goal", task->goal);
+   else
+      free_local((word)task->local);
+}
+
+void* pool_thread(void* data)
+{
+   ThreadPool pool = (ThreadPool)data;
+   Engine engine = create_engine();
+   set_engine_streams(pool->input, pool->output);
+   // Keep the engine inactive while we are idle, so that its registers are in its struct engine where AGC can see them
+   activate_engine(NULL);
+   pthread_mutex_lock(&pool->lock);
+   while (1)
+   {
+      while (pool->tasks.head == NULL && !pool->shutdown)
+         pthread_cond_wait(&pool->task_ready, &pool->lock);
+      if (pool->tasks.head == NULL)
+         break;
+      struct task* task = (struct task*)list_shift(&pool->tasks);
+      pthread_mutex_unlock(&pool->lock);
+
+      // The engine counts as running while the goal is copied onto its heap and while done() looks at it, not just in execute(),
+      // since atom garbage collection can only look at the heaps of engines which are not running
+      begin_running();
+      activate_engine(engine);
+      run_task(task);
+      activate_engine(NULL);
+      free(task);
+      end_running();
+
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0)
+         pthread_cond_broadcast(&pool->all_done);
+   }
+   pthread_mutex_unlock(&pool->lock);
+   destroy_engine(engine);
+   return NULL;
+}
+
+// Starts thread_count threads, each with their own engine. They share the current streams of the calling thread
+ThreadPool create_thread_pool(int thread_count)
+{
+   ThreadPool pool = malloc(sizeof(struct thread_pool));
+   pool->threads = malloc(sizeof(pthread_t) * thread_count);
+   pool->thread_count = thread_count;
+   init_list(&pool->tasks);
+   pool->pending = 0;
+   pool->shutdown = 0;
+   pool->input = current_input;
+   pool->output = current_output;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->task_ready, NULL);
+   pthread_cond_init(&pool->all_done, NULL);
+   for (int i = 0; i < thread_count; i++)
+   {
+      if (pthread_create(&pool->threads[i], NULL, pool_thread, pool) != 0)
+         fatal("Unable to start thread");
+   }
+   return pool;
+}
+
+// Queues goal to be run by one of the threads in the pool. done (which may be NULL) is called from that thread when it has finished
+int thread_pool_submit(ThreadPool pool, word goal, void (*done)(RC, word, void*), void* data)
+{
+   goal = DEREF(goal);
+   if (TAGOF(goal) == VARIABLE_TAG)
+      return instantiation_error();
+   struct task* task = malloc(sizeof(struct task));
+   task->goal = copy_local(goal, &task->local);
+   task->done = done;
+   task->data = data;
+   pthread_mutex_lock(&pool->lock);
+   list_append(&pool->tasks, (word)task);
+   pool->pending++;
+   pthread_cond_signal(&pool->task_ready);
+   pthread_mutex_unlock(&pool->lock);
+   return 1;
+}
+
+// Waits until every task submitted so far has finished
+void thread_pool_wait(ThreadPool pool)
+{
+   pthread_mutex_lock(&pool->lock);
+   while (pool->pending > 0)
+      pthread_cond_wait(&pool->all_done, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+// Finishes any outstanding tasks, then stops the threads and frees their engines
+void destroy_thread_pool(ThreadPool pool)
+{
+   pthread_mutex_lock(&pool->lock);
+   pool->shutdown = 1;
+   pthread_cond_broadcast(&pool->task_ready);
+   pthread_mutex_unlock(&pool->lock);
+   for (int i = 0; i < pool->thread_count; i++)
+      pthread_join(pool->threads[i], NULL);
+   pthread_mutex_destroy(&pool->lock);
+   pthread_cond_destroy(&pool->task_ready);
+   pthread_cond_destroy(&pool->all_done);
+   free(pool->threads);
+   free(pool);
+}
+
+#else
+
+void initialize_threads()
+{
+}
+
+#endif
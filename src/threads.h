@@ -0,0 +1,60 @@
+#ifndef _THREADS_H
+#define _THREADS_H
+
+/* Threads are available everywhere except Emscripten. Each thread that runs Prolog has its own engine (see kernel.c), whose registers
+   are thread-local. Everything shared between threads is protected as follows:
+      * The constant table is read without locking, since constants never move once they are created. Interning takes a lock for
+        the type of constant being interned (see ctable.c)
+      * Modules, predicates and their clauses, records, flags and the list of engines are protected by global_lock. It is recursive,
+        since for example assert/1 compiles the predicate while holding it. Only looking things up and changing them needs the lock:
+        running code does not, since a compiled clause chain is never modified once it is visible to other threads. Instead a new one
+        is built and swapped in, and the old one is retired until nothing can be running it (see retire_code). Smaller things, such
+        as call-site cache entries and erased records, are freed once every thread running Prolog has passed a safe point (see
+        defer_free). The main thread counts as well as pool threads, whichever engine it is running
+*/
+
+#ifndef EMSCRIPTEN
+#define HAVE_THREADS
+#endif
+
+#ifdef HAVE_THREADS
+#include <pthread.h>
+#define THREAD_LOCAL __thread
+extern pthread_mutex_t global_lock;
+#define LOCK_GLOBALS() pthread_mutex_lock(&global_lock)
+#define UNLOCK_GLOBALS() pthread_mutex_unlock(&global_lock)
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL)
+#define ATOMIC_EXCHANGE(p, v) __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL)
+#else
+#define THREAD_LOCAL
+#define LOCK_GLOBALS() (void)0
+#define UNLOCK_GLOBALS() (void)0
+#define ATOMIC_LOAD(p) (*(p))
+#define ATOMIC_STORE(p, v) (*(p) = (v))
+#define ATOMIC_ADD(p, v) (*(p) += (v))
+#define ATOMIC_EXCHANGE(p, v) __atomic_exchange_n(p, v, __ATOMIC_RELAXED)
+#endif
+
+// Each thread which is running Prolog is on a list, so that defer_free() can tell when they have all passed a safe point
+struct running_thread
+{
+   unsigned long epoch;          // The value of free_epoch when this thread last passed a safe point
+   struct running_thread* prev;
+   struct running_thread* next;
+};
+extern THREAD_LOCAL struct running_thread this_thread;
+extern unsigned long free_epoch;
+
+void initialize_threads();
+int threads_running();
+void pass_safe_point();
+extern THREAD_LOCAL int running_depth;
+void begin_running();
+void end_running();
+void defer_free(void (*fn)(void*), void* ptr);
+int deferred_free_count();
+void free_memory(void* ptr);
+
+#endif
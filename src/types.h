@@ -26,14 +26,28 @@ typedef struct
 } module;
 typedef module* Module;
 
+struct clause_index;
+struct call_cache;
+
 struct clause
 {
    word* constants;
-   uint8_t* code;
+   word* code;              // One word for each opcode and each operand. See assemble()
    struct clause* next;
    int code_size;
    int constant_size;
    int slot_count;
+   struct clause_index* index; // Only set for the SWITCH_ON_TERM clause at the start of an indexed predicate
+   struct call_cache** call_cache; // One per constant, but only used for the functors of I_CALL and I_DEPART. NULL if there are none
+   // The rest is only used to add and remove the clauses of a dynamic predicate without recompiling it (see add_dynamic_clause())
+   struct clause* prev;
+   struct cell_t* source;   // The cell in predicate->clauses this was compiled from. NULL for the copies in the chains of an index
+   struct clause* original; // For a copy, the clause it was copied from
+   struct clause* copies;   // For a clause, its first copy. For a copy, the next copy of the same clause
+   int index_arg;           // For a copy, the argument of the index whose chain it is in
+   int index_position;      // ... and the position of its key in that index, or -1 if it is in the default chain
+   unsigned long born;      // The clause generation when the clause was added, and when it was retracted (0 if it has not been).
+   unsigned long died;      // Calls only see the clauses which were there when they were made (see clause_visible())
 };
 typedef struct clause clause;
 typedef clause* Clause;
@@ -109,6 +123,7 @@ typedef union
 struct constant
 {
    int type;
+   int arity;               // For a functor, the same as data.functor_data->arity but without having to load the functor
    cdata data;
    int references;
    char marked;
@@ -123,15 +138,18 @@ typedef enum
    Body
 } ChoicepointType;
 
+// relocate_heap() and collect_garbage() take any word on the stack which looks like a reference into the heap to be one, so frames and
+// choicepoints must not have padding in them, which could hold anything. Fields smaller than a word are paired up or widened to fill one
 struct choicepoint
 {
-   unsigned char* PC;
+   word* PC;
    struct frame* FR;
    struct frame* NFR;
    word* SP;
    word* TR;
    word* H;
    ChoicepointType type;
+   int argc;
    struct choicepoint* CP;
    word functor;
    Clause clause;
@@ -140,9 +158,8 @@ struct choicepoint
    struct
    {
       void (*fn)(int, word);
-      int arg;
+      intptr_t arg;
    } foreign_cleanup;
-   int argc;
    word args[0];
 };
 typedef struct choicepoint choicepoint;
@@ -159,12 +176,13 @@ struct frame
 {
    struct frame* parent;
    int depth;
-   Clause clause;
    int is_local;            // If 1 then we must call free_clause() on the clause after we cannot backtrack here again
+   Clause clause;
    Module contextModule;
-   unsigned char* returnPC;
+   word* returnPC;
    Choicepoint choicepoint;
    word functor;
+   unsigned long generation; // The clause generation when the call was made
    word slots[0];
 };
 typedef struct frame frame;
@@ -0,0 +1,45 @@
+% Exercises the compiled arithmetic instructions. Run with ./proscript tests/arith.pl
+
+count(N, N):- !.
+count(I, N):- I1 is I + 1, count(I1, N).
+
+sum([], S, S).
+sum([X|Xs], S0, S):- S1 is S0 + X, sum(Xs, S1, S).
+
+sign_of(X, S):- ( X < 0 -> S = negative ; X =:= 0 -> S = zero ; S = positive ).
+
+error_of(Goal, E):- catch((Goal, E = none), error(E, _), true).
+
+test_values:-
+        X1 is (2 + 3 * 4) - 1, X1 == 13,
+        X2 is -(7) // 2, X2 == -3,
+        X3 is 1.5 + 2, X3 == 3.5,
+        X4 is 2 * 0.25, X4 == 0.5,
+        X5 is max(3, 4) + 1, X5 == 5,
+        A = 10, X6 is A - A * 2, X6 == -10,
+        E = 6 * 7, X7 is E, X7 == 42,
+        X8 is 2.0, X8 == 2.0,
+        13 is X1,
+        \+ 14 is X1,
+        sum([1, 2, 3, 4.5], 0, S), S == 10.5.
+
+test_overflow:-
+        Big is 4611686018427387904 * 4, Big > 4611686018427387904,
+        Big2 is (Big - Big) + 1, Big2 =:= 1,
+        M is 1152921504606846975 + 1152921504606846975, M =:= 2305843009213693950,
+        N is -(-1152921504606846976), N =:= 1152921504606846976.
+
+test_compare:-
+        1 < 2, 2 > 1, 1 =< 1, 1 >= 1, 1 =:= 1.0, 1 =\= 2, \+ 2 < 1,
+        3 + 1 > 2 * 1.5, 2 - 3 =:= -1,
+        sign_of(-3, negative), sign_of(0, zero), sign_of(0.5, positive).
+
+test_errors:-
+        error_of(_ is _ + 1, instantiation_error),
+        error_of(_ is foo + 1, type_error(evaluable, foo/0)),
+        error_of(_ is 1 // 0, zero_divisor),
+        error_of(_ is 1.5 // 2, type_error(integer, 1.5)),
+        error_of(_ < 1, instantiation_error),
+        error_of(a > 1, type_error(evaluable, a/0)).
+
+run_all_tests:- test_values, test_overflow, test_compare, test_errors, count(0, 1000000), !, writeln(arith_ok).
@@ -0,0 +1,156 @@
+% Exercises asserta/1, assertz/1 and retract/1 on indexed dynamic predicates. Run with ./proscript tests/harness.pl tests/assert.pl
+% A list of the clauses is kept alongside the predicate, and every call is checked against it
+
+:-dynamic(p/3).
+:-dynamic(q/1).
+:-dynamic(p/1).
+:-dynamic(u/1).
+
+p(1). p(2). p(3).
+u(1). u(2). u(3).
+
+% The keys the first two arguments are drawn from. Variables are left unbound
+key(0, a).
+key(1, b).
+key(2, f(1)).
+key(3, f(2)).
+key(4, g(x)).
+key(5, 1).
+key(6, 2).
+key(7, _).
+key(8, _).
+key(9, 3).
+
+random(S, S1, R, N):-
+        S1 is (S * 1103515245 + 12345) mod 2147483648,
+        R is (S1 // 65536) mod N.
+
+random_key(S, S1, K):-
+        random(S, S1, R, 10),
+        key(R, K).
+
+% Removes the first clause in the list which unifies with P, as retract/1 does
+delete_first([C|Cs], P, Cs):- \+ C \= P, !.
+delete_first([C|Cs], P, [C|Rest]):- delete_first(Cs, P, Rest).
+
+retract_first(P, Model, Model1):-
+        copy_term(P, Q),
+        ( retract(Q) -> delete_first(Model, P, Model1) ; \+ member(P, Model), Model1 = Model ).
+
+check(Model, P):-
+        findall(Id, (P = p(_, _, Id), call(P)), Got),
+        findall(Id, (member(P, Model), P = p(_, _, Id)), Expected),
+        ( Got == Expected -> true ; writeln(mismatch(P, Got, Expected)), fail ).
+
+% Calls with the second argument bound are repeated so that it gets a just-in-time index
+check_all(S, S1, Model):-
+        random_key(S, S2, K1),
+        random_key(S2, S1, K2),
+        check(Model, p(_, _, _)),
+        check(Model, p(K1, _, _)),
+        check(Model, p(_, K2, _)),
+        check(Model, p(_, K2, _)),
+        check(Model, p(K1, K2, _)).
+
+step(S, S1, Id, Model, Model1, Grow):-
+        random(S, S2, Op, 20),
+        random_key(S2, S3, K1),
+        random_key(S3, S4, K2),
+        ( Op < Grow ->
+            assertz(p(K1, K2, Id)), append(Model, [p(K1, K2, Id)], Model1)
+        ; Op < Grow + 4 ->
+            asserta(p(K1, K2, Id)), Model1 = [p(K1, K2, Id)|Model]
+        ; Op mod 2 =:= 0 ->
+            retract_first(p(K1, _, _), Model, Model1)
+        ; retract_first(p(_, K2, _), Model, Model1)
+        ),
+        check_all(S4, S1, Model1).
+
+steps(_, N, N, Model, _, Model):- !.
+steps(S, I, N, Model, Grow, Model2):-
+        step(S, S1, I, Model, Model1, Grow),
+        I1 is I + 1,
+        steps(S1, I1, N, Model1, Grow, Model2).
+
+test_random:-
+        steps(42, 0, 400, [], 12, Model),
+        length(Model, L), L > 50,
+        steps(7, 400, 1000, Model, 4, _),
+        retract_all_p.
+
+retract_all_p:-
+        retract(p(_, _, _)), !, retract_all_p.
+retract_all_p.
+
+% Clauses which are atoms, and emptying a predicate and filling it again
+test_atoms:-
+        assertz(flag), assertz(flag), asserta(q(1)),
+        retract(flag), flag, retract(flag), \+ catch(flag, _, fail),
+        retract(q(1)), \+ q(_),
+        assertz(q(2)), asserta(q(1)), assertz(q(3)),
+        findall(X, q(X), [1, 2, 3]),
+        retract(q(2)), findall(X, q(X), [1, 3]).
+
+% Clauses can be added while the predicate is running, although only later calls see them
+test_running:-
+        findall(X, (q(X), X < 10, Y is X + 10, assertz(q(Y))), L),
+        L == [1, 3],
+        findall(X, q(X), [1, 3, 11, 13]).
+
+% clause/2 and retract/1 see the clauses as they were when they were called
+test_logical_view:-
+        assertz(r(1)), assertz(r(2)), assertz(r(3)),
+        findall(X, (clause(r(X), true), ( X =:= 1 -> retract(r(2)), retract(r(1)) ; true ), Y is X + 10, assertz(r(Y))), L),
+        L == [1, 2, 3],
+        findall(X, r(X), [3, 11, 12, 13]),
+        findall(X, (retract(r(X)), Y is X + 100, assertz(r(Y))), [3, 11, 12, 13]),
+        findall(X, r(X), [103, 111, 112, 113]),
+        findall(L1, (retract(r(_)), findall(X, r(X), L1)), [[111, 112, 113], [112, 113], [113], []]),
+        assertz(r(1)), assertz(r(2)),
+        catch((clause(r(1), true), retract(r(2)), throw(done)), done, true),
+        findall(X, r(X), [1]).
+
+% So do other calls, however the clauses change while they are running
+test_update_view:-
+        findall(X, (u(X), assertz(u(X))), L),
+        L == [1, 2, 3],
+        findall(X, u(X), [1, 2, 3, 1, 2, 3]),
+        findall(X, (u(X), (X == 1 -> once(retract(u(3))), asserta(u(0)) ; true)), L1),
+        L1 == [1, 2, 3, 1, 2, 3],
+        findall(X, u(X), [0, 0, 1, 2, 1, 2]),
+        ( between(1, 20, I), K is I mod 2, assertz(ui(K, I)), fail ; true ),
+        findall(I, (ui(0, I), (I == 2 -> retract(ui(0, 20)), assertz(ui(0, 22)) ; true)), L2),
+        L2 == [2, 4, 6, 8, 10, 12, 14, 16, 18, 20],
+        findall(I, ui(0, I), [2, 4, 6, 8, 10, 12, 14, 16, 18, 22]).
+
+% A retracted clause is kept while a call which can still see it is running. Enough clauses are retracted in the second
+% query for the retired code to be reclaimed while it is running, and abolish/1 keeps the predicate the same way
+test_retract_running:-
+        findall(X, (p(X), (X == 1 -> retract(p(2)) ; true)), L),
+        L == [1, 2, 3],
+        findall(X, p(X), [1, 3]),
+        ( between(1, 1000, I), assertz(w(I)), fail ; true ),
+        findall(X, (w(X), (X =:= 1 -> forall(between(2, 1000, I), retract(w(I))) ; true)), L1),
+        length(L1, 1000),
+        findall(X, w(X), [1]),
+        assertz(ab(1)), assertz(ab(2)),
+        findall(X, (ab(X), (X == 1 -> abolish(ab/1) ; true)), L2),
+        L2 == [1, 2],
+        \+ catch(ab(_), _, fail).
+
+% Without adding clauses incrementally this takes minutes. retract/1 uses the index to find the clause
+test_many:-
+        ( between(0, 19999, I), assertz(big(I, I)), fail ; true ),
+        \+ ( between(0, 19999, I), \+ big(I, I) ),
+        \+ big(20000, _),
+        \+ ( between(0, 19999, I), \+ retract(big(I, I)) ),
+        \+ big(_, _).
+
+run_all_tests:-
+        run_test(test_random),
+        run_test(test_atoms),
+        run_test(test_running),
+        run_test(test_logical_view),
+        run_test(test_update_view),
+        run_test(test_retract_running),
+        run_test(test_many).
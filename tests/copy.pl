@@ -0,0 +1,39 @@
+% Exercises copy_term/2 and the local copies made by assert/1, recordz/2 and throw/1. Run with ./proscript tests/harness.pl tests/copy.pl
+
+test_sharing:-
+        T = f(X, g(Y, X), [Z, Y|_]),
+        copy_term(T, C),
+        C = f(A, g(B, A1), [D, B1|E]),
+        A == A1, B == B1,
+        var(A), var(B), var(D), var(E),
+        A \== X, B \== Y, D \== Z,
+        \+ A == B, \+ A == D,
+        copy_term(X, V), var(V), V \== X,
+        copy_term(foo, foo).
+
+% Copying used to take time proportional to the square of the number of variables
+test_many_variables:-
+        length(L, 100000),
+        copy_term(L-L, C1-C2),
+        \+ ( member(V, C1), nonvar(V) ),
+        C1 = [a|_], C2 = [A|_], A == a, L = [X|_], var(X),
+        recordz(copy_test, L-L), recorded(copy_test, R1-R2, Ref), erase(Ref),
+        R1 = [b|_], R2 = [B|_], B == b, L = [Y|_], var(Y).
+
+nest(0, T, T):- !.
+nest(N, T, T1):- N1 is N - 1, nest(N1, f(T), T1).
+
+depth(T, N, N):- atom(T), !.
+depth(f(T), N0, N):- N1 is N0 + 1, depth(T, N1, N).
+
+% Terms nested on their first argument used to be copied recursively in C, and too deep a term would overflow the C stack
+test_deep:-
+        nest(1000000, x, T),
+        copy_term(T, C), depth(C, 0, 1000000),
+        recordz(copy_test, T), recorded(copy_test, R, Ref), erase(Ref), depth(R, 0, 1000000),
+        catch(throw(T), E, true), depth(E, 0, 1000000).
+
+run_all_tests:-
+        run_test(test_sharing),
+        run_test(test_many_variables),
+        run_test(test_deep).
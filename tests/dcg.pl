@@ -0,0 +1,83 @@
+% Exercises grammar rules and phrase/2,3. Run with ./proscript tests/harness.pl tests/dcg.pl
+
+greeting --> [hello], name.
+name --> [world].
+name --> [prolog].
+
+digits([D|Ds]) --> digit(D), digits(Ds).
+digits([D]) --> digit(D).
+digit(D) --> [D], { code_type(D, digit) }.
+
+test_terminals:-
+        phrase(greeting, [hello, world]),
+        phrase(greeting, [hello, prolog]),
+        \+ phrase(greeting, [hello]),
+        phrase(greeting, [hello, world, again], [again]),
+        phrase(digits(Ds), "123", Rest), Ds == "123", Rest == [],
+        phrase(([a], [], "bc"), [a, 0'b, 0'c]).
+
+% Pushback puts the terminals back onto the input after the body
+peek(X), [X] --> [X].
+
+test_pushback:-
+        phrase(peek(X), [a, b], Rest),
+        X == a, Rest == [a, b],
+        dcg_translate_rule((p, [x] --> q), (p(S0, S):- q(S0, S1), S = [x|S1])),
+        var(S0).
+
+letter(X) --> [X].
+pair(A, B) --> call(letter, A), call(letter, B).
+
+test_call:-
+        phrase(pair(A, B), [x, y]), A == x, B == y,
+        phrase(call(letter, C), [z]), C == z.
+
+word([C|Cs]) --> [C], { C =\= 32 }, !, word(Cs).
+word([]) --> [].
+
+sign(-1) --> "-", !.
+sign(1) --> "+", !.
+sign(1) --> [].
+
+not_space --> \+ " ".
+
+choice(X) --> ( [a] -> { X = a } ; [b] -> { X = b } ; { X = none } ).
+
+either --> [a] ; [b], [c].
+
+test_control:-
+        phrase(word(W), "ab cd", Rest), W == "ab", Rest == " cd",
+        phrase(sign(S1), "-"), S1 == -1,
+        phrase(sign(S2), ""), S2 == 1,
+        phrase(not_space, "x", R1), R1 == "x",
+        \+ phrase(not_space, " ", _),
+        phrase(choice(X1), [a]), X1 == a,
+        phrase(choice(X2), [b]), X2 == b,
+        phrase(choice(X3), []), X3 == none,
+        phrase(either, [a]),
+        phrase(either, [b, c]),
+        \+ phrase(either, [b]).
+
+% phrase/3 accepts a grammar body rather than just a non-terminal
+test_phrase_body:-
+        phrase((greeting, [!]), [hello, world, !]),
+        phrase(([a] ; [b]), [b]),
+        phrase(({ X = 1 }, [X]), [1]),
+        phrase(user:letter(L), [q]), L == q,
+        catch(phrase(_, []), error(instantiation_error, _), true).
+
+count(N0, N) --> [_], !, { N1 is N0 + 1 }, count(N1, N).
+count(N, N) --> [].
+
+% Without the translation each step of the grammar goes through =.. and append/3
+test_large:-
+        findall(I, between(1, 200000, I), L),
+        phrase(count(0, N), L), N == 200000.
+
+run_all_tests:-
+        run_test(test_terminals),
+        run_test(test_pushback),
+        run_test(test_call),
+        run_test(test_control),
+        run_test(test_phrase_body),
+        run_test(test_large).
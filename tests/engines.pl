@@ -0,0 +1,10 @@
+% Goals for ./proscript --engines, which interleaves them in two engines
+
+first_engine_goal(X):-
+        member(X, [1, 2, 3]).
+
+second_engine_goal(X):-
+        member(X, [a, b]),
+        length(L, 100000),
+        garbage_collect,
+        L = [_|_].
@@ -0,0 +1,43 @@
+% Exercises throw/1 and catch/3. Run with ./proscript tests/harness.pl tests/exception.pl
+
+deep(0, Ball):- !, throw(Ball).
+deep(N, Ball):- N1 is N-1, deep(N1, Ball), true.
+
+% The context of an error is filled in with the predicates between the catcher and the throw, innermost last
+test_backtrace:-
+        catch(deep(2, error(oops, _)), error(oops, Trace), true),
+        Trace == [catch/3, deep/2, deep/2, deep/2],
+        catch(deep(2, error(oops, given)), error(oops, Context), true),
+        Context == given,
+        catch(deep(2, oops), Ball, true),
+        Ball == oops.
+
+% ... but only for as many frames as BACKTRACE_DEPTH
+test_deep_backtrace:-
+        catch(deep(1000, error(oops, _)), error(oops, Trace), true),
+        length(Trace, 64),
+        Trace = [deep/2|_],
+        last(Trace, deep/2).
+
+last([X], X):- !.
+last([_|Xs], X):- last(Xs, X).
+
+% The ball is kept in an area that is reused for each throw, and grown when a ball does not fit
+test_balls:-
+        findall(I-f(I, _), between(1, 1000, I), Big),
+        catch(throw(big(Big)), big(Caught), true),
+        length(Caught, 1000), Caught = [1-f(1, V1)|_], var(V1),
+        catch(throw(small(X, X)), small(A, B), true), A == B, var(A),
+        atom_codes(Atom, "not_interned_before"),
+        catch(catch(throw(one(Atom)), one(Y), throw(two(Y))), two(Z), true),
+        Z == not_interned_before,
+        catch(throw(big(Big)), big(Again), true), length(Again, 1000), last(Again, 1000-f(1000, _)).
+
+test_many:-
+        forall(between(1, 100000, _), catch(deep(20, oops), oops, true)).
+
+run_all_tests:-
+        run_test(test_backtrace),
+        run_test(test_deep_backtrace),
+        run_test(test_balls),
+        run_test(test_many).
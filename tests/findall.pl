@@ -0,0 +1,57 @@
+% Exercises findall/3, findall/4, aggregate_all/3, bagof/3 and setof/3. Run with ./proscript tests/findall.pl
+
+p(1). p(2). p(3).
+q(X, f(X, Y, Y, _)).
+
+test_findall:-
+        findall(X, p(X), [1, 2, 3]),
+        findall(X, fail, []),
+        findall(X, p(X), L1, [t]), L1 == [1, 2, 3, t],
+        findall(X, Y^p(X), [1, 2, 3]),
+        % Variables are shared within a solution but not between them
+        findall(X-Y, (p(X), q(X, Y)), [1-f(1, A, A, B), 2-f(2, C, C, _), 3-_]),
+        A \== B, A \== C,
+        findall(X, member(X, [abc, 1.5, 100000000000000000000000, f(_)]), [abc, 1.5, 100000000000000000000000, f(_)]).
+
+test_nested:-
+        findall(L, (p(X), findall(Y, (p(Y), Y =< X), L)), [[1], [1, 2], [1, 2, 3]]).
+
+test_exceptions:-
+        catch(findall(X, (p(X), X > 1, throw(oops)), _), E1, true), E1 == oops,
+        catch(findall(_, _, _), error(E2, _), true), E2 == instantiation_error,
+        % A goal containing a database reference can be called
+        recorda(findall_test, x, Ref), G = erase(Ref), call(G).
+
+long_list(0, []):- !.
+long_list(N, [N|T]):- N1 is N - 1, long_list(N1, T).
+
+% Big enough that collecting the results has to grow the heap
+test_large:-
+        findall(X-f(X), between(1, 300000, X), L), length(L, 300000),
+        long_list(5000, L0), findall(L0, p(_), [L2, _, _]), L2 == L0.
+
+test_aggregate:-
+        aggregate_all(count, p(_), 3), aggregate_all(count, fail, 0),
+        aggregate_all(sum(X), p(X), 6), aggregate_all(sum(X), fail, 0),
+        aggregate_all(sum(X), member(X, [1, 2.5]), S), S =:= 3.5,
+        aggregate_all(max(X), p(X), 3), aggregate_all(min(X*2), p(X), 2),
+        \+ aggregate_all(max(X), fail, _),
+        aggregate_all(bag(X), p(X), [1, 2, 3]),
+        catch(aggregate_all(sum(X), member(X, [1, a]), _), error(E, _), true), E = type_error(_, _).
+
+age(peter, 7). age(ann, 11). age(pat, 8). age(tom, 5). age(mike, 11).
+r(1, f(_)). r(2, f(_)). r(3, g(_)). r(1, f(_)).
+
+test_bagof:-
+        findall(A-L, bagof(N, age(N, A), L), [5-[tom], 7-[peter], 8-[pat], 11-[ann, mike]]),
+        findall(A-L, setof(N, age(N, A), L), [5-[tom], 7-[peter], 8-[pat], 11-[ann, mike]]),
+        \+ bagof(_, fail, _),
+        bagof(N, A^age(N, A), [peter, ann, pat, tom, mike]),
+        setof(A-N, age(N, A), [5-tom|_]),
+        % Solutions whose witnesses are variants are grouped together
+        findall(W-L, bagof(X, r(X, W), L), [f(_)-[1, 2, 1], g(_)-[3]]),
+        findall(W-L, setof(X, r(X, W), L), [f(_)-[1, 2], g(_)-[3]]),
+        % Many groups
+        findall(K, bagof(V, (between(1, 20000, V), K is V mod 1000), _), Ks), length(Ks, 1000).
+
+run_all_tests:- test_findall, test_nested, test_exceptions, test_large, test_aggregate, test_bagof, !, writeln(findall_ok).
@@ -0,0 +1,6 @@
+% The helpers shared by the test files which run a list of tests. Load it along with the test file, for example
+% ./proscript tests/harness.pl tests/assert.pl. make check runs every test file this way
+
+% Runs one test, reporting whether it passed. An error counts as failing
+run_test(Test):-
+        ( catch(Test, E, (writeln(Test-E), fail)) -> writeln(passed(Test)) ; writeln(failed(Test)), fail ).
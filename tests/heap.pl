@@ -0,0 +1,51 @@
+% Exercises growth and garbage collection of the global stack. Run with ./proscript tests/heap.pl
+
+make_list(0, []):- !.
+make_list(N, [f(N, _)|T]):- N1 is N - 1, make_list(N1, T).
+
+check_list([], 0).
+check_list([f(N, X)|T], N):- X = N, N1 is N - 1, check_list(T, N1).
+
+grow_with_choicepoints(N, L):- make_list(N, L).
+grow_with_choicepoints(_, done).
+
+% Each iteration leaves a few hundred cells of garbage on the heap
+garbage_loop(0):- !.
+garbage_loop(N):-
+        length(L, 50),
+        copy_term(f(L, L), _),
+        N1 is N - 1,
+        garbage_loop(N1).
+
+test_growth:-
+        make_list(20000, L),
+        check_list(L, 20000),
+        grow_with_choicepoints(20000, L2),
+        length(L2, 20000),
+        findall(X, (member(X, [a, b, c]), make_list(10000, _)), Xs),
+        Xs == [a, b, c],
+        catch((make_list(10000, Big), throw(big(Big))), big(B), true),
+        length(B, 10000).
+
+% Everything test_growth built is garbage by now
+test_gc:-
+        garbage_loop(400),
+        garbage_collect,
+        '$heap_usage'(Bytes),
+        Bytes < 100000.
+
+% With a threshold of 1% the heap would have to be 200 times the size of the live data to stay under it
+test_low_threshold:-
+        set_prolog_flag(gc_threshold, 1),
+        make_list(1000000, L),
+        check_list(L, 1000000),
+        garbage_loop(400),
+        set_prolog_flag(gc_threshold, 50).
+
+run_all_tests:-
+        test_growth,
+        !,
+        test_gc,
+        test_low_threshold,
+        !,
+        writeln(heap_ok).
@@ -0,0 +1,60 @@
+% Exercises first-argument indexing. Run with ./proscript tests/index.pl
+
+colour(red, 1).
+colour(green, 2).
+colour(blue, 3).
+colour(f(x), 4).
+colour(X, 5):- X == any.
+colour(1, 6).
+colour(2.5, 7).
+colour([_|_], 8).
+colour(red, 9).
+colour(g(_, _), 10).
+
+app([], L, L).
+app([H|T], L, [H|R]):- app(T, L, R).
+
+% More keys than fit in the linear part of the index
+digit(0, zero). digit(1, one). digit(2, two). digit(3, three). digit(4, four).
+digit(5, five). digit(6, six). digit(7, seven). digit(8, eight). digit(9, nine).
+digit(ten, 10). digit(f(_), compound).
+
+:- dynamic(row/3).
+
+fill(N, N):- !.
+fill(I, N):- K is I mod 3, assertz(row(I, K, I)), I1 is I + 1, fill(I1, N).
+
+% Looking rows up by the third argument often enough builds an index on it
+lookup_rows(0):- !.
+lookup_rows(N):- row(I, _, N), I == N, N1 is N - 1, lookup_rows(N1).
+
+det(Goal):- setup_call_cleanup(true, Goal, Det = true), Det == true.
+
+test_index:-
+        findall(K-V, colour(K, V), All), length(All, 9),
+        findall(V, colour(red, V), [1, 9]),
+        findall(V, colour(green, V), [2]),
+        findall(V, colour(any, V), [5]),
+        findall(V, colour(f(x), V), [4]),
+        findall(V, colour(f(y), V), []),
+        findall(V, colour([a], V), [8]),
+        findall(V, colour(g(a, b), V), [10]),
+        findall(V, colour(1, V), [6]),
+        findall(V, colour(2.5, V), [7]),
+        findall(V, colour(nothing, V), []),
+        det(app([a, b], [c], _)),
+        app(X, Y, [a, b]), X == [a], Y == [b], !,
+        det(digit(7, _)),
+        digit(9, nine), digit(ten, T), T == 10, digit(f(z), C), C == compound,
+        \+ digit(11, _),
+        findall(D, digit(D, _), Ds), length(Ds, 12).
+
+test_jit_index:-
+        fill(0, 40),
+        lookup_rows(39),
+        findall(I, row(I, 1, _), Ones), length(Ones, 13),
+        retract(row(7, _, _)), \+ row(_, _, 7),
+        assertz(row(x, y, 7)), row(X, _, 7), X == x,
+        det(row(_, _, 8)).
+
+run_all_tests:- test_index, test_jit_index, !, writeln(index_ok).
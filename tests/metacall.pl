@@ -0,0 +1,60 @@
+% Exercises call/1 on goals of the same shape with different arguments. Run with ./proscript tests/harness.pl tests/metacall.pl
+
+p(1). p(2). p(3).
+
+q(X, Y):- Y is X * 10.
+
+% Goals of the same shape share a compiled clause, so the arguments must not leak from one call into the next
+test_arguments:-
+        G1 = q(1, A), call(G1), A == 10,
+        G2 = q(2, B), call(G2), B == 20,
+        G3 = q(X, X), \+ catch(call(G3), _, fail),
+        call(q(3, 30)),
+        \+ call(q(3, 31)),
+        findall(Y, ( member(X1, [1, 2, 3]), call((q(X1, Y), Y > 10)) ), [20, 30]),
+        call((A1 = f(B1), B1 = a)), A1 == f(a).
+
+% Cuts inside call/1 are local to it, whatever the shape was compiled from
+test_control:-
+        findall(X, call((p(X), !)), [1]),
+        findall(X, ( call((p(X), ! ; X = 4)) ), [1]),
+        findall(X, call(( p(X), X > 1 -> true ; X = none )), [2]),
+        findall(X, call(( p(X), X > 5 -> true ; X = none )), [none]),
+        findall(X, call((p(X), \+ X = 2)), [1, 3]),
+        C = !, findall(X, call((p(X), C)), [1]),
+        C1 = true, findall(X, call((p(X), C1)), [1, 2, 3]).
+
+% A variable inside a control construct is called when the goal runs
+test_variables:-
+        G = (p(X), Y), Y = (X > 2), findall(X, call(G), [3]),
+        catch(call((true, _)), error(instantiation_error, _), true),
+        catch(call(_), error(instantiation_error, _), true),
+        catch(call((true, 1)), error(type_error(callable, _), _), true),
+        catch(call((fail, 1)), error(type_error(callable, _), _), true).
+
+test_modules:-
+        call(user:p(1)),
+        M = user, call(M:q(2, Y)), Y == 20,
+        call((user:p(X), user:q(X, Z))), Z == 10.
+
+% A goal which is just a call of a predicate is called directly, without compiling anything
+test_direct:-
+        call(p(2)), \+ call(p(4)),
+        call(user:q(4, A)), A == 40,
+        call(q, 5, B), B == 50,
+        findall(X, call(p, X), [1, 2, 3]),
+        catch(call(no_such_predicate(1)), error(existence_error(procedure, no_such_predicate/1), _), true),
+        catch(call(user:no_such_predicate), error(existence_error(procedure, no_such_predicate/0), _), true),
+        catch(call(user:_), error(instantiation_error, _), true).
+
+% Every call used to compile the goal again
+test_many:-
+        forall(between(1, 100000, I), call((q(I, Y), Y > I))).
+
+run_all_tests:-
+        run_test(test_arguments),
+        run_test(test_control),
+        run_test(test_variables),
+        run_test(test_modules),
+        run_test(test_direct),
+        run_test(test_many).
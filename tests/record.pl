@@ -0,0 +1,50 @@
+% Exercises recorda/3, recordz/3, recorded/3 and erase/1. Run with ./proscript tests/harness.pl tests/record.pl
+
+test_order:-
+        recordz(order, b), recordz(order, c), recorda(order, a),
+        findall(X, recorded(order, X), [a, b, c]),
+        recorded(order, b, Ref), erase(Ref),
+        findall(X, recorded(order, X), [a, c]),
+        \+ erase(Ref),
+        \+ recorded(_, _, Ref),
+        forall(recorded(order, _, R), erase(R)),
+        \+ recorded(order, _).
+
+% Records erased or added while recorded/3 is part way through are neither seen nor lost
+test_cursor:-
+        forall(between(1, 5, I), recordz(cursor, I, _)),
+        findall(X, ( recorded(cursor, X, Ref),
+                     erase(Ref),
+                     ( X =:= 2 -> recorded(cursor, 3, Ref3), erase(Ref3) ; true ),
+                     Y is X + 10, recordz(cursor, Y) ), L),
+        L == [1, 2, 4, 5],
+        findall(X, recorded(cursor, X), [11, 12, 14, 15]),
+        catch(( recorded(cursor, _, R), erase(R), throw(done) ), done, true),
+        findall(X, recorded(cursor, X), [12, 14, 15]).
+
+% Once there are enough records, those with a bound first argument are found through a hash table. Records with a variable first
+% argument match any key, and the order is kept
+test_hashed:-
+        forall(between(1, 1000, I), ( K is I mod 10, recordz(hashed, f(K, I)) )),
+        recorda(hashed, f(_, first)), recordz(hashed, f(_, last)), recordz(hashed, g),
+        findall(I, recorded(hashed, f(3, I)), L),
+        length(L, 102), L = [first, 3, 13|_], last(L, last),
+        findall(I, recorded(hashed, f(x, I)), [first, last]),
+        recorded(hashed, f(3, 13), Ref), erase(Ref),
+        findall(I, recorded(hashed, f(3, I)), [first, 3, 23|_]),
+        recorded(hashed, g, _).
+
+last([X], X):- !.
+last([_|Xs], X):- last(Xs, X).
+
+% Erasing records as they are found used to take time proportional to the square of the number of records
+test_many:-
+        forall(between(1, 20000, I), recordz(many, I)),
+        forall(recorded(many, _, Ref), erase(Ref)),
+        \+ recorded(many, _).
+
+run_all_tests:-
+        run_test(test_order),
+        run_test(test_cursor),
+        run_test(test_hashed),
+        run_test(test_many).
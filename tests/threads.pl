@@ -0,0 +1,41 @@
+% Goals for ./proscript --threads, which runs many copies of thread_work/2 at once in a thread pool
+
+:-dynamic(counter/2).
+
+thread_work(N, R):-
+        number_codes(N, Codes),
+        atom_codes(Suffix, Codes),
+        atom_concat(task_, Suffix, Key),
+        assertz(counter(Key, 0)),
+        count(Key, 100),
+        retract(counter(Key, R)),
+        churn(Key, 100),
+        bench(300).
+
+count(_, 0):- !.
+count(Key, I):-
+        retract(counter(Key, C)),
+        C1 is C + 1,
+        assertz(counter(Key, C1)),
+        I1 is I - 1,
+        count(Key, I1).
+
+% Erased records are freed with defer_free(), which must not wait for the whole pool to be idle
+churn(_, 0):- !.
+churn(Key, I):-
+        recordz(Key, I, Ref),
+        erase(Ref),
+        I1 is I - 1,
+        churn(Key, I1).
+
+app([], L, L).
+app([H|T], L, [H|R]):- app(T, L, R).
+
+nrev([], []).
+nrev([H|T], R):- nrev(T, RT), app(RT, [H], R).
+
+range(N, N, [N]):- !.
+range(I, N, [I|T]):- I1 is I + 1, range(I1, N, T).
+
+bench(0):- !.
+bench(K):- range(1, 30, L), nrev(L, _), K1 is K - 1, bench(K1).
@@ -0,0 +1,42 @@
+% Exercises conditional trailing and trail tidying on cut. Run with ./proscript tests/trail.pl
+
+q. q.
+
+bind_after_cut(X):- q, !, X = bound.
+bind_before_cut(X):- q, X = bound, !.
+
+% Bindings of variables older than a choicepoint must still be undone when we backtrack to it, even if they were made (or trailed)
+% under a choicepoint that has since been cut
+test_undo:-
+        ( member(Y, [1, 2]), var(X), bind_after_cut(X), Y == 2 -> true ; fail ),
+        ( member(Z, [1, 2]), var(W), bind_before_cut(W), Z == 2 -> true ; fail ),
+        ( member(V, [1, 2]), T = f(U), U = V, T == f(2) -> true ; fail ),
+        \+ \+ (A = 1, A == 1), var(A).
+
+% A head that fails part of the way through must undo the bindings it has made before the next clause is tried, even though the
+% choicepoint for that clause is only made once a head has matched
+r(f(a, b), first).
+r(f(_, c), second).
+r(g(X, X), third).
+r(g(_, _), fourth).
+
+test_shallow:-
+        T = f(Y, c), r(T, W), W == second, var(Y),
+        r(g(P, Q), third), P == Q, var(P),
+        r(g(1, 2), Z), Z == fourth,
+        findall(N-V, r(g(V, 3), N), [third-3, fourth-_]),
+        findall(N, r(_, N), [first, second, third, fourth]).
+
+% Builds a list by binding one new variable per element. Every binding would be trailed if trailing were unconditional, which is
+% far more than fits in the trail
+long_list(0, []):- !.
+long_list(N, [N|T]):- N1 is N - 1, long_list(N1, T).
+
+last_of([X], X):- !.
+last_of([_|T], X):- last_of(T, X).
+
+test_deterministic:-
+        long_list(500000, L),
+        last_of(L, X), X == 1.
+
+run_all_tests:- test_undo, test_shallow, test_deterministic, !, writeln(trail_ok).
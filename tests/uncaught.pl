@@ -0,0 +1,7 @@
+% An error which no catch/3 is waiting for must reach the top level cleanly, even when it is raised
+% half way through an inline arithmetic instruction. Run with ./proscript tests/uncaught.pl; it should
+% report the type_error and exit rather than abort.
+
+run_all_tests:-
+        X is foo + 1,
+        writeln(X).
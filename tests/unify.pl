@@ -0,0 +1,33 @@
+% Exercises unification of long lists and deeply nested terms. Run with ./proscript tests/harness.pl tests/unify.pl
+
+nest(0, T, T):- !.
+nest(N, T, T1):- N1 is N - 1, nest(N1, f(T, N), T1).
+
+fill([]).
+fill([a|T]):- fill(T).
+
+% Unification used to recurse in C on every argument, so these would overflow the C stack
+test_long_list:-
+        length(L1, 1000000), length(L2, 1000000), fill(L2),
+        L1 = L2, L1 = [a, a|_],
+        length(L3, 1000000), fill(L3), L1 = L3,
+        length(L4, 999999), fill(L4), append(L4, [b], L5), \+ L1 = L5.
+
+test_deep:-
+        nest(1000000, X, T1), nest(1000000, a, T2),
+        T1 = T2, X == a,
+        nest(1000000, Y, T3), nest(1000000, b, T4),
+        \+ T2 = T4,
+        T3 = T4, Y == b.
+
+% Arguments are still unified from left to right, so a clash in the first argument is found without looking at the rest
+test_order:-
+        length(L, 1000000),
+        \+ f(a, L) = f(b, _),
+        f(X, g(Y, X), [Y|Z]) = f(1, g(2, W), [V, 3]),
+        X == 1, Y == 2, W == 1, V == 2, Z == [3].
+
+run_all_tests:-
+        run_test(test_long_list),
+        run_test(test_deep),
+        run_test(test_order).